@@ -0,0 +1,407 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/*
+ * Benchmark suite of libfs. Formats a fresh virtual disk with fs_format.x, in
+ * any of the layouts it supports, runs a fixed set of
+ * workloads on it and prints, for each of them, the throughput and the
+ * latency percentiles of its operations as JSON, so that runs can be compared
+ * over time. The disk is a file of the host, so the data usually comes from
+ * the page cache: the numbers measure libfs rather than the host's disk.
+ */
+
+#define BLOCK_SIZE 4096
+#define FORMAT_PROGRAM "fs_format.x"
+#define CHUNK_SIZE (1024 * 1024)
+#define RANDOM_READ_SIZE 4096
+#define APPEND_SIZE 64
+#define DEFAULT_FILE_MB 64
+#define DEFAULT_OPS 100000
+
+#define die(...)			\
+do {					\
+	fprintf(stderr, __VA_ARGS__);	\
+	fprintf(stderr, "\n");		\
+	exit(1);			\
+} while (0)
+
+#define die_perror(msg)			\
+do {					\
+	perror(msg);			\
+	exit(1);			\
+} while (0)
+
+/* Layout of the disk, as given to fs_format.x */
+struct format_options {
+	size_t block_size;
+	size_t fat_bits;
+	size_t journal_blocks;
+	int extents;
+};
+
+/* Latencies of the operations of a workload, in nanoseconds */
+struct samples {
+	double *ns;
+	size_t count;
+	size_t max;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Format the disk by running fs_format.x, taken from the directory of this
+ * program (or else from the PATH). Its report goes to stderr, away from the
+ * JSON.
+ */
+static void format(const char *program, const char *diskname,
+		   const struct format_options *opts, size_t data_blocks)
+{
+	char path[4096], bsize[32], bits[32], blocks[32], journal[32];
+	const char *args[12];
+	const char *slash = strrchr(program, '/');
+	int n = 0, status;
+	pid_t pid;
+
+	if (slash)
+		snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - program),
+			 program, FORMAT_PROGRAM);
+	else
+		snprintf(path, sizeof(path), "%s", FORMAT_PROGRAM);
+	snprintf(bsize, sizeof(bsize), "%zu", opts->block_size);
+	snprintf(bits, sizeof(bits), "%zu", opts->fat_bits);
+	snprintf(blocks, sizeof(blocks), "%zu", data_blocks);
+	snprintf(journal, sizeof(journal), "%zu", opts->journal_blocks);
+
+	args[n++] = path;
+	args[n++] = "-b";
+	args[n++] = bsize;
+	args[n++] = "-w";
+	args[n++] = bits;
+	if (opts->extents)
+		args[n++] = "-e";
+	args[n++] = diskname;
+	args[n++] = blocks;
+	args[n++] = journal;
+	args[n] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		die_perror("fork");
+	if (pid == 0) {
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		if (slash)
+			execv(path, (char **)args);
+		else
+			execvp(path, (char **)args);
+		die_perror(path);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		die_perror("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		die("Cannot format %s", diskname);
+}
+
+static void samples_init(struct samples *s, size_t max)
+{
+	s->ns = malloc(max * sizeof(double));
+	if (!s->ns)
+		die_perror("malloc");
+	s->count = 0;
+	s->max = max;
+}
+
+static void samples_add(struct samples *s, double ns)
+{
+	if (s->count < s->max)
+		s->ns[s->count++] = ns;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Latency below which the given fraction of the operations completed */
+static double percentile(struct samples *s, double fraction)
+{
+	size_t i = fraction * s->count;
+
+	if (s->count == 0)
+		return 0;
+	if (i >= s->count)
+		i = s->count - 1;
+	return s->ns[i];
+}
+
+/* Print the results of a workload as a JSON object, then release them */
+static void report(const char *name, struct samples *s, size_t bytes,
+		   double seconds, int last)
+{
+	qsort(s->ns, s->count, sizeof(double), cmp_double);
+	printf("    {\n");
+	printf("      \"name\": \"%s\",\n", name);
+	printf("      \"ops\": %zu,\n", s->count);
+	printf("      \"bytes\": %zu,\n", bytes);
+	printf("      \"seconds\": %.6f,\n", seconds);
+	printf("      \"ops_per_s\": %.1f,\n", s->count / seconds);
+	printf("      \"mb_per_s\": %.1f,\n", bytes / seconds / (1024 * 1024));
+	printf("      \"latency_ns\": {\"p50\": %.0f, \"p90\": %.0f, "
+	       "\"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}\n",
+	       percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99),
+	       percentile(s, 0.999), s->count ? s->ns[s->count - 1] : 0);
+	printf("    }%s\n", last ? "" : ",");
+	free(s->ns);
+}
+
+static int open_file(const char *name)
+{
+	int fs_fd = fs_open(name);
+
+	if (fs_fd < 0)
+		die("Cannot open file %s", name);
+	return fs_fd;
+}
+
+/* Write then read back a whole file, one chunk per call */
+static void bench_sequential(size_t file_size, char *buf)
+{
+	struct samples s;
+	size_t off;
+	double start, t;
+	int fs_fd;
+
+	if (fs_create("seq"))
+		die("Cannot create file seq");
+	fs_fd = open_file("seq");
+
+	samples_init(&s, file_size / CHUNK_SIZE + 1);
+	start = now_ns();
+	for (off = 0; off < file_size; off += CHUNK_SIZE) {
+		memset(buf, off / CHUNK_SIZE, CHUNK_SIZE);
+		t = now_ns();
+		if (fs_write(fs_fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+			die("Short write at offset %zu", off);
+		samples_add(&s, now_ns() - t);
+	}
+	if (fs_fsync(fs_fd))
+		die("Cannot sync file seq");
+	report("seq_write", &s, file_size, (now_ns() - start) / 1e9, 0);
+
+	samples_init(&s, file_size / CHUNK_SIZE + 1);
+	fs_lseek(fs_fd, 0);
+	start = now_ns();
+	for (off = 0; off < file_size; off += CHUNK_SIZE) {
+		t = now_ns();
+		if (fs_read(fs_fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+			die("Short read at offset %zu", off);
+		samples_add(&s, now_ns() - t);
+		if ((uint8_t)buf[CHUNK_SIZE - 1] != (uint8_t)(off / CHUNK_SIZE))
+			die("Wrong data at offset %zu", off);
+	}
+	report("seq_read", &s, file_size, (now_ns() - start) / 1e9, 0);
+	fs_close(fs_fd);
+}
+
+/* Read aligned blocks at random offsets of the file written above */
+static void bench_random_read(size_t file_size, size_t ops, char *buf)
+{
+	struct samples s;
+	size_t i, off, blocks = file_size / RANDOM_READ_SIZE;
+	double start, t;
+	int fs_fd = open_file("seq");
+
+	srand(1);
+	samples_init(&s, ops);
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		off = (size_t)rand() % blocks * RANDOM_READ_SIZE;
+		t = now_ns();
+		if (fs_lseek(fs_fd, off) ||
+		    fs_read(fs_fd, buf, RANDOM_READ_SIZE) != RANDOM_READ_SIZE)
+			die("Cannot read at offset %zu", off);
+		samples_add(&s, now_ns() - t);
+	}
+	report("rand_read_4k", &s, ops * RANDOM_READ_SIZE,
+	       (now_ns() - start) / 1e9, 0);
+	fs_close(fs_fd);
+	fs_delete("seq");
+}
+
+/* Small writes at the end of a growing file */
+static void bench_append(size_t ops, char *buf)
+{
+	struct samples s;
+	size_t i;
+	double start, t;
+	int fs_fd;
+
+	if (fs_create("log"))
+		die("Cannot create file log");
+	fs_fd = open_file("log");
+	memset(buf, 'a', APPEND_SIZE);
+	samples_init(&s, ops);
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		t = now_ns();
+		if (fs_write(fs_fd, buf, APPEND_SIZE) != APPEND_SIZE)
+			die("Short append %zu", i);
+		samples_add(&s, now_ns() - t);
+	}
+	if (fs_fsync(fs_fd))
+		die("Cannot sync file log");
+	report("append_64", &s, ops * APPEND_SIZE, (now_ns() - start) / 1e9, 0);
+	fs_close(fs_fd);
+	fs_delete("log");
+}
+
+/* Create and delete files, one pair of calls per operation */
+static void bench_churn(size_t ops)
+{
+	struct samples s;
+	char name[FS_FILENAME_LEN];
+	size_t i;
+	double start, t;
+
+	samples_init(&s, ops);
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		snprintf(name, sizeof(name), "churn_%zu", i % 64);
+		t = now_ns();
+		if (fs_create(name) || fs_delete(name))
+			die("Cannot create and delete file %s", name);
+		samples_add(&s, now_ns() - t);
+	}
+	report("create_delete", &s, 0, (now_ns() - start) / 1e9, 0);
+}
+
+/* Open, stat and close a file, one triple of calls per operation */
+static void bench_open_stat_close(size_t ops)
+{
+	struct samples s;
+	size_t i;
+	double start, t;
+	int fs_fd;
+
+	if (fs_create("meta"))
+		die("Cannot create file meta");
+	samples_init(&s, ops);
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		t = now_ns();
+		fs_fd = fs_open("meta");
+		if (fs_fd < 0 || fs_stat(fs_fd) != 0 || fs_close(fs_fd))
+			die("Cannot open, stat and close file meta");
+		samples_add(&s, now_ns() - t);
+	}
+	report("open_stat_close", &s, 0, (now_ns() - start) / 1e9, 1);
+	fs_delete("meta");
+}
+
+static void usage(char *program)
+{
+	die("Usage: %s [-s <file size in MiB>] [-n <operations>] "
+	    "[-b <block size>] [-w <16|32>] [-e] [-j <journal block count>] "
+	    "<diskname>\n"
+	    "Formats <diskname> (its content is lost) with fs_format.x, with\n"
+	    "the given block size, FAT entry width, extents and journal (none\n"
+	    "by default), then measures sequential\n"
+	    "writes and reads of a file of the given size (%d MiB by default),\n"
+	    "random 4 KiB reads, 64-byte appends, create/delete churn and\n"
+	    "open/stat/close loops, with the given number of operations (%d\n"
+	    "by default) for the last four. Results are printed as JSON.",
+	    program, DEFAULT_FILE_MB, DEFAULT_OPS);
+}
+
+int main(int argc, char **argv)
+{
+	struct format_options opts = { .block_size = BLOCK_SIZE, .fat_bits = 16 };
+	size_t file_mb = DEFAULT_FILE_MB, ops = DEFAULT_OPS, file_size;
+	size_t data_blocks;
+	char *buf, *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:n:b:w:ej:")) != -1) {
+		switch (opt) {
+		case 's':
+			file_mb = strtoul(optarg, &end, 0);
+			if (*end || file_mb == 0)
+				die("Invalid file size '%s'", optarg);
+			break;
+		case 'n':
+			ops = strtoul(optarg, &end, 0);
+			if (*end || ops == 0)
+				die("Invalid number of operations '%s'",
+				    optarg);
+			break;
+		case 'b':
+			opts.block_size = strtoul(optarg, &end, 0);
+			if (*end || opts.block_size == 0)
+				die("Invalid block size '%s'", optarg);
+			break;
+		case 'w':
+			opts.fat_bits = strtoul(optarg, &end, 0);
+			if (*end)
+				die("Invalid FAT entry width '%s'", optarg);
+			break;
+		case 'e':
+			opts.extents = 1;
+			break;
+		case 'j':
+			opts.journal_blocks = strtoul(optarg, &end, 0);
+			if (*end)
+				die("Invalid journal block count '%s'", optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	/* Room for the file, plus the appends and some slack */
+	file_size = file_mb * 1024 * 1024;
+	data_blocks = (file_size + ops * APPEND_SIZE) / opts.block_size + 64;
+	format(argv[0], argv[optind], &opts, data_blocks);
+
+	buf = malloc(CHUNK_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	if (fs_mount(argv[optind]))
+		die("Cannot mount %s", argv[optind]);
+
+	printf("{\n");
+	printf("  \"disk\": {\"data_blocks\": %zu, \"block_size\": %zu, "
+	       "\"fat_bits\": %zu, \"extents\": %s, "
+	       "\"journal_blocks\": %zu},\n",
+	       data_blocks, opts.block_size, opts.fat_bits,
+	       opts.extents ? "true" : "false", opts.journal_blocks);
+	printf("  \"file_size\": %zu,\n", file_size);
+	printf("  \"workloads\": [\n");
+	bench_sequential(file_size, buf);
+	bench_random_read(file_size, ops, buf);
+	bench_append(ops, buf);
+	bench_churn(ops);
+	bench_open_stat_close(ops);
+	printf("  ]\n");
+	printf("}\n");
+
+	if (fs_umount())
+		die("Cannot unmount %s", argv[optind]);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * Virtual disk formatter. By default, produces the same layout as fs_make.x,
+ * and can also reserve a metadata journal between the root directory and the
+ * data blocks. Larger blocks, 32-bit FAT entries or extent-based files select
+ * the extended layout of the superblock, which fs_make.x does not know about.
+ *
+ * A fresh disk is almost all zeros: only the superblock, the first FAT entry
+ * and the journal header are written, and the rest of the disk file is left as
+ * a hole, so that formatting takes the same time whatever the size of the
+ * disk. That is one pwrite() of blocks 0 and 1, plus one of the journal header
+ * block if there is a journal. With -a, the disk's space is allocated up front
+ * instead.
+ */
+
+#define BLOCK_SIZE 4096
+#define BLOCK_SIZE_MAX 65536
+#define FAT16_EOC 0xFFFF
+#define FAT32_EOC 0xFFFFFFFF
+#define MAX_LEGACY_BLOCKS 0xFFFF
+#define MAX_EXTENDED_BLOCKS 0x7FFFFFFF
+#define SUPER_EXTENDED 1
+#define LAYOUT_EXTENTS 1
+#define FILE_MAX_COUNT 128
+
+#define die(...)			\
+do {					\
+	fprintf(stderr, __VA_ARGS__);	\
+	fprintf(stderr, "\n");		\
+	exit(1);			\
+} while (0)
+
+struct __attribute__ ((packed)) super_block {
+	uint8_t signature[8];
+	uint16_t disk_blocks;
+	uint16_t root_index;
+	uint16_t dblock_index;
+	uint16_t num_blocks;
+	uint8_t block_fat;
+	uint8_t version;
+	uint32_t block_size;
+	uint8_t fat_bits;
+	uint32_t disk_blocks32;
+	uint32_t root_index32;
+	uint32_t dblock_index32;
+	uint32_t num_blocks32;
+	uint32_t block_fat32;
+	uint8_t layout;
+	uint8_t padding[4052];
+};
+
+struct __attribute__ ((packed)) journal_header {
+	uint8_t signature[8];
+	uint32_t num_blocks;
+	uint32_t checksum;
+};
+
+static size_t block_size = BLOCK_SIZE;
+
+static void write_blocks(int fd, size_t block, const void *buf,
+			 size_t nblocks)
+{
+	if (pwrite(fd, buf, nblocks * block_size, (off_t)block * block_size)
+	    != (ssize_t)(nblocks * block_size)) {
+		perror("pwrite");
+		exit(1);
+	}
+}
+
+static void usage(char *program)
+{
+	die("Usage: %s [-b <block size>] [-w <16|32>] [-e] [-a] <diskname> "
+	    "<data block count> [<journal block count>]\n"
+	    "The block size is a power of two from 4096 to 65536 bytes, and\n"
+	    "FAT entries are 16 bits wide unless -w 32 is given. With -e,\n"
+	    "files are lists of extents instead of FAT chains. With -a, the\n"
+	    "disk file is allocated on the host instead of being sparse.\n"
+	    "The journal defaults to the smallest one that can hold every FAT\n"
+	    "block, the root directory and, with -e, every extent block; a\n"
+	    "count of 0 leaves it out.",
+	    program);
+}
+
+int main(int argc, char **argv)
+{
+	struct super_block super;
+	struct journal_header *header;
+	uint8_t *block;
+	size_t data_blocks, fat_blocks, journal_blocks, disk_blocks, meta_blocks;
+	size_t fat_bits = 16, max_data, max_logged;
+	char *end;
+	int fd, opt, extended, extents = 0, allocate = 0;
+
+	while ((opt = getopt(argc, argv, "b:w:ea")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, &end, 0);
+			if (*end || block_size < BLOCK_SIZE ||
+			    block_size > BLOCK_SIZE_MAX ||
+			    (block_size & (block_size - 1)))
+				die("Invalid block size '%s'", optarg);
+			break;
+		case 'w':
+			fat_bits = strtoul(optarg, &end, 0);
+			if (*end || (fat_bits != 16 && fat_bits != 32))
+				die("Invalid FAT entry width '%s'", optarg);
+			break;
+		case 'e':
+			extents = 1;
+			break;
+		case 'a':
+			allocate = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 3 || argc > 4)
+		usage(argv[0]);
+	extended = block_size != BLOCK_SIZE || fat_bits != 16 || extents;
+
+	data_blocks = strtoul(argv[2], &end, 0);
+	max_data = (fat_bits == 16) ? FAT16_EOC : MAX_EXTENDED_BLOCKS;
+	if (*end || data_blocks == 0 || data_blocks >= max_data)
+		die("Invalid data block count '%s'", argv[2]);
+	fat_blocks = (data_blocks + block_size * 8 / fat_bits - 1)
+		     / (block_size * 8 / fat_bits);
+
+	/*
+	 * A transaction holds every FAT block, the root directory and the
+	 * extent block of every file
+	 */
+	meta_blocks = fat_blocks + 1 + (extents ? FILE_MAX_COUNT : 0);
+	journal_blocks = meta_blocks + 1;
+	if (argc == 4) {
+		journal_blocks = strtoul(argv[3], &end, 0);
+		if (*end || (journal_blocks && journal_blocks < meta_blocks + 1))
+			die("The journal needs at least %zu blocks",
+			    meta_blocks + 1);
+	}
+	max_logged = (block_size - sizeof(struct journal_header))
+		     / sizeof(uint32_t);
+	if (journal_blocks && meta_blocks > max_logged)
+		die("The metadata does not fit in a journal transaction: use "
+		    "larger blocks, or a journal block count of 0");
+
+	disk_blocks = 2 + fat_blocks + journal_blocks + data_blocks;
+	if (disk_blocks > (extended ? MAX_EXTENDED_BLOCKS : MAX_LEGACY_BLOCKS))
+		die("The disk cannot hold more than %d blocks",
+		    extended ? MAX_EXTENDED_BLOCKS : MAX_LEGACY_BLOCKS);
+
+	/* Block 0 and the first FAT block, then the journal header */
+	block = calloc(2, block_size);
+	if (!block) {
+		perror("calloc");
+		exit(1);
+	}
+
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	/* The disk file starts out as one big hole, which reads as zeros */
+	if (allocate) {
+		errno = posix_fallocate(fd, 0, (off_t)disk_blocks * block_size);
+		if (errno) {
+			perror("posix_fallocate");
+			exit(1);
+		}
+	} else if (ftruncate(fd, (off_t)disk_blocks * block_size)) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	/* The superblock takes the first 4096 bytes of block 0 */
+	memset(&super, 0, sizeof(super));
+	memcpy(super.signature, "ECS150FS", 8);
+	if (extended) {
+		super.version = SUPER_EXTENDED;
+		super.block_size = block_size;
+		super.fat_bits = fat_bits;
+		super.disk_blocks32 = disk_blocks;
+		super.root_index32 = fat_blocks + 1;
+		super.dblock_index32 = fat_blocks + 2 + journal_blocks;
+		super.num_blocks32 = data_blocks;
+		super.block_fat32 = fat_blocks;
+		super.layout = extents ? LAYOUT_EXTENTS : 0;
+	} else {
+		super.disk_blocks = disk_blocks;
+		super.root_index = fat_blocks + 1;
+		super.dblock_index = fat_blocks + 2 + journal_blocks;
+		super.num_blocks = data_blocks;
+		super.block_fat = fat_blocks;
+	}
+	memcpy(block, &super, sizeof(super));
+
+	/*
+	 * Entry 0 of the FAT is never handed out. The other entries, and the
+	 * root directory, are all zeros.
+	 */
+	if (fat_bits == 16)
+		*(uint16_t *)(block + block_size) = FAT16_EOC;
+	else
+		*(uint32_t *)(block + block_size) = FAT32_EOC;
+	write_blocks(fd, 0, block, 2);
+
+	/* An empty journal, followed by room for one transaction */
+	if (journal_blocks) {
+		memset(block, 0, block_size);
+		header = (struct journal_header *)block;
+		memcpy(header->signature, "ECS150JL", 8);
+		write_blocks(fd, fat_blocks + 2, block, 1);
+	}
+
+	if (close(fd)) {
+		perror("close");
+		exit(1);
+	}
+	free(block);
+
+	printf("Created virtual disk '%s' with '%zu' data blocks of %zu bytes, "
+	       "%zu-bit FAT entries, %s files and a %zu-block journal\n",
+	       argv[1], data_blocks, block_size, fat_bits,
+	       extents ? "extent-based" : "FAT-chained", journal_blocks);
+	return 0;
+}
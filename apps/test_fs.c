@@ -1,15 +1,20 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
+#include <stats.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -34,239 +39,592 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
-{
-	struct thread_arg *t_arg = arg;
-	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+size_t get_argv(char *argv);
 
-	char line_buffer[1024];
-	int command_index = 1;
+static double now_ns(void)
+{
+	struct timespec ts;
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* Named fds a script can use, the unnamed one being the first */
+#define SCRIPT_FDS 64
+/* Nesting depth of the loops of a script */
+#define SCRIPT_DEPTH 16
+/* Arguments of a script line, command included */
+#define SCRIPT_ARGS 8
+/* Threads the replay command can run a script from */
+#define REPLAY_THREADS 64
+
+enum script_code {
+	SC_MOUNT, SC_UMOUNT, SC_CREATE, SC_DELETE, SC_OPEN, SC_CLOSE,
+	SC_SEEK, SC_WRITE, SC_READ, SC_LOOP, SC_END
+};
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
-		die_perror("fopen");
+static const char *script_names[] = {
+	"MOUNT", "UMOUNT", "CREATE", "DELETE", "OPEN", "CLOSE", "SEEK",
+	"WRITE", "READ", "LOOP", "END"
+};
 
-	int fs_fd = -1;
+/* One command of a script, as compiled before the script runs */
+struct script_op {
+	enum script_code code;
+	int line;		/* Line of the script it comes from */
+	int fd;			/* Named fd it acts on */
+	int random;		/* READ/WRITE at a random offset of the file */
+	int per_thread;		/* %t in the name stands for the thread */
+	size_t arg;		/* SEEK offset, READ/WRITE length, LOOP count */
+	size_t jump;		/* LOOP: index of its END, END: of its LOOP */
+	char *name;		/* CREATE/DELETE/OPEN file name */
+	char *data;		/* WRITE data, READ expected data (or NULL) */
+	size_t data_size;
+};
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
-		/* Remove trailing newline from command line */
-		char *nl = strchr(line_buffer, '\n');
-		if (nl)
-			*nl = '\0';
+struct script {
+	struct script_op *ops;
+	size_t nops;
+	size_t max_read;	/* Largest READ, for the read buffers */
+	char *fd_names[SCRIPT_FDS];
+	int nfds;
+	size_t loops[SCRIPT_DEPTH];	/* LOOPs still open while compiling */
+	int depth;
+};
 
-		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
+/* State of one run of a script */
+struct script_run {
+	struct script *script;
+	const char *diskname;
+	int replay;		/* Mounted by the replay command, quiet */
+	int thread;
+	int mounted;
+	int fds[SCRIPT_FDS];
+	char *read_buf;
+	uint64_t rng;
+	uint64_t *lat;		/* Histogram per op, NULL if not timed */
+	size_t mismatches;
+};
 
-		int data_fd;
-		int count, data_size;
+static int parse_size(const char *s, size_t *out)
+{
+	char *end;
+	unsigned long long n;
+
+	if (!s || *s < '0' || *s > '9')
+		return -1;
+	n = strtoull(s, &end, 0);
+	if (*end != '\0')
+		return -1;
+	*out = n;
+	return 0;
+}
 
-		char *read_buf;
+/* Read a whole host file in memory, with a trailing zero byte */
+static char *load_host_file(const char *path, size_t *size)
+{
+	struct stat st;
+	char *data;
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
 
-		/* End when no command present */
-		if (!command)
-			break;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", path);
+	data = calloc(st.st_size + 1, 1);
+	if (!data)
+		die_perror("calloc");
+	while (done < (size_t)st.st_size) {
+		ret = read(fd, data + done, st.st_size - done);
+		if (ret <= 0)
+			die_perror("read");
+		done += ret;
+	}
+	close(fd);
+	*size = done;
+	return data;
+}
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+static struct script_op *script_push(struct script *s, enum script_code code,
+				     int line)
+{
+	struct script_op *op;
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
+	if ((s->nops & (s->nops - 1)) == 0) {
+		s->ops = realloc(s->ops, (s->nops ? 2 * s->nops : 16) *
+				 sizeof(struct script_op));
+		if (!s->ops)
+			die_perror("realloc");
+	}
+	op = &s->ops[s->nops++];
+	memset(op, 0, sizeof(*op));
+	op->code = code;
+	op->line = line;
+	return op;
+}
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+static void script_open_loop(struct script *s, size_t count, int line)
+{
+	if (s->depth == SCRIPT_DEPTH)
+		die("line %d: loops nested too deep", line);
+	script_push(s, SC_LOOP, line)->arg = count;
+	s->loops[s->depth++] = s->nops - 1;
+}
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+static void script_close_loop(struct script *s, int line)
+{
+	struct script_op *op;
 
-			printf("CREATE successful.\n");
+	if (s->depth == 0)
+		die("line %d: END without LOOP", line);
+	op = script_push(s, SC_END, line);
+	op->jump = s->loops[--s->depth];
+	s->ops[op->jump].jump = s->nops - 1;
+}
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+static int script_fd(struct script *s, const char *name, int line)
+{
+	int i;
+
+	for (i = 0; i < s->nfds; i++)
+		if (!strcmp(s->fd_names[i], name))
+			return i;
+	if (s->nfds == SCRIPT_FDS)
+		die("line %d: more than %d named fds", line, SCRIPT_FDS);
+	s->fd_names[s->nfds] = strdup(name);
+	return s->nfds++;
+}
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+/* Compile one command, given as its tab-separated arguments */
+static void script_compile(struct script *s, char **args, int argc, int line)
+{
+	struct script_op *op;
+	size_t n;
+	int i, code = -1, fd = 0;
+
+	if (!strcmp(args[0], "REPEAT")) {
+		if (argc < 3 || parse_size(args[1], &n))
+			die("line %d: need REPEAT <count> <command>", line);
+		script_open_loop(s, n, line);
+		script_compile(s, args + 2, argc - 2, line);
+		script_close_loop(s, line);
+		return;
+	}
+	for (i = 0; i < (int)ARRAY_SIZE(script_names); i++)
+		if (!strcmp(args[0], script_names[i]))
+			code = i;
+	if (code < 0)
+		die("line %d: unknown command '%s'", line, args[0]);
+	if (code == SC_LOOP) {
+		if (argc < 2 || parse_size(args[1], &n))
+			die("line %d: need LOOP <count>", line);
+		script_open_loop(s, n, line);
+		return;
+	}
+	if (code == SC_END) {
+		script_close_loop(s, line);
+		return;
+	}
 
-			printf("DELETE successful.\n");
+	/* An fd name comes first, or else the unnamed fd is used */
+	if (argc > 1 && args[1][0] == '@') {
+		fd = script_fd(s, args[1] + 1, line);
+		args++;
+		argc--;
+	}
+	op = script_push(s, code, line);
+	op->fd = fd;
+	switch (code) {
+	case SC_CREATE:
+	case SC_DELETE:
+	case SC_OPEN:
+		if (argc < 2)
+			die("line %d: need %s <filename>", line, args[0]);
+		op->name = strdup(args[1]);
+		op->per_thread = strstr(args[1], "%t") != NULL;
+		break;
+	case SC_SEEK:
+		if (argc < 2 || parse_size(args[1], &op->arg))
+			die("line %d: need SEEK <offset>", line);
+		break;
+	case SC_WRITE:
+		if (argc > 2 && !strcmp(args[1], "DATA")) {
+			op->data = strdup(args[2]);
+			op->data_size = strlen(args[2]);
+		} else if (argc > 2 && !strcmp(args[1], "FILE")) {
+			op->data = load_host_file(args[2], &op->data_size);
+		} else if (argc > 1 && !parse_size(args[1], &op->data_size)) {
+			/* Filler data, at the offset or anywhere in the file */
+			op->data = malloc(op->data_size + 1);
+			if (!op->data)
+				die_perror("malloc");
+			memset(op->data, 'w', op->data_size);
+			op->random = argc > 2 && !strcmp(args[2], "RANDOM");
+		} else {
+			die("line %d: need WRITE DATA <data>, FILE <filename> "
+			    "or <len> [RANDOM]", line);
+		}
+		break;
+	case SC_READ:
+		if (argc < 2 || parse_size(args[1], &op->arg))
+			die("line %d: need READ <len> [...]", line);
+		if (argc > 3 && !strcmp(args[2], "DATA")) {
+			op->data = strdup(args[3]);
+			op->data_size = strlen(args[3]);
+		} else if (argc > 3 && !strcmp(args[2], "FILE")) {
+			op->data = load_host_file(args[3], &op->data_size);
+		} else if (argc > 2 && !strcmp(args[2], "RANDOM")) {
+			op->random = 1;
+		} else if (argc > 2) {
+			die("line %d: invalid data description", line);
+		}
+		if (op->arg > s->max_read)
+			s->max_read = op->arg;
+		break;
+	default:
+		break;
+	}
+}
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+/* Compile a script file into an array of commands */
+static void script_load(struct script *s, const char *path)
+{
+	char *args[SCRIPT_ARGS];
+	char *buf = NULL;
+	size_t buf_len = 0;
+	ssize_t len;
+	FILE *f;
+	int line = 0, argc;
+
+	memset(s, 0, sizeof(*s));
+	/* The unnamed fd */
+	script_fd(s, "", 0);
+
+	f = fopen(path, "r");
+	if (!f)
+		die_perror("fopen");
+	while ((len = getline(&buf, &buf_len, f)) >= 0) {
+		line++;
+		while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+			buf[--len] = '\0';
+		argc = 0;
+		args[argc] = strtok(buf, "\t");
+		while (args[argc] && ++argc < SCRIPT_ARGS)
+			args[argc] = strtok(NULL, "\t");
+		/* Blank lines and comments */
+		if (argc == 0 || args[0][0] == '#')
+			continue;
+		script_compile(s, args, argc, line);
+	}
+	if (s->depth > 0)
+		die("line %d: LOOP without END", line);
+	free(buf);
+	fclose(f);
+}
 
-			fs_fd = fs_open(fs_filename);
+static void script_free(struct script *s)
+{
+	size_t i;
+	int j;
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+	for (i = 0; i < s->nops; i++) {
+		free(s->ops[i].name);
+		free(s->ops[i].data);
+	}
+	for (j = 0; j < s->nfds; j++)
+		free(s->fd_names[j]);
+	free(s->ops);
+}
 
-			printf("OPEN successful.\n");
+/* Give up on a script, unmounting first if the script mounted the disk */
+#define script_fail(run, op, ...)				\
+do {								\
+	if ((run)->mounted)					\
+		fs_umount();					\
+	test_fs_error("line %d", (op)->line);			\
+	die(__VA_ARGS__);					\
+} while (0)
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+static uint64_t script_random(struct script_run *run)
+{
+	/* xorshift64 */
+	run->rng ^= run->rng << 13;
+	run->rng ^= run->rng >> 7;
+	run->rng ^= run->rng << 17;
+	return run->rng;
+}
 
-			printf("CLOSE successful.\n");
+/* Move the fd to a random offset where @len bytes fit, if the file allows */
+static void script_seek_random(struct script_run *run, struct script_op *op,
+			       int fd, size_t len)
+{
+	int size = fs_stat(fd);
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+	if (size < 0)
+		script_fail(run, op, "Cannot stat file");
+	if (fs_lseek(fd, (size_t)size > len ?
+		     script_random(run) % (size - len + 1) : 0))
+		script_fail(run, op, "Cannot seek to position");
+}
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+static void script_exec(struct script_run *run, struct script_op *op)
+{
+	char name[FS_FILENAME_LEN * 2];
+	const char *filename = op->name;
+	int *fd = &run->fds[op->fd];
+	int count;
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
-			}
+	if (op->per_thread) {
+		char *t = strstr(op->name, "%t");
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+		snprintf(name, sizeof(name), "%.*s%d%s", (int)(t - op->name),
+			 op->name, run->thread, t + 2);
+		filename = name;
+	}
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
-			}
+	switch (op->code) {
+	case SC_MOUNT:
+		if (run->replay)
+			break;
+		if (fs_mount(run->diskname))
+			die("Cannot mount disk");
+		printf("MOUNT successful.\n");
+		run->mounted = 1;
+		break;
+	case SC_UMOUNT:
+		if (run->replay)
+			break;
+		if (run->mounted && fs_umount())
+			die("Cannot unmount");
+		printf("UMOUNT successful.\n");
+		run->mounted = 0;
+		break;
+	case SC_CREATE:
+		if (fs_create(filename))
+			script_fail(run, op, "Cannot create file");
+		if (!run->replay)
+			printf("CREATE successful.\n");
+		break;
+	case SC_DELETE:
+		if (fs_delete(filename))
+			script_fail(run, op, "Cannot delete file");
+		if (!run->replay)
+			printf("DELETE successful.\n");
+		break;
+	case SC_OPEN:
+		*fd = fs_open(filename);
+		if (*fd < 0)
+			script_fail(run, op, "Cannot open file");
+		if (!run->replay)
+			printf("OPEN successful.\n");
+		break;
+	case SC_CLOSE:
+		if (fs_close(*fd))
+			script_fail(run, op, "Cannot close file");
+		*fd = -1;
+		if (!run->replay)
+			printf("CLOSE successful.\n");
+		break;
+	case SC_SEEK:
+		if (fs_lseek(*fd, op->arg))
+			script_fail(run, op, "Cannot seek to position");
+		if (!run->replay)
+			printf("SEEK successful.\n");
+		break;
+	case SC_WRITE:
+		if (op->random)
+			script_seek_random(run, op, *fd, 0);
+		count = fs_write(*fd, op->data, op->data_size);
+		if (count < 0)
+			script_fail(run, op, "write error");
+		if (!run->replay)
 			printf("Wrote %d bytes to file.\n", count);
+		break;
+	case SC_READ:
+		if (op->random)
+			script_seek_random(run, op, *fd, op->arg);
+		count = fs_read(*fd, run->read_buf, op->arg);
+		if (count < 0)
+			script_fail(run, op, "read error");
+		run->read_buf[count] = '\0';
+		if (!op->data) {
+			if (!run->replay)
+				printf("Read %d bytes from file.\n", count);
+		} else if ((size_t)count == op->data_size &&
+			   !memcmp(op->data, run->read_buf, count)) {
+			if (!run->replay)
+				printf("Read %d bytes from file. Compared %zu "
+				       "correct.\n", count, op->data_size);
+		} else {
+			run->mismatches++;
+			if (!run->replay)
+				printf("Read unexpected data! %s read vs given "
+				       "%s\n", run->read_buf, op->data);
+		}
+		break;
+	default:
+		break;
+	}
+}
 
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
-
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
+/* Run the commands of a script, looping as told */
+static void script_run(struct script_run *run)
+{
+	struct script *s = run->script;
+	size_t left[SCRIPT_DEPTH];
+	int depth = 0;
+	size_t pc = 0;
+	double start;
+
+	while (pc < s->nops) {
+		struct script_op *op = &s->ops[pc];
+
+		if (op->code == SC_LOOP) {
+			if (op->arg == 0) {
+				pc = op->jump + 1;
+				continue;
 			}
-
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
+			left[depth++] = op->arg;
+		} else if (op->code == SC_END) {
+			if (--left[depth - 1] > 0) {
+				pc = op->jump + 1;
+				continue;
 			}
+			depth--;
+		} else if (!run->lat) {
+			script_exec(run, op);
+		} else {
+			start = now_ns();
+			script_exec(run, op);
+			stats_hist_add(&run->lat[pc * STATS_HIST_SLOTS],
+				       now_ns() - start);
+		}
+		pc++;
+	}
+}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+static void script_run_init(struct script_run *run, struct script *s,
+			    const char *diskname, int thread, int replay)
+{
+	int i;
+
+	memset(run, 0, sizeof(*run));
+	run->script = s;
+	run->diskname = diskname;
+	run->thread = thread;
+	run->replay = replay;
+	run->rng = 0x9E3779B97F4A7C15ull * (thread + 1);
+	for (i = 0; i < SCRIPT_FDS; i++)
+		run->fds[i] = -1;
+	run->read_buf = malloc(s->max_read + 1);
+	if (!run->read_buf)
+		die_perror("malloc");
+	if (replay) {
+		run->lat = calloc(s->nops * STATS_HIST_SLOTS, sizeof(uint64_t));
+		if (!run->lat)
+			die_perror("calloc");
+	}
+}
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
-			}
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script script;
+	struct script_run run;
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
-			}
-		}
-	}
+	script_load(&script, t_arg->argv[1]);
+	script_run_init(&run, &script, t_arg->argv[0], 0, 0);
+	script_run(&run);
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (run.mounted && fs_umount())
+		die("Cannot unmount diskname");
+
+	free(run.read_buf);
+	script_free(&script);
+}
+
+static void *replay_worker(void *arg)
+{
+	script_run(arg);
+	return NULL;
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script script;
+	struct script_run runs[REPLAY_THREADS];
+	pthread_t threads[REPLAY_THREADS];
+	size_t nthreads = 1, total = 0, mismatches = 0, i, t;
+	struct stats_latency sl;
+	uint64_t *lat;
+	double start, elapsed;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename> [<threads>]");
+	if (t_arg->argc > 2)
+		nthreads = get_argv(t_arg->argv[2]);
+	if (!nthreads || nthreads > REPLAY_THREADS)
+		die("thread count must be between 1 and %d", REPLAY_THREADS);
+
+	script_load(&script, t_arg->argv[1]);
+	for (t = 0; t < nthreads; t++)
+		script_run_init(&runs[t], &script, t_arg->argv[0], t, 1);
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	start = now_ns();
+	for (t = 0; t < nthreads; t++)
+		if (pthread_create(&threads[t], NULL, replay_worker, &runs[t]))
+			die_perror("pthread_create");
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	elapsed = (now_ns() - start) / 1e9;
+
+	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	/* Sum up each command over the threads */
+	lat = runs[0].lat;
+	for (t = 1; t < nthreads; t++)
+		for (i = 0; i < script.nops; i++)
+			stats_hist_merge(&lat[i * STATS_HIST_SLOTS],
+					 &runs[t].lat[i * STATS_HIST_SLOTS]);
+	printf("line\tcommand\tcount\tmean ns\tp50 ns\tp90 ns\tp99 ns\t"
+	       "p99.9 ns\tmax ns\n");
+	for (i = 0; i < script.nops; i++, lat += STATS_HIST_SLOTS) {
+		stats_hist_summary(lat, &sl);
+		if (sl.count == 0)
+			continue;
+		total += sl.count;
+		printf("%d\t%s\t%zu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+		       script.ops[i].line, script_names[script.ops[i].code],
+		       sl.count, (unsigned long long)sl.mean,
+		       (unsigned long long)sl.p50, (unsigned long long)sl.p90,
+		       (unsigned long long)sl.p99, (unsigned long long)sl.p999,
+		       (unsigned long long)sl.max);
+	}
+	printf("%zu threads, %zu commands in %.3f s, %.0f commands/s\n",
+	       nthreads, total, elapsed, total / elapsed);
+
+	for (t = 0; t < nthreads; t++) {
+		mismatches += runs[t].mismatches;
+		free(runs[t].read_buf);
+		free(runs[t].lat);
+	}
+	script_free(&script);
+	if (mismatches)
+		die("%zu reads returned unexpected data", mismatches);
 }
 
 void thread_fs_stat(void *arg)
@@ -319,7 +677,7 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
 	int stat, read;
 
@@ -348,15 +706,16 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+	/* The content goes from the disk to stdout, without a buffer */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+	read = fs_export(fs_fd, STDOUT_FILENO, stat);
+	if (read != stat) {
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot read file (%d/%d bytes)", read, stat);
 	}
 
-	read = fs_read(fs_fd, buf, stat);
-
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -364,72 +723,134 @@ void thread_fs_cat(void *arg)
 
 	if (fs_umount())
 		die("cannot unmount diskname");
-
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
 }
 
-void thread_fs_rm(void *arg)
+void thread_fs_stream(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename;
+	char *diskname, *filename, *buf;
+	struct fs_readahead_stats ra;
+	int fs_fd, ra_window;
+	int stat, read;
+	size_t chunk = 512;
+	size_t calls, window, i;
+	double start, first_ns = 0, last_ns = 0;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("need <diskname> <filename> [<chunk size>]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		chunk = get_argv(t_arg->argv[2]);
+	if (!chunk)
+		die("invalid chunk size");
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_delete(filename)) {
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
 		fs_umount();
-		die("Cannot delete file");
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	buf = malloc(chunk);
+	if (!buf) {
+		perror("malloc");
+		fs_umount();
+		die("Cannot malloc");
+	}
+
+	/* Time the first and the last tenth of the reads */
+	calls = (stat + chunk - 1) / chunk;
+	window = calls / 10 ? calls / 10 : 1;
+	for (i = 0; i < calls; i++) {
+		start = now_ns();
+		read = fs_read(fs_fd, buf, chunk);
+		if (read <= 0) {
+			fs_umount();
+			die("read error at offset %zu", i * chunk);
+		}
+		if (i < window)
+			first_ns += now_ns() - start;
+		if (i >= calls - window)
+			last_ns += now_ns() - start;
+	}
+
+	/* The stream was sequential, a jump back must close the window */
+	ra_window = fs_readahead_window(fs_fd);
+	fs_readahead_stats(&ra);
+	fs_lseek(fs_fd, stat / 2);
+	fs_read(fs_fd, buf, chunk);
+	if (fs_readahead_window(fs_fd) != 0) {
+		fs_umount();
+		die("read-ahead window still open after a random seek");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
 	}
 
 	if (fs_umount())
-		die("Cannot unmount diskname");
+		die("cannot unmount diskname");
 
-	printf("Removed file '%s'\n", filename);
+	free(buf);
+
+	printf("Streamed file '%s' (%d bytes) in %zu reads of %zu bytes\n",
+	       filename, stat, calls, chunk);
+	printf("First %zu reads: %.0f ns/read\n", window, first_ns / window);
+	printf("Last %zu reads: %.0f ns/read\n", window, last_ns / window);
+	printf("Read-ahead: window %d blocks, %zu prefetched, %zu hits "
+	       "(%.0f%%)\n", ra_window, ra.prefetched, ra.hits,
+	       ra.prefetched ? 100.0 * ra.hits / ra.prefetched : 0.0);
+
+	/* Reads at the end of the file should cost about the same as the
+	 * first ones; a cost that grows with the offset means the FAT chain is
+	 * walked from the start on each call */
+	if (calls >= 100 && last_ns > 4 * first_ns + 1e6)
+		die("per-read cost grows with the file offset");
 }
 
-void thread_fs_add(void *arg)
+static long rss_kb(void)
 {
-	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fd, fs_fd;
-	struct stat st;
-	int written;
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+	if (!statm)
+		die_perror("fopen");
+	if (fscanf(statm, "%*d %ld", &pages) != 1)
+		die("cannot parse /proc/self/statm");
+	fclose(statm);
 
-	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
 
-	/* Open file on host computer */
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		die_perror("open");
-	if (fstat(fd, &st))
-		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
-		die("Not a regular file: %s\n", filename);
+void thread_fs_memcheck(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	const char *filename = "memcheck";
+	static char buf[3 * 4096 + 100];
+	size_t calls = 10000;
+	size_t i, len;
+	long rss_start = 0, rss_end;
+	int fs_fd;
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
+	if (t_arg->argc < 1)
+		die("need <diskname> [<calls>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		calls = get_argv(t_arg->argv[1]);
 
-	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
-	 */
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
@@ -444,56 +865,1144 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
-
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
+	/* Mix small, block-sized and multi-block transfers over the first few
+	 * blocks of the file, and check that memory usage does not grow */
+	memset(buf, 'a', sizeof(buf));
+	for (i = 0; i < calls; i++) {
+		len = (i * 7919) % sizeof(buf);
+		fs_lseek(fs_fd, 0);
+		if (i % 2 == 0) {
+			if (fs_write(fs_fd, buf, len) < 0)
+				die("write error");
+		} else {
+			if (fs_read(fs_fd, buf, len) < 0)
+				die("read error");
+		}
+		if (i == calls / 10)
+			rss_start = rss_kb();
 	}
+	rss_end = rss_kb();
 
+	fs_close(fs_fd);
+	fs_delete(filename);
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
-		   st.st_size);
+	printf("RSS after %zu calls: %ld kB\n", calls / 10, rss_start);
+	printf("RSS after %zu calls: %ld kB\n", calls, rss_end);
 
-	munmap(buf, st.st_size);
-	close(fd);
+	if (rss_end > rss_start + 1024)
+		die("memory usage grows with the number of calls");
 }
 
-void thread_fs_ls(void *arg)
+void thread_fs_iocheck(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
+	const char *filename = "iocheck";
+	static char buf[5 * 4096];
+	struct fs_io_stats before, after;
+	size_t calls = 1000;
+	size_t i, len, offset, reads, max_reads = 0, total_reads = 0;
+	size_t idle_writes, sync_writes;
+	int fs_fd, size;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("need <diskname> [<calls>]");
 
 	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		calls = get_argv(t_arg->argv[1]);
 
+	/* Without the block cache, every read-modify-write reaches the disk */
+	fs_set_cache_size(0);
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	/* Appends and overwrites of all sizes and alignments */
+	memset(buf, 'a', sizeof(buf));
+	for (i = 0; i < calls; i++) {
+		size = fs_stat(fs_fd);
+		len = (i * 7919) % sizeof(buf);
+		offset = (i % 3 == 0) ? (size_t)size : (i * 104729) % (size + 1);
+		fs_lseek(fs_fd, offset);
+
+		fs_io_stats(&before);
+		if (fs_write(fs_fd, buf, len) < 0)
+			die("write error");
+		fs_io_stats(&after);
+
+		reads = after.blocks_read - before.blocks_read;
+		total_reads += reads;
+		if (reads > max_reads)
+			max_reads = reads;
+	}
+
+	fs_close(fs_fd);
+	fs_delete(filename);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Block reads over %zu writes: %zu (at most %zu per write)\n",
+	       calls, total_reads, max_reads);
+
+	/* Only the partial head and tail blocks may need to be read in */
+	if (max_reads > 2)
+		die("write read more than the head and tail blocks");
 
+	/* Only the metadata blocks that changed are written back */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_io_stats(&before);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	fs_io_stats(&after);
+	idle_writes = after.blocks_written - before.blocks_written;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(filename))
+		die("Cannot create file");
+	fs_io_stats(&before);
+	if (fs_sync())
+		die("Cannot sync");
+	fs_io_stats(&after);
+	sync_writes = after.blocks_written - before.blocks_written;
+	fs_delete(filename);
 	if (fs_umount())
 		die("Cannot unmount diskname");
+
+	printf("Block writes of an idle unmount: %zu, of a sync after a create: "
+	       "%zu\n", idle_writes, sync_writes);
+	/* The root directory, after the journal header and copy if any */
+	if (idle_writes != 0 || (sync_writes != 1 && sync_writes != 3))
+		die("unchanged metadata was written back");
 }
 
-void thread_fs_info(void *arg)
+/* Expected content of byte @offset of stress file @file */
+static char stress_byte(int file, size_t offset)
 {
-	struct thread_arg *t_arg = arg;
-	char *diskname;
+	return (char)(offset * 131 + file * 7 + (offset >> 12));
+}
 
-	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+static void stress_fill(char *buf, int file, size_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = stress_byte(file, offset + i);
+}
+
+static int stress_check(const char *buf, int file, size_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] != stress_byte(file, offset + i))
+			return -1;
+	return 0;
+}
+
+#define STRESS_FILE_SIZE (256 * 1024)
+#define STRESS_MAX_LEN (16 * 1024)
+#define STRESS_SCRATCH_SIZE (20 * 1024)
+
+struct stress_arg {
+	int file;
+	size_t ops;
+	size_t bytes;
+	int errors;
+};
+
+static void *stress_worker(void *arg)
+{
+	struct stress_arg *s_arg = arg;
+	static __thread char buf[STRESS_SCRATCH_SIZE + STRESS_MAX_LEN];
+	char name[16], scratch[16];
+	unsigned seed = s_arg->file * 2654435761u;
+	size_t i, offset, len;
+	int fs_fd, scratch_fd;
+
+	snprintf(name, sizeof(name), "stress%d", s_arg->file);
+	snprintf(scratch, sizeof(scratch), "scratch%d", s_arg->file);
+
+	fs_fd = fs_open(name);
+	if (fs_fd < 0) {
+		s_arg->errors++;
+		return NULL;
+	}
+
+	for (i = 0; i < s_arg->ops; i++) {
+		offset = rand_r(&seed) % STRESS_FILE_SIZE;
+		len = rand_r(&seed) % STRESS_MAX_LEN;
+		if (offset + len > STRESS_FILE_SIZE)
+			len = STRESS_FILE_SIZE - offset;
+
+		fs_lseek(fs_fd, offset);
+		if (rand_r(&seed) % 5) {
+			/* Read back and check */
+			if (fs_read(fs_fd, buf, len) != (int)len ||
+			    stress_check(buf, s_arg->file, offset, len))
+				s_arg->errors++;
+		} else {
+			/* Rewrite the same content */
+			stress_fill(buf, s_arg->file, offset, len);
+			if (fs_write(fs_fd, buf, len) != (int)len)
+				s_arg->errors++;
+		}
+		s_arg->bytes += len;
+
+		if (fs_stat(fs_fd) != STRESS_FILE_SIZE)
+			s_arg->errors++;
+
+		/* Now and then, go through the allocator and root directory */
+		if (i % 64 == 0) {
+			if (fs_create(scratch)) {
+				s_arg->errors++;
+				continue;
+			}
+			scratch_fd = fs_open(scratch);
+			stress_fill(buf, s_arg->file, 0, STRESS_SCRATCH_SIZE);
+			if (scratch_fd < 0 || fs_write(scratch_fd, buf,
+				STRESS_SCRATCH_SIZE) != STRESS_SCRATCH_SIZE)
+				s_arg->errors++;
+			fs_lseek(scratch_fd, 0);
+			memset(buf, 0, STRESS_SCRATCH_SIZE);
+			if (fs_read(scratch_fd, buf, STRESS_SCRATCH_SIZE) !=
+			    STRESS_SCRATCH_SIZE ||
+			    stress_check(buf, s_arg->file, 0, STRESS_SCRATCH_SIZE))
+				s_arg->errors++;
+			if (fs_close(scratch_fd) || fs_delete(scratch))
+				s_arg->errors++;
+		}
+	}
+
+	if (fs_close(fs_fd))
+		s_arg->errors++;
+
+	return NULL;
+}
+
+void thread_fs_stress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *buf;
+	char name[16];
+	size_t max_threads = 8, ops = 20000;
+	struct stress_arg s_args[FS_OPEN_MAX_COUNT / 2];
+	pthread_t threads[FS_OPEN_MAX_COUNT / 2];
+	size_t nthreads, i, bytes, total_ops;
+	double start, elapsed, base = 0;
+	int fs_fd, errors = 0;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [<max threads> [<ops per thread>]]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_threads = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		ops = get_argv(t_arg->argv[2]);
+	if (!max_threads || max_threads > ARRAY_SIZE(threads))
+		die("thread count must be between 1 and %zu",
+		    ARRAY_SIZE(threads));
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* One file per thread, filled with a known pattern */
+	buf = malloc(STRESS_FILE_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < max_threads; i++) {
+		snprintf(name, sizeof(name), "stress%zu", i);
+		stress_fill(buf, i, 0, STRESS_FILE_SIZE);
+		if (fs_create(name) || (fs_fd = fs_open(name)) < 0) {
+			fs_umount();
+			die("Cannot create file");
+		}
+		if (fs_write(fs_fd, buf, STRESS_FILE_SIZE) != STRESS_FILE_SIZE) {
+			fs_umount();
+			die("Cannot fill file (disk too small?)");
+		}
+		fs_close(fs_fd);
+	}
+
+	printf("threads\tops/s\tMB/s\tspeedup\n");
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		start = now_ns();
+		for (i = 0; i < nthreads; i++) {
+			s_args[i] = (struct stress_arg){ .file = i, .ops = ops };
+			if (pthread_create(&threads[i], NULL, stress_worker,
+					   &s_args[i]))
+				die_perror("pthread_create");
+		}
+		bytes = 0;
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(threads[i], NULL);
+			bytes += s_args[i].bytes;
+			errors += s_args[i].errors;
+		}
+		elapsed = (now_ns() - start) / 1e9;
+		total_ops = nthreads * ops;
+		if (nthreads == 1)
+			base = total_ops / elapsed;
+		printf("%zu\t%.0f\t%.1f\t%.2f\n", nthreads, total_ops / elapsed,
+		       bytes / elapsed / (1024 * 1024),
+		       total_ops / elapsed / base);
+		if (nthreads < max_threads && nthreads * 2 > max_threads)
+			nthreads = max_threads / 2;
+	}
+
+	/* Final check of every file, then clean up */
+	for (i = 0; i < max_threads; i++) {
+		snprintf(name, sizeof(name), "stress%zu", i);
+		fs_fd = fs_open(name);
+		if (fs_fd < 0 ||
+		    fs_read(fs_fd, buf, STRESS_FILE_SIZE) != STRESS_FILE_SIZE ||
+		    stress_check(buf, i, 0, STRESS_FILE_SIZE))
+			errors++;
+		fs_close(fs_fd);
+		fs_delete(name);
+	}
+	free(buf);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (errors)
+		die("%d errors, file system corrupted", errors);
+	printf("No corruption detected\n");
+}
+
+struct multi_arg {
+	fs_t fs;
+	int volume;
+	size_t rounds;
+	int errors;
+};
+
+/* Write, read back and delete a patterned file on one volume */
+static void *multi_worker(void *arg)
+{
+	struct multi_arg *m_arg = arg;
+	static __thread char buf[STRESS_FILE_SIZE];
+	size_t i;
+	int fs_fd;
+
+	for (i = 0; i < m_arg->rounds; i++) {
+		if (fs_create_h(m_arg->fs, "multi") ||
+		    (fs_fd = fs_open_h(m_arg->fs, "multi")) < 0) {
+			m_arg->errors++;
+			return NULL;
+		}
+		stress_fill(buf, m_arg->volume, 0, STRESS_FILE_SIZE);
+		if (fs_write_h(m_arg->fs, fs_fd, buf, STRESS_FILE_SIZE) !=
+		    STRESS_FILE_SIZE)
+			m_arg->errors++;
+		fs_lseek_h(m_arg->fs, fs_fd, 0);
+		memset(buf, 0, STRESS_FILE_SIZE);
+		if (fs_read_h(m_arg->fs, fs_fd, buf, STRESS_FILE_SIZE) !=
+		    STRESS_FILE_SIZE ||
+		    stress_check(buf, m_arg->volume, 0, STRESS_FILE_SIZE))
+			m_arg->errors++;
+		if (fs_close_h(m_arg->fs, fs_fd) ||
+		    fs_delete_h(m_arg->fs, "multi"))
+			m_arg->errors++;
+	}
+
+	return NULL;
+}
+
+void thread_fs_multi(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct multi_arg *m_args;
+	pthread_t *threads;
+	size_t rounds = 16;
+	double start, elapsed;
+	int nvolumes, i, errors = 0;
+
+	if (t_arg->argc < 1)
+		die("need <diskname>... [-r <rounds>]");
+
+	nvolumes = t_arg->argc;
+	if (nvolumes > 2 && !strcmp(t_arg->argv[nvolumes - 2], "-r")) {
+		rounds = get_argv(t_arg->argv[nvolumes - 1]);
+		nvolumes -= 2;
+	}
+
+	m_args = calloc(nvolumes, sizeof(*m_args));
+	threads = calloc(nvolumes, sizeof(*threads));
+	if (!m_args || !threads)
+		die_perror("calloc");
+
+	/* Every image is mounted at the same time, each with its own handle */
+	for (i = 0; i < nvolumes; i++) {
+		m_args[i].fs = fs_mount_h(t_arg->argv[i]);
+		if (!m_args[i].fs)
+			die("Cannot mount diskname '%s'", t_arg->argv[i]);
+		m_args[i].volume = i;
+		m_args[i].rounds = rounds;
+	}
+	/* The settings are shared by every mount, so they are frozen now */
+	if (fs_set_cache_size(64) != -1)
+		die("settings changed while volumes are mounted");
+
+	start = now_ns();
+	for (i = 0; i < nvolumes; i++)
+		if (pthread_create(&threads[i], NULL, multi_worker, &m_args[i]))
+			die_perror("pthread_create");
+	for (i = 0; i < nvolumes; i++) {
+		pthread_join(threads[i], NULL);
+		errors += m_args[i].errors;
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	for (i = 0; i < nvolumes; i++)
+		if (fs_umount_h(m_args[i].fs))
+			die("Cannot unmount diskname '%s'", t_arg->argv[i]);
+	free(m_args);
+	free(threads);
+
+	printf("Volumes: %d, MB/s: %.1f\n", nvolumes,
+	       2.0 * nvolumes * rounds * STRESS_FILE_SIZE / elapsed
+	       / (1024 * 1024));
+	if (errors)
+		die("%d errors, volumes interfered with each other", errors);
+	printf("No corruption detected\n");
+}
+
+/* Requests of the aio command still in flight */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	size_t inflight;
+	size_t bytes;
+	int errors;
+} aio_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void aio_complete(void *arg, int ret)
+{
+	size_t expected = (size_t)arg;
+
+	pthread_mutex_lock(&aio_state.lock);
+	if (ret != (int)expected)
+		aio_state.errors++;
+	else
+		aio_state.bytes += ret;
+	aio_state.inflight--;
+	pthread_cond_signal(&aio_state.done);
+	pthread_mutex_unlock(&aio_state.lock);
+}
+
+/* Wait until fewer than @depth requests are in flight */
+static void aio_throttle(size_t depth)
+{
+	pthread_mutex_lock(&aio_state.lock);
+	while (aio_state.inflight >= depth)
+		pthread_cond_wait(&aio_state.done, &aio_state.lock);
+	aio_state.inflight++;
+	pthread_mutex_unlock(&aio_state.lock);
+}
+
+void thread_fs_aio(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *ref, *buf;
+	size_t depth = 16, chunk = 65536, offset, len;
+	double start, sync_s, async_s, write_s;
+	int fs_fd, copy_fd, stat;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [<depth> [<chunk size>]]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		depth = get_argv(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		chunk = get_argv(t_arg->argv[3]);
+	if (!depth || !chunk)
+		die("invalid depth or chunk size");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	stat = fs_stat(fs_fd);
+
+	ref = malloc(stat + 1);
+	buf = malloc(stat + 1);
+	if (!ref || !buf)
+		die_perror("malloc");
+
+	/* Reference content, read synchronously */
+	start = now_ns();
+	for (offset = 0; offset < (size_t)stat; offset += len) {
+		len = chunk < stat - offset ? chunk : stat - offset;
+		if (fs_read(fs_fd, &ref[offset], len) != (int)len)
+			die("read error at offset %zu", offset);
+	}
+	sync_s = (now_ns() - start) / 1e9;
+
+	/* Same reads, with up to @depth of them in flight */
+	fs_lseek(fs_fd, 0);
+	memset(buf, 0, stat);
+	start = now_ns();
+	for (offset = 0; offset < (size_t)stat; offset += len) {
+		len = chunk < stat - offset ? chunk : stat - offset;
+		aio_throttle(depth);
+		if (fs_read_async(fs_fd, &buf[offset], len, aio_complete,
+				  (void *)len))
+			die("cannot submit read at offset %zu", offset);
+	}
+	fs_aio_wait();
+	async_s = (now_ns() - start) / 1e9;
+	if (memcmp(ref, buf, stat))
+		die("asynchronous reads do not match the file content");
+
+	/* Copy the file with asynchronous writes, then check the copy */
+	if (fs_create("aio_copy") || (copy_fd = fs_open("aio_copy")) < 0)
+		die("Cannot create file");
+	start = now_ns();
+	for (offset = 0; offset < (size_t)stat; offset += len) {
+		len = chunk < stat - offset ? chunk : stat - offset;
+		aio_throttle(depth);
+		if (fs_write_async(copy_fd, &ref[offset], len, aio_complete,
+				   (void *)len))
+			die("cannot submit write at offset %zu", offset);
+	}
+	fs_aio_wait();
+	write_s = (now_ns() - start) / 1e9;
+	fs_lseek(copy_fd, 0);
+	memset(buf, 0, stat);
+	if (fs_read(copy_fd, buf, stat) != stat || memcmp(ref, buf, stat))
+		die("asynchronous writes do not match the file content");
+	fs_close(copy_fd);
+	fs_delete("aio_copy");
+
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(ref);
+	free(buf);
+
+	if (aio_state.errors)
+		die("%d requests failed", aio_state.errors);
+	printf("Read '%s' (%d bytes) in chunks of %zu bytes\n", filename, stat,
+	       chunk);
+	printf("sync reads:\t%.1f MB/s\n", stat / sync_s / (1024 * 1024));
+	printf("async reads:\t%.1f MB/s (depth %zu)\n",
+	       stat / async_s / (1024 * 1024), depth);
+	printf("async writes:\t%.1f MB/s (depth %zu)\n",
+	       stat / write_s / (1024 * 1024), depth);
+}
+
+/* The log file is started over once it holds this many bytes */
+#define APPEND_FILE_BYTES (4 * 1024 * 1024)
+
+/* Time @appends writes of @size bytes at the end of a log file */
+static double append_run(char *diskname, size_t buffer_blocks, size_t appends,
+			 size_t size, size_t *blocks_written)
+{
+	struct fs_io_stats before, after;
+	size_t per_file = APPEND_FILE_BYTES / size, i, j, records;
+	char *buf, *check;
+	double start, elapsed;
+	int fs_fd;
+
+	buf = malloc(size);
+	check = malloc(per_file * size);
+	if (!buf || !check)
+		die_perror("malloc");
+
+	if (fs_set_write_buffer(buffer_blocks) || fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete("append_log");
+	if (fs_create("append_log") || (fs_fd = fs_open("append_log")) < 0)
+		die("Cannot create file");
+
+	fs_io_stats(&before);
+	start = now_ns();
+	for (i = 0; i < appends; i++) {
+		if (i && i % per_file == 0) {
+			fs_close(fs_fd);
+			fs_delete("append_log");
+			fs_create("append_log");
+			fs_fd = fs_open("append_log");
+		}
+		memset(buf, i & 0xff, size);
+		if (fs_write(fs_fd, buf, size) != (int)size)
+			die("short append %zu", i);
+	}
+	if (fs_fsync(fs_fd))
+		die("Cannot sync file");
+	elapsed = (now_ns() - start) / 1e9;
+	fs_io_stats(&after);
+	*blocks_written = after.blocks_written - before.blocks_written;
+
+	/* Records of the last log file */
+	records = appends - (appends - 1) / per_file * per_file;
+	fs_lseek(fs_fd, 0);
+	if (fs_stat(fs_fd) != (int)(records * size) ||
+	    fs_read(fs_fd, check, records * size) != (int)(records * size))
+		die("log file has the wrong size");
+	for (j = 0; j < records * size; j++)
+		if ((unsigned char)check[j] !=
+		    ((appends - records + j / size) & 0xff))
+			die("log file content mismatch at %zu", j);
+
+	fs_close(fs_fd);
+	fs_delete("append_log");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+	free(check);
+	return elapsed;
+}
+
+/* Appends buffered on one fd are seen through another fd of the file */
+static void append_peer(char *diskname)
+{
+	char check[12];
+	int fd_a, fd_b;
+
+	if (fs_set_write_buffer(16) || fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete("append_peer");
+	if (fs_create("append_peer") || (fd_a = fs_open("append_peer")) < 0 ||
+	    (fd_b = fs_open("append_peer")) < 0)
+		die("Cannot create file");
+
+	if (fs_write(fd_a, "hello", 5) != 5)
+		die("short append");
+	if (fs_stat(fd_b) != 5)
+		die("append not seen by fs_stat() on another fd");
+	if (fs_read(fd_b, check, 5) != 5 || memcmp(check, "hello", 5))
+		die("append not seen by fs_read() on another fd");
+	if (fs_write(fd_a, "world", 5) != 5)
+		die("short append");
+	if (fs_lseek(fd_b, 0) || fs_read(fd_b, check, 10) != 10 ||
+	    memcmp(check, "helloworld", 10))
+		die("append not seen after fs_lseek() on another fd");
+	if (fs_write(fd_a, "!", 1) != 1 || fs_lseek(fd_b, 11) ||
+	    fs_write(fd_b, "?", 1) != 1 || fs_stat(fd_a) != 12 ||
+	    fs_lseek(fd_a, 0) || fs_read(fd_a, check, 12) != 12 ||
+	    memcmp(check, "helloworld!?", 12))
+		die("appends through two fds were not both kept");
+
+	fs_close(fd_a);
+	fs_close(fd_b);
+	fs_delete("append_peer");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t appends = 1000000, size = 64, direct_blocks, buffered_blocks;
+	double direct_s, buffered_s;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [<appends> [<append size>]]");
+	if (t_arg->argc > 1)
+		appends = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		size = get_argv(t_arg->argv[2]);
+	if (!appends || !size || size > APPEND_FILE_BYTES)
+		die("invalid number of appends or append size");
+
+	append_peer(t_arg->argv[0]);
+	direct_s = append_run(t_arg->argv[0], 0, appends, size,
+			      &direct_blocks);
+	buffered_s = append_run(t_arg->argv[0], 16, appends, size,
+				&buffered_blocks);
+
+	printf("Appends seen through every fd of the file\n");
+	printf("%zu appends of %zu bytes\n", appends, size);
+	printf("unbuffered:\t%.0f appends/s, %.1f MB/s, %zu blocks written\n",
+	       appends / direct_s, appends * size / direct_s / (1024 * 1024),
+	       direct_blocks);
+	printf("buffered:\t%.0f appends/s, %.1f MB/s, %zu blocks written\n",
+	       appends / buffered_s, appends * size / buffered_s / (1024 * 1024),
+	       buffered_blocks);
+}
+
+/* Files created by the child of the journal command before it crashes */
+#define CRASH_FILES 16
+
+static char crash_byte(int file, size_t offset)
+{
+	return 'a' + (file + offset / 1000) % 26;
+}
+
+/* Create files and sync them, then crash without unmounting */
+static void crash_child(char *diskname, size_t size, int sync)
+{
+	char name[FS_FILENAME_LEN], *buf;
+	int i, fs_fd;
+	size_t j;
+
+	buf = malloc(size);
+	if (!buf || fs_set_sync_interval(0) || fs_mount(diskname))
+		_exit(2);
+	for (i = 0; i < CRASH_FILES; i++) {
+		snprintf(name, sizeof(name), "crash_%d", i);
+		for (j = 0; j < size; j++)
+			buf[j] = crash_byte(i, j);
+		if (fs_create(name) || (fs_fd = fs_open(name)) < 0 ||
+		    fs_write(fs_fd, buf, size) != (int)size || fs_close(fs_fd))
+			_exit(2);
+	}
+	if (sync && fs_sync())
+		_exit(2);
+	_exit(0);
+}
+
+void thread_fs_journal(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char name[FS_FILENAME_LEN], *buf;
+	size_t size = 10000, j;
+	int i, status, fs_fd, sync, found;
+	pid_t pid;
+
+	if (t_arg->argc < 1)
+		die("need <diskname>");
+
+	buf = malloc(size);
+	if (!buf)
+		die_perror("malloc");
+
+	/* Files are lost in a crash until synced, and kept once synced */
+	for (sync = 0; sync <= 1; sync++) {
+		pid = fork();
+		if (pid < 0)
+			die_perror("fork");
+		if (pid == 0)
+			crash_child(t_arg->argv[0], size, sync);
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			die("child failed");
+
+		if (fs_mount(t_arg->argv[0]))
+			die("Cannot mount diskname after a crash");
+		found = 0;
+		for (i = 0; i < CRASH_FILES; i++) {
+			snprintf(name, sizeof(name), "crash_%d", i);
+			fs_fd = fs_open(name);
+			if (fs_fd < 0)
+				continue;
+			found++;
+			if (fs_read(fs_fd, buf, size) != (int)size)
+				die("file %s is truncated", name);
+			for (j = 0; j < size; j++)
+				if (buf[j] != crash_byte(i, j))
+					die("file %s is corrupted", name);
+			fs_close(fs_fd);
+			fs_delete(name);
+		}
+		if (fs_umount())
+			die("Cannot unmount diskname");
+
+		printf("%s crash: %d/%d files recovered\n",
+		       sync ? "Synced" : "Unsynced", found, CRASH_FILES);
+		if (sync && found != CRASH_FILES)
+			die("synced files were lost");
+	}
+	free(buf);
+}
+
+/* Files opened over and over by the fds command */
+#define FDS_FILES 8
+
+void thread_fs_fds(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char name[FS_FILENAME_LEN];
+	size_t count = 100000, i;
+	int *fds;
+	double start, open_s, stat_s, close_s;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [<open files>]");
+	if (t_arg->argc > 1)
+		count = get_argv(t_arg->argv[1]);
+
+	fds = malloc(count * sizeof(int));
+	if (!fds)
+		die_perror("malloc");
+	if (fs_set_open_max(count) || fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	for (i = 0; i < FDS_FILES; i++) {
+		snprintf(name, sizeof(name), "fds_%zu", i);
+		if (fs_create(name))
+			die("Cannot create file %s", name);
+	}
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "fds_%zu", i % FDS_FILES);
+		if ((fds[i] = fs_open(name)) < 0)
+			die("Cannot open fd %zu", i);
+	}
+	open_s = (now_ns() - start) / 1e9;
+	if (fs_open("fds_0") >= 0)
+		die("Opened more than %zu files", count);
+	if (!fs_delete("fds_0"))
+		die("Deleted an open file");
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		if (fs_stat(fds[i]))
+			die("Wrong size on fd %zu", i);
+	stat_s = (now_ns() - start) / 1e9;
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		if (fs_close(fds[i]))
+			die("Cannot close fd %zu", i);
+	close_s = (now_ns() - start) / 1e9;
+	if (fs_close(fds[0]) == 0 || fs_stat(fds[0]) >= 0)
+		die("Used a closed fd");
+
+	for (i = 0; i < FDS_FILES; i++) {
+		snprintf(name, sizeof(name), "fds_%zu", i);
+		if (fs_delete(name))
+			die("Cannot delete file %s", name);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	fs_set_open_max(FS_OPEN_MAX_COUNT);
+
+	printf("%zu open files\n", count);
+	printf("open:\t%.0f ns/op\n", open_s * 1e9 / count);
+	printf("stat:\t%.0f ns/op\n", stat_s * 1e9 / count);
+	printf("close:\t%.0f ns/op\n", close_s * 1e9 / count);
+	free(fds);
+}
+
+/* Size of the reads of the stats command */
+#define STATS_CHUNK 4096
+
+static void print_latency(const char *name, enum fs_op op)
+{
+	struct fs_latency lat;
+
+	if (fs_latency(op, &lat))
+		die("Cannot get latency of %s", name);
+	printf("%s:	%zu ops, p50 %llu ns, p90 %llu ns, p99 %llu ns, "
+	       "p99.9 %llu ns, max %llu ns\n", name, lat.count,
+	       (unsigned long long)lat.p50, (unsigned long long)lat.p90,
+	       (unsigned long long)lat.p99, (unsigned long long)lat.p999,
+	       (unsigned long long)lat.max);
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats st;
+	char buf[STATS_CHUNK];
+	size_t total = 0;
+	int fs_fd, read;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	if (fs_set_latency_histograms(1) || fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	fs_fd = fs_open(t_arg->argv[1]);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	while ((read = fs_read(fs_fd, buf, sizeof(buf))) > 0)
+		total += read;
+	if (read < 0 || (int)total != fs_stat(fs_fd)) {
+		fs_umount();
+		die("Cannot read file");
+	}
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_stats(&st))
+		die("Cannot get stats");
+	printf("Read file '%s' (%zu bytes)\n", t_arg->argv[1], total);
+	printf("block reads:\t%zu calls, %zu blocks\n", st.read_calls,
+	       st.blocks_read);
+	printf("block writes:\t%zu calls, %zu blocks\n", st.write_calls,
+	       st.blocks_written);
+	printf("bytes copied:\t%zu\n", st.bytes_copied);
+	printf("FAT steps:\t%zu\n", st.fat_steps);
+	printf("allocations:\t%zu, %zu words scanned\n", st.alloc_calls,
+	       st.alloc_scanned);
+	printf("name lookups:\t%zu\n", st.find_file_calls);
+	print_latency("mount", FS_OP_MOUNT);
+	print_latency("open", FS_OP_OPEN);
+	print_latency("read", FS_OP_READ);
+	print_latency("write", FS_OP_WRITE);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	fs_set_latency_histograms(0);
+}
+
+/* Directories created by the dirs command, and files in each of them */
+#define DIRS_COUNT 32
+#define DIRS_FILES 1000
+
+/* Content of a file of the dirs command, which also tells it apart */
+static int dirs_path(char *path, size_t len, int dir, int file)
+{
+	return snprintf(path, len, "/d%d/sub/f%d", dir, file);
+}
+
+void thread_fs_dirs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char path[64], check[64];
+	int dir, file, fs_fd, len;
+	double start, create_s, lookup_s;
+
+	if (t_arg->argc < 1)
+		die("need <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	start = now_ns();
+	for (dir = 0; dir < DIRS_COUNT; dir++) {
+		snprintf(path, sizeof(path), "d%d", dir);
+		if (fs_mkdir(path))
+			die("Cannot create directory %s", path);
+		snprintf(path, sizeof(path), "d%d/sub", dir);
+		if (fs_mkdir(path))
+			die("Cannot create directory %s", path);
+		for (file = 0; file < DIRS_FILES; file++) {
+			len = dirs_path(path, sizeof(path), dir, file);
+			if (fs_create(path))
+				die("Cannot create file %s", path);
+			/* Only some of the files hold data */
+			if (file % 100)
+				continue;
+			if ((fs_fd = fs_open(path)) < 0 ||
+			    fs_write(fs_fd, path, len) != len || fs_close(fs_fd))
+				die("Cannot write file %s", path);
+		}
+	}
+	create_s = (now_ns() - start) / 1e9;
+	if (!fs_create("d0/sub/f0") || !fs_create("nodir/f0") ||
+	    fs_open("d0") >= 0 || !fs_delete("d0/sub"))
+		die("Invalid directory operations succeeded");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* Everything is found again after a remount */
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	start = now_ns();
+	for (dir = 0; dir < DIRS_COUNT; dir++) {
+		for (file = 0; file < DIRS_FILES; file++) {
+			len = dirs_path(path, sizeof(path), dir, file);
+			if ((fs_fd = fs_open(path)) < 0)
+				die("Cannot open file %s", path);
+			if (fs_stat(fs_fd) != (file % 100 ? 0 : len))
+				die("file %s has the wrong size", path);
+			if (file % 100 == 0 &&
+			    (fs_read(fs_fd, check, len) != len ||
+			     memcmp(check, path, len)))
+				die("file %s is corrupted", path);
+			fs_close(fs_fd);
+		}
+	}
+	lookup_s = (now_ns() - start) / 1e9;
+	for (dir = 0; dir < DIRS_COUNT; dir++) {
+		for (file = 0; file < DIRS_FILES; file++) {
+			dirs_path(path, sizeof(path), dir, file);
+			if (fs_delete(path))
+				die("Cannot delete file %s", path);
+		}
+		snprintf(path, sizeof(path), "d%d/sub", dir);
+		if (fs_delete(path))
+			die("Cannot delete directory %s", path);
+		snprintf(path, sizeof(path), "d%d", dir);
+		if (fs_delete(path))
+			die("Cannot delete directory %s", path);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%d files in %d directories\n", DIRS_COUNT * DIRS_FILES,
+	       2 * DIRS_COUNT);
+	printf("create:\t%.0f files/s\n", DIRS_COUNT * DIRS_FILES / create_s);
+	printf("open:\t%.0f files/s\n", DIRS_COUNT * DIRS_FILES / lookup_s);
+}
+
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_delete(filename)) {
+		fs_umount();
+		die("Cannot delete file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed file '%s'\n", filename);
+}
+
+void thread_fs_add(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fd, fs_fd;
+	struct stat st;
+	int written;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	/* Open file on host computer */
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	/* Now, deal with our filesystem:
+	 * - mount, create a new file, copy content of host file into this new
+	 *   file (straight from the host file, without a buffer), close the new
+	 *   file, and umount
+	 */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	written = fs_import(fs_fd, fd, st.st_size);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+		   st.st_size);
+
+	close(fd);
+}
+
+void thread_fs_ls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_info(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [-v]");
 
 	diskname = t_arg->argv[0];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_info();
+	if (t_arg->argc > 1 && !strcmp(t_arg->argv[1], "-v"))
+		fs_info_verbose();
+	else
+		fs_info();
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -515,9 +2024,22 @@ static struct {
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "memcheck",	thread_fs_memcheck },
+	{ "iocheck",	thread_fs_iocheck },
+	{ "stress",	thread_fs_stress },
+	{ "multi",	thread_fs_multi },
+	{ "stream",	thread_fs_stream },
+	{ "aio",	thread_fs_aio },
+	{ "append",	thread_fs_append },
+	{ "journal",	thread_fs_journal },
+	{ "dirs",	thread_fs_dirs },
+	{ "fds",	thread_fs_fds },
+	{ "stats",	thread_fs_stats },
+	{ "script",	thread_fs_script },
+	{ "replay",	thread_fs_replay }
 };
 
 void usage(char *program)
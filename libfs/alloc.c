@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+
+#define WORD_BITS 64
+
+/* Free-block map, one bit per data block, set when the block is free */
+struct free_map {
+    uint64_t *words;    // Bitmap words
+    size_t nwords;      // Number of bitmap words
+    size_t nblocks;     // Number of data blocks
+    size_t hint;        // Word where the next search starts
+    size_t nfree;       // Number of free blocks
+    struct alloc_stats stats;
+};
+
+struct free_map *alloc_create(const uint32_t *fat, size_t nblocks) {
+    struct free_map *map = calloc(1, sizeof(*map));
+    if (!map) {
+        return NULL;
+    }
+    map->nwords = (nblocks + WORD_BITS - 1) / WORD_BITS;
+    map->words = calloc(map->nwords ? map->nwords : 1, sizeof(uint64_t));
+    if (!map->words) {
+        free(map);
+        return NULL;
+    }
+    map->nblocks = nblocks;
+    map->hint = 0;
+    map->nfree = 0;
+    for (size_t i = 0; i < nblocks; i++) {
+        if (fat[i] == 0) {
+            map->words[i / WORD_BITS] |= (uint64_t)1 << (i % WORD_BITS);
+        }
+    }
+    for (size_t w = 0; w < map->nwords; w++) {
+        map->nfree += __builtin_popcountll(map->words[w]);
+    }
+    return map;
+}
+
+void alloc_destroy(struct free_map *map) {
+    if (map) {
+        free(map->words);
+        free(map);
+    }
+}
+
+int alloc_block(struct free_map *map) {
+    map->stats.calls++;
+    if (map->nfree == 0) {
+        return -1;
+    }
+    // Look at 64 blocks at a time, from the hint up and then wrapping around
+    for (size_t n = 0; n < map->nwords; n++) {
+        size_t w = (map->hint + n) % map->nwords;
+        map->stats.words_scanned++;
+        if (map->words[w] != 0) {
+            int bit = __builtin_ctzll(map->words[w]);
+            map->words[w] &= ~((uint64_t)1 << bit);
+            map->nfree--;
+            map->hint = w;
+            return w * WORD_BITS + bit;
+        }
+    }
+    return -1;
+}
+
+static int is_free(struct free_map *map, size_t index) {
+    return (map->words[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+}
+
+// Find the first block at or after index whose free bit equals free_bit
+static size_t next_with(struct free_map *map, size_t index, int free_bit) {
+    while (index < map->nblocks) {
+        map->stats.words_scanned++;
+        uint64_t word = map->words[index / WORD_BITS];
+        if (!free_bit) {
+            word = ~word;
+        }
+        word &= ~(uint64_t)0 << (index % WORD_BITS);
+        if (word != 0) {
+            index = (index & ~(size_t)(WORD_BITS - 1)) + __builtin_ctzll(word);
+            break;
+        }
+        index = (index & ~(size_t)(WORD_BITS - 1)) + WORD_BITS;
+    }
+    return index < map->nblocks ? index : map->nblocks;
+}
+
+static void take(struct free_map *map, size_t start, size_t len) {
+    for (size_t i = start; i < start + len; i++) {
+        map->words[i / WORD_BITS] &= ~((uint64_t)1 << (i % WORD_BITS));
+    }
+    map->nfree -= len;
+    map->hint = (start + len) / WORD_BITS % map->nwords;
+}
+
+int alloc_run(struct free_map *map, size_t goal, size_t want, size_t *len) {
+    if (map->nfree == 0 || want == 0) {
+        map->stats.calls++;
+        return -1;
+    }
+    if (goal < map->nblocks && is_free(map, goal)) {
+        map->stats.calls++;
+        size_t end = next_with(map, goal, 0);
+        *len = (end - goal < want) ? end - goal : want;
+        take(map, goal, *len);
+        return goal;
+    }
+    if (want == 1) {
+        *len = 1;
+        return alloc_block(map);
+    }
+    map->stats.calls++;
+    // Walk the free runs, keeping the smallest one that fits, or else the
+    // largest one
+    size_t best_start = 0;
+    size_t best_len = 0;
+    size_t start = next_with(map, 0, 1);
+    while (start < map->nblocks) {
+        size_t end = next_with(map, start, 0);
+        size_t run = end - start;
+        if (run == want) {
+            best_start = start;
+            best_len = run;
+            break;
+        }
+        if ((run > want && (best_len < want || run < best_len)) ||
+            (best_len < want && run > best_len)) {
+            best_start = start;
+            best_len = run;
+        }
+        start = next_with(map, end, 1);
+    }
+    *len = (best_len < want) ? best_len : want;
+    take(map, best_start, *len);
+    return best_start;
+}
+
+void alloc_release(struct free_map *map, size_t index) {
+    if (index >= map->nblocks) {
+        return;
+    }
+    uint64_t mask = (uint64_t)1 << (index % WORD_BITS);
+    if (!(map->words[index / WORD_BITS] & mask)) {
+        map->words[index / WORD_BITS] |= mask;
+        map->nfree++;
+    }
+}
+
+size_t alloc_free_count(struct free_map *map) {
+    return map->nfree;
+}
+
+void alloc_get_stats(struct free_map *map, struct alloc_stats *stats) {
+    *stats = map->stats;
+}
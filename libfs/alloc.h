@@ -0,0 +1,93 @@
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint32_t definition */
+
+/* Free-block map counters */
+struct alloc_stats {
+    size_t calls;           // Allocation requests
+    size_t words_scanned;   // Bitmap words (64 blocks each) looked at
+};
+
+/*
+ * Each mounted file system has its own free-block map. A map is not locked:
+ * callers must serialize allocations and releases (see fat_lock in fs.c).
+ */
+struct free_map;
+
+/**
+ * alloc_create - Build a free-block map
+ * @fat: FAT entries of the mounted file system
+ * @nblocks: Number of data blocks (and of FAT entries)
+ *
+ * Scan the FAT once and record which data blocks are free (entry set to 0), so
+ * that blocks can later be allocated without scanning the FAT again.
+ *
+ * Return: NULL if the map cannot be allocated. Otherwise, the new map.
+ */
+struct free_map *alloc_create(const uint32_t *fat, size_t nblocks);
+
+/**
+ * alloc_destroy - Release a free-block map
+ * @map: Free-block map
+ */
+void alloc_destroy(struct free_map *map);
+
+/**
+ * alloc_block - Allocate a data block
+ * @map: Free-block map
+ *
+ * Find a free data block, starting from where the previous allocation left
+ * off, and mark it as used. The caller is responsible for updating the FAT.
+ *
+ * Return: -1 if there is no free data block left. Otherwise, the index of the
+ * allocated block.
+ */
+int alloc_block(struct free_map *map);
+
+/**
+ * alloc_run - Allocate a run of contiguous data blocks
+ * @map: Free-block map
+ * @goal: Preferred first block, usually the one right after the end of a file
+ * @want: Number of blocks wanted
+ * @len: Set to the number of blocks actually allocated
+ *
+ * Allocate up to @want free data blocks that directly follow each other on
+ * disk, and mark them as used. If block @goal is free, the run starts there so
+ * that a growing file stays contiguous. Otherwise, the smallest free run that
+ * can hold @want blocks is used (best fit), or the largest free run if none is
+ * big enough; the caller then asks again for the remaining blocks. The caller
+ * is responsible for updating the FAT.
+ *
+ * Return: -1 if there is no free data block left. Otherwise, the index of the
+ * first block of the run.
+ */
+int alloc_run(struct free_map *map, size_t goal, size_t want, size_t *len);
+
+/**
+ * alloc_release - Give a data block back
+ * @map: Free-block map
+ * @index: Index of the data block
+ */
+void alloc_release(struct free_map *map, size_t index);
+
+/**
+ * alloc_free_count - Get the number of free data blocks
+ * @map: Free-block map
+ *
+ * Return: The number of free data blocks.
+ */
+size_t alloc_free_count(struct free_map *map);
+
+/**
+ * alloc_get_stats - Get the free-block map counters
+ * @map: Free-block map
+ * @stats: Counters to be filled in
+ *
+ * The average scan length of an allocation is @stats->words_scanned /
+ * @stats->calls.
+ */
+void alloc_get_stats(struct free_map *map, struct alloc_stats *stats);
+
+#endif /* _ALLOC_H */
@@ -0,0 +1,348 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define NO_FRAME -1
+
+/* One cached block */
+struct frame {
+    size_t block;   // Disk block held by this frame
+    int next;       // Next frame in the same hash bucket
+    uint8_t valid;  // Frame holds a block
+    uint8_t dirty;  // Block was modified since it was read
+    uint8_t ref;    // CLOCK reference bit
+    uint8_t busy;   // Block is being read or written back, without the lock
+};
+
+/* Block cache instance */
+struct cache {
+    size_t nframes;         // Number of frames
+    size_t nbuckets;        // Number of hash buckets (power of two)
+    size_t hand;            // CLOCK hand
+    struct frame *frames;   // Frame descriptors
+    int *buckets;           // Hash bucket heads
+    uint8_t *data;          // Block contents, block_size per frame
+    size_t block_size;      // Size of a block of the disk
+    disk_t disk;            // Disk the blocks come from
+    pthread_mutex_t lock;   // Protects the frames, but is not held during I/O
+    pthread_cond_t io_done; // Signaled when a frame stops being busy
+    struct cache_stats stats;
+};
+
+static size_t bucket_of(struct cache *cache, size_t block) {
+    return (block * 2654435761u) & (cache->nbuckets - 1);
+}
+
+static int lookup(struct cache *cache, size_t block) {
+    int i = cache->buckets[bucket_of(cache, block)];
+    while (i != NO_FRAME && cache->frames[i].block != block) {
+        i = cache->frames[i].next;
+    }
+    return i;
+}
+
+static void unhash(struct cache *cache, int frame) {
+    int *link = &cache->buckets[bucket_of(cache, cache->frames[frame].block)];
+    while (*link != frame) {
+        link = &cache->frames[*link].next;
+    }
+    *link = cache->frames[frame].next;
+}
+
+// Wait until a busy frame is done with its I/O, which drops the lock meanwhile
+static void wait_io(struct cache *cache) {
+    pthread_cond_wait(&cache->io_done, &cache->lock);
+}
+
+// Start I/O on @frame: other threads wait for it instead of touching the frame
+static uint8_t *start_io(struct cache *cache, int frame) {
+    cache->frames[frame].busy = 1;
+    pthread_mutex_unlock(&cache->lock);
+    return &cache->data[frame * cache->block_size];
+}
+
+static void end_io(struct cache *cache, int frame) {
+    pthread_mutex_lock(&cache->lock);
+    cache->frames[frame].busy = 0;
+    pthread_cond_broadcast(&cache->io_done);
+}
+
+// Write back a dirty frame, without the lock during the write
+static int writeback(struct cache *cache, int frame) {
+    size_t block = cache->frames[frame].block;
+    uint8_t *data = start_io(cache, frame);
+    int ret = block_write_h(cache->disk, block, data);
+    end_io(cache, frame);
+    if (ret != 0) {
+        return -1;
+    }
+    cache->frames[frame].dirty = 0;
+    cache->stats.writebacks++;
+    return 0;
+}
+
+// Pick a frame to evict using CLOCK, NO_FRAME if every frame is busy
+static int pick_victim(struct cache *cache) {
+    for (size_t steps = 0; steps < 2 * cache->nframes; steps++) {
+        struct frame *f = &cache->frames[cache->hand];
+        int frame = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->nframes;
+        if (f->busy) {
+            continue;
+        }
+        if (!f->valid || !f->ref) {
+            return frame;
+        }
+        f->ref = 0;
+    }
+    return NO_FRAME;
+}
+
+// Give a clean frame to @block, evicting its previous block if needed
+static void assign(struct cache *cache, int frame, size_t block) {
+    struct frame *f = &cache->frames[frame];
+    if (f->valid) {
+        unhash(cache, frame);
+        cache->stats.evictions++;
+    }
+    size_t b = bucket_of(cache, block);
+    f->block = block;
+    f->valid = 1;
+    f->dirty = 0;
+    f->ref = 1;
+    f->next = cache->buckets[b];
+    cache->buckets[b] = frame;
+}
+
+struct cache *cache_create(disk_t disk, size_t nblocks) {
+    if (nblocks == 0) {
+        return NULL;
+    }
+    struct cache *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->nbuckets = 1;
+    while (cache->nbuckets < nblocks * 2) {
+        cache->nbuckets <<= 1;
+    }
+    cache->frames = calloc(nblocks, sizeof(struct frame));
+    cache->buckets = malloc(cache->nbuckets * sizeof(int));
+    cache->block_size = block_disk_block_size_h(disk);
+    cache->data = malloc(nblocks * cache->block_size);
+    if (!cache->frames || !cache->buckets || !cache->data) {
+        free(cache->frames);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache);
+        return NULL;
+    }
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        cache->buckets[i] = NO_FRAME;
+    }
+    cache->nframes = nblocks;
+    cache->disk = disk;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->io_done, NULL);
+    return cache;
+}
+
+int cache_destroy(struct cache *cache) {
+    if (!cache) {
+        return 0;
+    }
+    int ret = cache_flush(cache);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->io_done);
+    free(cache->frames);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache);
+    return ret;
+}
+
+// Find the frame holding @block, bringing it in from the disk if @load is set.
+// The lock is dropped while blocks are read or written back, so that threads
+// working on other blocks do not wait for that I/O.
+static int get_frame(struct cache *cache, size_t block, int load) {
+    int counted = 0;
+    int cleaned = NO_FRAME;
+    for (;;) {
+        int frame = lookup(cache, block);
+        if (frame != NO_FRAME) {
+            if (cache->frames[frame].busy) {
+                wait_io(cache);
+                continue;
+            }
+            if (!counted) {
+                cache->stats.hits++;
+            }
+            cache->frames[frame].ref = 1;
+            return frame;
+        }
+        if (!counted) {
+            cache->stats.misses++;
+            counted = 1;
+        }
+        // Reuse the frame written back for @block, unless it was taken since
+        frame = cleaned;
+        if (frame == NO_FRAME || cache->frames[frame].busy ||
+            cache->frames[frame].dirty) {
+            frame = pick_victim(cache);
+        }
+        cleaned = NO_FRAME;
+        if (frame == NO_FRAME) {
+            wait_io(cache);
+            continue;
+        }
+        if (cache->frames[frame].valid && cache->frames[frame].dirty) {
+            // Another thread may bring @block in meanwhile, so look it up again
+            if (writeback(cache, frame) != 0) {
+                return NO_FRAME;
+            }
+            cleaned = frame;
+            continue;
+        }
+        assign(cache, frame, block);
+        if (load) {
+            uint8_t *data = start_io(cache, frame);
+            int ret = block_read_h(cache->disk, block, data);
+            end_io(cache, frame);
+            if (ret != 0) {
+                unhash(cache, frame);
+                cache->frames[frame].valid = 0;
+                return NO_FRAME;
+            }
+        }
+        return frame;
+    }
+}
+
+int cache_read_part(struct cache *cache, size_t block, size_t offset,
+                    void *buf, size_t len) {
+    if (!cache) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache->lock);
+    int frame = get_frame(cache, block, 1);
+    if (frame != NO_FRAME) {
+        memcpy(buf, &cache->data[frame * cache->block_size + offset], len);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return frame == NO_FRAME ? -1 : 0;
+}
+
+int cache_write_part(struct cache *cache, size_t block, size_t offset,
+                     const void *buf, size_t len) {
+    if (!cache) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache->lock);
+    // A whole-block write does not need the old content
+    int frame = get_frame(cache, block, len != cache->block_size);
+    if (frame != NO_FRAME) {
+        memcpy(&cache->data[frame * cache->block_size + offset], buf, len);
+        cache->frames[frame].dirty = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return frame == NO_FRAME ? -1 : 0;
+}
+
+int cache_write_fresh(struct cache *cache, size_t block, size_t offset,
+                      const void *buf, size_t len) {
+    if (!cache) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache->lock);
+    int frame = get_frame(cache, block, 0);
+    if (frame != NO_FRAME) {
+        uint8_t *data = &cache->data[frame * cache->block_size];
+        memset(data, 0, offset);
+        memcpy(&data[offset], buf, len);
+        memset(&data[offset + len], 0, cache->block_size - offset - len);
+        cache->frames[frame].dirty = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return frame == NO_FRAME ? -1 : 0;
+}
+
+size_t cache_capacity(struct cache *cache) {
+    return cache ? cache->nframes : 0;
+}
+
+int cache_sync_range(struct cache *cache, size_t block, size_t nblocks) {
+    int ret = 0;
+    if (!cache) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    for (size_t b = block; b < block + nblocks; b++) {
+        int frame;
+        while ((frame = lookup(cache, b)) != NO_FRAME &&
+               cache->frames[frame].busy) {
+            wait_io(cache);
+        }
+        if (frame != NO_FRAME && cache->frames[frame].dirty) {
+            if (writeback(cache, frame) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+void cache_drop_range(struct cache *cache, size_t block, size_t nblocks) {
+    if (!cache) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    for (size_t b = block; b < block + nblocks; b++) {
+        int frame;
+        while ((frame = lookup(cache, b)) != NO_FRAME &&
+               cache->frames[frame].busy) {
+            wait_io(cache);
+        }
+        if (frame != NO_FRAME) {
+            unhash(cache, frame);
+            cache->frames[frame].valid = 0;
+            cache->frames[frame].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int cache_flush(struct cache *cache) {
+    int ret = 0;
+    if (!cache) {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->nframes; i++) {
+        while (cache->frames[i].busy) {
+            wait_io(cache);
+        }
+        if (cache->frames[i].valid && cache->frames[i].dirty) {
+            if (writeback(cache, i) != 0) {
+                ret = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats) {
+    if (!cache) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
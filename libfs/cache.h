@@ -0,0 +1,151 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/** Default number of blocks held by the block cache */
+#define CACHE_DEFAULT_BLOCKS 64
+
+/* Block cache counters */
+struct cache_stats {
+    size_t hits;        // Lookups served from the cache
+    size_t misses;      // Lookups that had to go to the disk
+    size_t evictions;   // Blocks pushed out to make room
+    size_t writebacks;  // Dirty blocks written back to the disk
+};
+
+/*
+ * Each mounted file system has its own cache. A NULL cache stands for a
+ * disabled one: every function below accepts it, the part functions then fail
+ * and the others do nothing.
+ */
+struct cache;
+
+/**
+ * cache_create - Set up a block cache
+ * @disk: Virtual disk the blocks are read from and written back to
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Allocate a write-back cache of @nblocks blocks sitting in front of
+ * block_read_h() and block_write_h() on @disk. The blocks have the block size
+ * of @disk at the time the cache is created.
+ *
+ * Return: NULL if @nblocks is 0 or if the cache cannot be allocated. Otherwise,
+ * the new cache.
+ */
+struct cache *cache_create(disk_t disk, size_t nblocks);
+
+/**
+ * cache_destroy - Tear down a block cache
+ * @cache: Block cache
+ *
+ * Write back every dirty block and release the cache memory.
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_destroy(struct cache *cache);
+
+/**
+ * cache_capacity - Get the size of a cache
+ * @cache: Block cache
+ *
+ * Return: The number of blocks the cache can hold, 0 if it is disabled.
+ */
+size_t cache_capacity(struct cache *cache);
+
+/**
+ * cache_read_part - Read part of a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to read from
+ * @offset: Offset of the data in the block
+ * @buf: Data buffer to be filled with @len bytes of the block
+ * @len: Number of bytes to read
+ *
+ * The data is copied straight out of the cached block, which is brought in
+ * from the disk on a miss.
+ *
+ * Return: -1 if the cache is disabled, or if the block cannot be read from the
+ * disk. 0 otherwise.
+ */
+int cache_read_part(struct cache *cache, size_t block, size_t offset,
+                    void *buf, size_t len);
+
+/**
+ * cache_write_part - Write part of a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to write to
+ * @offset: Offset of the data in the block
+ * @buf: Data buffer holding the @len bytes to write
+ * @len: Number of bytes to write
+ *
+ * The data is copied straight into the cached block, which is then marked
+ * dirty; it reaches the disk when it is evicted or when the cache is flushed.
+ * Unless the whole block is written, a missing block is first read from the
+ * disk.
+ *
+ * Return: -1 if the cache is disabled, if the block cannot be read from the
+ * disk, or if a dirty block could not be evicted. 0 otherwise.
+ */
+int cache_write_part(struct cache *cache, size_t block, size_t offset,
+                     const void *buf, size_t len);
+
+/**
+ * cache_write_fresh - Write part of a block holding no data yet
+ * @cache: Block cache
+ * @block: Index of the block to write to
+ * @offset: Offset of the data in the block
+ * @buf: Data buffer holding the @len bytes to write
+ * @len: Number of bytes to write
+ *
+ * Same as cache_write_part(), for a block whose content outside of the written
+ * bytes does not matter: the block is never read from the disk, and the rest
+ * of it is zeroed.
+ *
+ * Return: -1 if the cache is disabled, or if a dirty block could not be
+ * evicted. 0 otherwise.
+ */
+int cache_write_fresh(struct cache *cache, size_t block, size_t offset,
+                      const void *buf, size_t len);
+
+/**
+ * cache_sync_range - Write back cached blocks of a run
+ * @cache: Block cache
+ * @block: Index of the first block of the run
+ * @nblocks: Number of blocks in the run
+ *
+ * Write back the dirty blocks of the run so that it can be read directly from
+ * the disk.
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_sync_range(struct cache *cache, size_t block, size_t nblocks);
+
+/**
+ * cache_drop_range - Forget cached blocks of a run
+ * @cache: Block cache
+ * @block: Index of the first block of the run
+ * @nblocks: Number of blocks in the run
+ *
+ * Drop the cached copies of a run that was just written directly to the disk,
+ * discarding any dirty content they held.
+ */
+void cache_drop_range(struct cache *cache, size_t block, size_t nblocks);
+
+/**
+ * cache_flush - Write back all dirty blocks
+ * @cache: Block cache
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_flush(struct cache *cache);
+
+/**
+ * cache_get_stats - Get the cache counters
+ * @cache: Block cache
+ * @stats: Counters to be filled in
+ */
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
@@ -1,144 +1,1184 @@
+#define _GNU_SOURCE /* for copy_file_range() */
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* io_uring is used through raw system calls, unless built with -DNO_IO_URING */
+#if defined(__linux__) && !defined(NO_IO_URING) && \
+	__has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+/* Pulled in through <linux/fs.h>, and not our block size */
+#undef BLOCK_SIZE
+#endif
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Size of the buffer of block_copy_in_h()/block_copy_out_h() when the kernel
+ * cannot copy by itself */
+#define COPY_BUFFER_SIZE (1 << 20)
+
+/* Largest vector accepted by block_readv()/block_writev() */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
-	/* Block count */
+	/* Block size and count */
+	size_t block_size;
 	size_t bcount;
+	/* Whole image mapping (memory-mapped backend only) */
+	uint8_t *map;
+	/* Asynchronous engine, started by the first block_submit_h() */
+	struct aio *aio;
+	pthread_mutex_t aio_lock;
+	/* I/O counters of this disk only */
+	struct block_stats stats;
+};
+
+/* Worker threads of the thread-pool engine */
+#define AIO_WORKERS 4
+
+/* Requested submission queue depth of the io_uring engine */
+#define AIO_RING_DEPTH 128
+
+/* Run of a batch, as tracked while in flight */
+struct aio_run {
+	struct aio_batch *batch;
+	size_t block;
+	struct iovec iov;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Batch of runs submitted together by block_submit_h() */
+struct aio_batch {
+	/* Next batch waiting for a worker */
+	struct aio_batch *next;
+	int is_write;
+	/* Runs not completed yet (io_uring engine) */
+	int pending;
+	int ret;
+	block_done_t done;
+	void *arg;
+	int nruns;
+	struct aio_run runs[];
+};
+
+/* Asynchronous engine of a disk: an io_uring, or else a pool of workers */
+struct aio {
+	pthread_mutex_t lock;
+	/* Batches submitted and not completed yet */
+	unsigned batches;
+	/* Signaled when the last batch in flight completes */
+	pthread_cond_t idle;
+	int stop;
+
+	/* Thread-pool engine */
+	pthread_t workers[AIO_WORKERS];
+	int nworkers;
+	struct aio_batch *head, *tail;
+	pthread_cond_t work;
+
+	/* io_uring engine (ring_fd is -1 when the pool is used) */
+	int ring_fd;
+	/* Entries in flight, and signaled when some complete */
+	unsigned inflight;
+	pthread_cond_t room;
+#ifdef HAVE_IO_URING
+	pthread_t reaper;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+static void aio_stop(disk_t disk);
+
+/* Virtual disk of the block_*() functions without a handle */
+static disk_t default_disk;
+
+/* I/O counters, summed over all disks */
+static struct block_stats stats;
+
+/* Account for I/O requests in the counters of the disk and in the global ones */
+static void count_io(disk_t disk, int is_write, size_t calls, size_t nblocks)
+{
+	struct block_stats *both[] = { &stats, &disk->stats };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (is_write) {
+			__atomic_fetch_add(&both[i]->write_calls, calls,
+					   __ATOMIC_RELAXED);
+			__atomic_fetch_add(&both[i]->blocks_written, nblocks,
+					   __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_add(&both[i]->read_calls, calls,
+					   __ATOMIC_RELAXED);
+			__atomic_fetch_add(&both[i]->blocks_read, nblocks,
+					   __ATOMIC_RELAXED);
+		}
+	}
+}
 
 int block_disk_open(const char *diskname)
 {
+	return block_disk_open_backend(diskname, BLOCK_BACKEND_FILE);
+}
+
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
+	if (default_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	default_disk = block_disk_open_h(diskname, backend);
+
+	return default_disk ? 0 : -1;
+}
+
+disk_t block_disk_open_h(const char *diskname, enum block_backend backend)
+{
+	struct disk *disk;
 	int fd;
 	struct stat st;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
-	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk = calloc(1, sizeof(*disk));
+	if (!disk) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
 
-	return 0;
+	if (backend == BLOCK_BACKEND_MMAP && st.st_size > 0) {
+		disk->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		if (disk->map == MAP_FAILED) {
+			perror("mmap");
+			free(disk);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	disk->fd = fd;
+	disk->block_size = BLOCK_SIZE;
+	disk->bcount = st.st_size / BLOCK_SIZE;
+	pthread_mutex_init(&disk->aio_lock, NULL);
+
+	return disk;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret = block_disk_close_h(default_disk);
+
+	default_disk = NULL;
+
+	return ret;
+}
+
+int block_disk_close_h(disk_t disk)
+{
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk->aio)
+		aio_stop(disk);
+	pthread_mutex_destroy(&disk->aio_lock);
 
-	disk.fd = INVALID_FD;
+	if (disk->map) {
+		block_disk_sync_h(disk);
+		munmap(disk->map, disk->bcount * disk->block_size);
+	}
+
+	close(disk->fd);
+	free(disk);
 
 	return 0;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	return block_disk_count_h(default_disk);
+}
+
+int block_disk_count_h(disk_t disk)
+{
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bcount;
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_set_block_size(size_t block_size)
+{
+	return block_disk_set_block_size_h(default_disk, block_size);
+}
+
+int block_disk_set_block_size_h(disk_t disk, size_t block_size)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t bytes;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block_size < BLOCK_SIZE || block_size > BLOCK_SIZE_MAX ||
+	    (block_size & (block_size - 1))) {
+		block_error("invalid block size '%zu'", block_size);
+		return -1;
+	}
+
+	bytes = disk->bcount * disk->block_size;
+	if (bytes % block_size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    bytes, block_size);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	disk->block_size = block_size;
+	disk->bcount = bytes / block_size;
+
+	return 0;
+}
+
+size_t block_disk_block_size(void)
+{
+	return block_disk_block_size_h(default_disk);
+}
+
+size_t block_disk_block_size_h(disk_t disk)
+{
+	return disk ? disk->block_size : 0;
+}
+
+int block_disk_sync(void)
+{
+	return block_disk_sync_h(default_disk);
+}
+
+int block_disk_sync_h(disk_t disk)
+{
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (disk->map &&
+	    msync(disk->map, disk->bcount * disk->block_size, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+
+	if (!disk->map && fdatasync(disk->fd)) {
+		perror("fdatasync");
 		return -1;
 	}
 
 	return 0;
 }
 
+void *block_ptr(size_t block)
+{
+	return block_ptr_h(default_disk, block);
+}
+
+void *block_ptr_h(disk_t disk, size_t block)
+{
+	if (!disk || !disk->map || block >= disk->bcount)
+		return NULL;
+
+	return disk->map + block * disk->block_size;
+}
+
+int block_prefetch(size_t block, size_t nblocks)
+{
+	return block_prefetch_h(default_disk, block, nblocks);
+}
+
+int block_prefetch_h(disk_t disk, size_t block, size_t nblocks)
+{
+	int ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk->bcount || nblocks > disk->bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, nblocks, disk->bcount);
+		return -1;
+	}
+
+	/* Only a hint, the blocks are brought in by the kernel */
+	if (disk->map) {
+		if (madvise(disk->map + block * disk->block_size,
+			    nblocks * disk->block_size, MADV_WILLNEED)) {
+			perror("madvise");
+			return -1;
+		}
+	} else {
+		ret = posix_fadvise(disk->fd, (off_t)block * disk->block_size,
+				    (off_t)nblocks * disk->block_size,
+				    POSIX_FADV_WILLNEED);
+		if (ret) {
+			errno = ret;
+			perror("posix_fadvise");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_write_h(default_disk, block, buf);
+}
+
+int block_write_h(disk_t disk, size_t block, const void *buf)
+{
+	struct iovec iov;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = disk->block_size;
+
+	return block_writev_h(disk, block, &iov, 1);
+}
+
 int block_read(size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	return block_read_h(default_disk, block, buf);
+}
+
+int block_read_h(disk_t disk, size_t block, void *buf)
+{
+	struct iovec iov;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = disk->block_size;
+
+	return block_readv_h(disk, block, &iov, 1);
+}
+
+/* Check a vectored request and return the number of blocks it spans */
+static ssize_t check_iov(disk_t disk, size_t block, const struct iovec *iov,
+			 int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		block_error("invalid vector count (%d)", iovcnt);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len == 0 || len % disk->block_size != 0) {
+		block_error("length '%zu' is not multiple of '%zu'",
+			    len, disk->block_size);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (block >= disk->bcount ||
+	    len / disk->block_size > disk->bcount - block) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, len / disk->block_size, disk->bcount);
 		return -1;
 	}
 
+	return len / disk->block_size;
+}
+
+/*
+ * Transfer a whole vector at the block's position, resuming after short reads
+ * or writes. A single preadv()/pwritev() covers the common case.
+ */
+static int transfer_iov(disk_t disk, int is_write, off_t pos,
+			const struct iovec *iov, int iovcnt)
+{
+	struct iovec cur[iovcnt];
+	struct iovec *v = cur;
+	ssize_t ret;
+	int i;
+
+	/* Memory-mapped disk, simply copy from or into the mapping */
+	if (disk->map) {
+		for (i = 0; i < iovcnt; i++) {
+			if (is_write)
+				memcpy(disk->map + pos, iov[i].iov_base,
+				       iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, disk->map + pos,
+				       iov[i].iov_len);
+			pos += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	memcpy(cur, iov, iovcnt * sizeof(struct iovec));
+
+	while (iovcnt > 0) {
+		if (is_write)
+			ret = pwritev(disk->fd, v, iovcnt, pos);
+		else
+			ret = preadv(disk->fd, v, iovcnt, pos);
+		if (ret < 0) {
+			perror(is_write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at offset %lld",
+				    (long long)pos);
+			return -1;
+		}
+		pos += ret;
+
+		/* Skip over what was transferred */
+		while (iovcnt > 0 && (size_t)ret >= v->iov_len) {
+			ret -= v->iov_len;
+			v++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			v->iov_base = (char *)v->iov_base + ret;
+			v->iov_len -= ret;
+		}
+	}
+
 	return 0;
 }
 
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return block_writev_h(default_disk, block, iov, iovcnt);
+}
+
+int block_writev_h(disk_t disk, size_t block, const struct iovec *iov,
+		   int iovcnt)
+{
+	ssize_t nblocks = check_iov(disk, block, iov, iovcnt);
+
+	if (nblocks < 0)
+		return -1;
+
+	count_io(disk, 1, 1, nblocks);
+
+	return transfer_iov(disk, 1, (off_t)block * disk->block_size, iov,
+			    iovcnt);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return block_readv_h(default_disk, block, iov, iovcnt);
+}
+
+int block_readv_h(disk_t disk, size_t block, const struct iovec *iov,
+		  int iovcnt)
+{
+	ssize_t nblocks = check_iov(disk, block, iov, iovcnt);
+
+	if (nblocks < 0)
+		return -1;
+
+	count_io(disk, 0, 1, nblocks);
+
+	return transfer_iov(disk, 0, (off_t)block * disk->block_size, iov,
+			    iovcnt);
+}
+
+/* Check a byte range and return the number of blocks it spans */
+static ssize_t check_range(disk_t disk, size_t block, size_t offset,
+			   size_t len)
+{
+	size_t end;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	end = offset + len;
+	if (len == 0 || block >= disk->bcount || end < offset ||
+	    (end + disk->block_size - 1) / disk->block_size >
+	    disk->bcount - block) {
+		block_error("byte range out of bounds (%zu+%zu+%zu)",
+			    block, offset, len);
+		return -1;
+	}
+
+	return (end + disk->block_size - 1) / disk->block_size;
+}
+
+/* Write a whole buffer to a file descriptor, at its file offset */
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Copy through a buffer, for when the kernel cannot do it by itself */
+static ssize_t copy_buffered(disk_t disk, int is_in, off_t pos, size_t len,
+			     int fd)
+{
+	size_t chunk = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+	size_t done = 0;
+	uint8_t *buf;
+	ssize_t ret = 0;
+
+	buf = malloc(chunk);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+
+	while (done < len) {
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = len - done < chunk ? len - done : chunk
+		};
+
+		if (is_in) {
+			ret = read(fd, buf, iov.iov_len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				perror("read");
+			if (ret <= 0)
+				break;
+			iov.iov_len = ret;
+			if (transfer_iov(disk, 1, pos, &iov, 1)) {
+				ret = -1;
+				break;
+			}
+		} else {
+			if (transfer_iov(disk, 0, pos, &iov, 1) ||
+			    write_all(fd, buf, iov.iov_len)) {
+				ret = -1;
+				break;
+			}
+		}
+		pos += iov.iov_len;
+		done += iov.iov_len;
+	}
+
+	free(buf);
+	return ret < 0 ? -1 : (ssize_t)done;
+}
+
+ssize_t block_copy_in_h(disk_t disk, size_t block, size_t offset, size_t len,
+			int fd)
+{
+	ssize_t nblocks = check_range(disk, block, offset, len);
+	off_t pos;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (nblocks < 0)
+		return -1;
+
+	count_io(disk, 1, 1, nblocks);
+	pos = (off_t)block * disk->block_size + offset;
+
+	/* Memory-mapped disk, read straight into the mapping */
+	if (disk->map) {
+		while (done < len) {
+			ret = read(fd, disk->map + pos + done, len - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				perror("read");
+				return -1;
+			}
+			if (ret == 0)
+				break;
+			done += ret;
+		}
+		return done;
+	}
+
+	while (done < len) {
+		ret = copy_file_range(fd, NULL, disk->fd, &pos, len - done, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && done == 0 &&
+		    (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+		     errno == EOPNOTSUPP || errno == EBADF))
+			return copy_buffered(disk, 1, pos, len, fd);
+		if (ret < 0) {
+			perror("copy_file_range");
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+ssize_t block_copy_out_h(disk_t disk, size_t block, size_t offset, size_t len,
+			 int fd)
+{
+	ssize_t nblocks = check_range(disk, block, offset, len);
+	off_t pos;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (nblocks < 0)
+		return -1;
+
+	count_io(disk, 0, 1, nblocks);
+	pos = (off_t)block * disk->block_size + offset;
+
+	/* The mapping is shared, so the file holds its latest content */
+	while (done < len) {
+		ret = sendfile(fd, disk->fd, &pos, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && done == 0 &&
+		    (errno == EINVAL || errno == ENOSYS))
+			return copy_buffered(disk, 0, pos, len, fd);
+		if (ret <= 0) {
+			if (ret < 0)
+				perror("sendfile");
+			else
+				block_error("unexpected end of disk at offset "
+					    "%lld", (long long)pos);
+			return -1;
+		}
+		done += ret;
+	}
+
+	return done;
+}
+
+static void load_stats(const struct block_stats *in, struct block_stats *out)
+{
+	out->read_calls = __atomic_load_n(&in->read_calls, __ATOMIC_RELAXED);
+	out->write_calls = __atomic_load_n(&in->write_calls, __ATOMIC_RELAXED);
+	out->blocks_read = __atomic_load_n(&in->blocks_read, __ATOMIC_RELAXED);
+	out->blocks_written = __atomic_load_n(&in->blocks_written,
+					      __ATOMIC_RELAXED);
+}
+
+void block_get_stats(struct block_stats *out)
+{
+	load_stats(&stats, out);
+}
+
+void block_disk_stats_h(disk_t disk, struct block_stats *out)
+{
+	load_stats(&disk->stats, out);
+}
+
+/* Complete a batch and account for it */
+static void batch_finish(struct aio *aio, struct aio_batch *batch)
+{
+	batch->done(batch->arg, batch->ret);
+	free(batch);
+
+	pthread_mutex_lock(&aio->lock);
+	if (--aio->batches == 0)
+		pthread_cond_broadcast(&aio->idle);
+	pthread_mutex_unlock(&aio->lock);
+}
+
+/* Worker of the thread-pool engine, running queued batches one at a time */
+static void *aio_worker(void *arg)
+{
+	disk_t disk = arg;
+	struct aio *aio = disk->aio;
+	struct aio_batch *batch;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&aio->lock);
+		while (!aio->head && !aio->stop)
+			pthread_cond_wait(&aio->work, &aio->lock);
+		batch = aio->head;
+		if (batch) {
+			aio->head = batch->next;
+			if (!aio->head)
+				aio->tail = NULL;
+		}
+		pthread_mutex_unlock(&aio->lock);
+		if (!batch)
+			return NULL;
+
+		for (i = 0; i < batch->nruns; i++)
+			if (transfer_iov(disk, batch->is_write,
+					 (off_t)batch->runs[i].block
+					 * disk->block_size,
+					 &batch->runs[i].iov, 1))
+				batch->ret = -1;
+		batch_finish(aio, batch);
+	}
+}
+
+#ifdef HAVE_IO_URING
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+/* Set up the rings shared with the kernel */
+static int ring_setup(struct aio *aio)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, AIO_RING_DEPTH, &p);
+	if (fd < 0)
+		return -1;
+	if (p.cq_entries < 2 * p.sq_entries) {
+		close(fd);
+		return -1;
+	}
+
+	aio->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	aio->cq_ring_size = p.cq_off.cqes +
+			    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aio->cq_ring_size > aio->sq_ring_size)
+			aio->sq_ring_size = aio->cq_ring_size;
+		aio->cq_ring_size = aio->sq_ring_size;
+	}
+
+	aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (aio->sq_ring == MAP_FAILED)
+		goto err_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		aio->cq_ring = aio->sq_ring;
+	} else {
+		aio->cq_ring = mmap(NULL, aio->cq_ring_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, fd,
+				    IORING_OFF_CQ_RING);
+		if (aio->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+	aio->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+			 IORING_OFF_SQES);
+	if (aio->sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = aio->sq_ring;
+	aio->sq_head = (unsigned *)(sq + p.sq_off.head);
+	aio->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	aio->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	aio->sq_array = (unsigned *)(sq + p.sq_off.array);
+	aio->sq_entries = p.sq_entries;
+	cq = aio->cq_ring;
+	aio->cq_head = (unsigned *)(cq + p.cq_off.head);
+	aio->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	aio->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	aio->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	aio->ring_fd = fd;
+
+	return 0;
+
+err_cq:
+	if (aio->cq_ring != aio->sq_ring)
+		munmap(aio->cq_ring, aio->cq_ring_size);
+err_sq:
+	munmap(aio->sq_ring, aio->sq_ring_size);
+err_close:
+	close(fd);
+	return -1;
+}
+
+static void ring_teardown(struct aio *aio)
+{
+	munmap(aio->sqes, aio->sq_entries * sizeof(struct io_uring_sqe));
+	if (aio->cq_ring != aio->sq_ring)
+		munmap(aio->cq_ring, aio->cq_ring_size);
+	munmap(aio->sq_ring, aio->sq_ring_size);
+	close(aio->ring_fd);
+}
+
+/* Hand the @queued entries added to the submission queue to the kernel */
+static void ring_flush(struct aio *aio, unsigned tail, unsigned queued)
+{
+	int ret;
+
+	__atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+	while (queued > 0) {
+		ret = ring_enter(aio->ring_fd, queued, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("io_uring_enter");
+			return;
+		}
+		queued -= ret;
+	}
+}
+
+/*
+ * Queue one entry per run (or a no-op to stop the reaper if @batch is NULL).
+ * No more entries than the submission queue holds are ever in flight, so the
+ * completion queue, which is larger, cannot overflow. Called with the lock
+ * held.
+ */
+static void ring_submit(disk_t disk, struct aio_batch *batch)
+{
+	struct aio *aio = disk->aio;
+	struct io_uring_sqe *sqe;
+	struct aio_run *run;
+	unsigned tail = *aio->sq_tail, queued = 0, index;
+	int i, nruns = batch ? batch->nruns : 1;
+
+	for (i = 0; i < nruns; i++) {
+		while (aio->inflight == aio->sq_entries) {
+			ring_flush(aio, tail, queued);
+			queued = 0;
+			pthread_cond_wait(&aio->room, &aio->lock);
+			tail = *aio->sq_tail;
+		}
+
+		index = tail & *aio->sq_mask;
+		sqe = &aio->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		if (batch) {
+			run = &batch->runs[i];
+			sqe->opcode = batch->is_write ? IORING_OP_WRITEV
+						      : IORING_OP_READV;
+			sqe->fd = disk->fd;
+			sqe->addr = (uintptr_t)&run->iov;
+			sqe->len = 1;
+			sqe->off = (uint64_t)run->block * disk->block_size;
+			sqe->user_data = (uintptr_t)run;
+		} else {
+			sqe->opcode = IORING_OP_NOP;
+		}
+		aio->sq_array[index] = index;
+		tail++;
+		queued++;
+		aio->inflight++;
+	}
+
+	ring_flush(aio, tail, queued);
+}
+
+/* Finish a run whose transfer came back, completing its batch if it was last */
+static void ring_complete(disk_t disk, struct aio_run *run, int res)
+{
+	struct aio_batch *batch = run->batch;
+	struct iovec rest;
+
+	if (res < 0) {
+		errno = -res;
+		perror(batch->is_write ? "io_uring write" : "io_uring read");
+		batch->ret = -1;
+	} else if ((size_t)res < run->iov.iov_len) {
+		/* Short transfer, finish it synchronously */
+		rest.iov_base = (char *)run->iov.iov_base + res;
+		rest.iov_len = run->iov.iov_len - res;
+		if (transfer_iov(disk, batch->is_write,
+				 (off_t)run->block * disk->block_size + res,
+				 &rest, 1))
+			batch->ret = -1;
+	}
+
+	if (--batch->pending == 0)
+		batch_finish(disk->aio, batch);
+}
+
+/* Reap completions until the no-op queued by aio_stop() comes back */
+static void *aio_reaper(void *arg)
+{
+	disk_t disk = arg;
+	struct aio *aio = disk->aio;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int stop = 0;
+
+	while (!stop) {
+		if (ring_enter(aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR) {
+			perror("io_uring_enter");
+			continue;
+		}
+
+		head = *aio->cq_head;
+		tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+
+		/*
+		 * Taking the lock also orders the batches after their
+		 * submission. New entries can be queued right away: the
+		 * completion queue holds twice what can be in flight.
+		 */
+		pthread_mutex_lock(&aio->lock);
+		aio->inflight -= tail - head;
+		pthread_cond_broadcast(&aio->room);
+		pthread_mutex_unlock(&aio->lock);
+
+		for (; head != tail; head++) {
+			cqe = &aio->cqes[head & *aio->cq_mask];
+			if (cqe->user_data)
+				ring_complete(disk,
+					      (struct aio_run *)(uintptr_t)
+					      cqe->user_data, cqe->res);
+			else
+				stop = 1;
+		}
+		__atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_IO_URING */
+
+/* Start the asynchronous engine of a disk, preferring io_uring */
+static int aio_start(disk_t disk)
+{
+	struct aio *aio;
+
+	pthread_mutex_lock(&disk->aio_lock);
+	if (disk->aio) {
+		pthread_mutex_unlock(&disk->aio_lock);
+		return 0;
+	}
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio) {
+		perror("calloc");
+		pthread_mutex_unlock(&disk->aio_lock);
+		return -1;
+	}
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->idle, NULL);
+	pthread_cond_init(&aio->work, NULL);
+	pthread_cond_init(&aio->room, NULL);
+	aio->ring_fd = -1;
+	disk->aio = aio;
+
+#ifdef HAVE_IO_URING
+	/* A memory-mapped disk is served by plain copies in the workers */
+	if (!disk->map && ring_setup(aio) == 0 &&
+	    pthread_create(&aio->reaper, NULL, aio_reaper, disk)) {
+		ring_teardown(aio);
+		aio->ring_fd = -1;
+	}
+#endif
+	if (aio->ring_fd == -1) {
+		/* Run with the workers that can be started */
+		while (aio->nworkers < AIO_WORKERS &&
+		       !pthread_create(&aio->workers[aio->nworkers], NULL,
+				       aio_worker, disk))
+			aio->nworkers++;
+		if (aio->nworkers == 0) {
+			perror("pthread_create");
+			disk->aio = NULL;
+			free(aio);
+			pthread_mutex_unlock(&disk->aio_lock);
+			return -1;
+		}
+	}
+
+	pthread_mutex_unlock(&disk->aio_lock);
+	return 0;
+}
+
+/* Wait for the batches in flight, then stop the asynchronous engine */
+static void aio_stop(disk_t disk)
+{
+	struct aio *aio = disk->aio;
+	int i;
+
+	pthread_mutex_lock(&aio->lock);
+	while (aio->batches > 0)
+		pthread_cond_wait(&aio->idle, &aio->lock);
+	aio->stop = 1;
+#ifdef HAVE_IO_URING
+	if (aio->ring_fd != -1)
+		ring_submit(disk, NULL);
+#endif
+	pthread_cond_broadcast(&aio->work);
+	pthread_mutex_unlock(&aio->lock);
+
+#ifdef HAVE_IO_URING
+	if (aio->ring_fd != -1) {
+		pthread_join(aio->reaper, NULL);
+		ring_teardown(aio);
+	}
+#endif
+	for (i = 0; i < aio->nworkers; i++)
+		pthread_join(aio->workers[i], NULL);
+
+	pthread_mutex_destroy(&aio->lock);
+	pthread_cond_destroy(&aio->idle);
+	pthread_cond_destroy(&aio->work);
+	pthread_cond_destroy(&aio->room);
+	free(aio);
+	disk->aio = NULL;
+}
+
+int block_submit(int is_write, const struct block_io *ios, int nios,
+		 block_done_t done, void *arg)
+{
+	return block_submit_h(default_disk, is_write, ios, nios, done, arg);
+}
+
+int block_submit_h(disk_t disk, int is_write, const struct block_io *ios,
+		   int nios, block_done_t done, void *arg)
+{
+	struct aio_batch *batch;
+	struct aio *aio;
+	size_t nblocks = 0;
+	int i;
+
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (nios <= 0 || !ios || !done) {
+		block_error("invalid request (%d runs)", nios);
+		return -1;
+	}
+
+	for (i = 0; i < nios; i++) {
+		if (ios[i].nblocks == 0 || ios[i].block >= disk->bcount ||
+		    ios[i].nblocks > disk->bcount - ios[i].block) {
+			block_error("block index out of bounds (%zu+%zu/%zu)",
+				    ios[i].block, ios[i].nblocks,
+				    disk->bcount);
+			return -1;
+		}
+		nblocks += ios[i].nblocks;
+	}
+
+	if (aio_start(disk))
+		return -1;
+
+	batch = malloc(sizeof(*batch) + nios * sizeof(struct aio_run));
+	if (!batch) {
+		perror("malloc");
+		return -1;
+	}
+	batch->next = NULL;
+	batch->is_write = is_write;
+	batch->pending = nios;
+	batch->ret = 0;
+	batch->done = done;
+	batch->arg = arg;
+	batch->nruns = nios;
+	for (i = 0; i < nios; i++) {
+		batch->runs[i].batch = batch;
+		batch->runs[i].block = ios[i].block;
+		batch->runs[i].iov.iov_base = ios[i].buf;
+		batch->runs[i].iov.iov_len = ios[i].nblocks * disk->block_size;
+	}
+
+	count_io(disk, is_write, nios, nblocks);
+
+	aio = disk->aio;
+	pthread_mutex_lock(&aio->lock);
+	aio->batches++;
+#ifdef HAVE_IO_URING
+	if (aio->ring_fd != -1) {
+		ring_submit(disk, batch);
+		pthread_mutex_unlock(&aio->lock);
+		return 0;
+	}
+#endif
+	if (aio->tail)
+		aio->tail->next = batch;
+	else
+		aio->head = batch;
+	aio->tail = batch;
+	pthread_cond_signal(&aio->work);
+	pthread_mutex_unlock(&aio->lock);
+
+	return 0;
+}
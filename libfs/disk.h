@@ -2,10 +2,34 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for ssize_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
-/** Size of a disk block in bytes */
+/** Default size of a disk block in bytes, see block_disk_set_block_size() */
 #define BLOCK_SIZE 4096
 
+/** Largest block size accepted by block_disk_set_block_size() */
+#define BLOCK_SIZE_MAX 65536
+
+/** I/O counters, summed over all virtual disks and kept across opens */
+struct block_stats {
+	size_t read_calls;	/* Read requests (block_read(), block_readv()) */
+	size_t write_calls;	/* Write requests (block_write(), block_writev()) */
+	size_t blocks_read;	/* Blocks read */
+	size_t blocks_written;	/* Blocks written */
+};
+
+/** Ways of accessing the virtual disk file */
+enum block_backend {
+	/* Positional read/write system calls on the file */
+	BLOCK_BACKEND_FILE,
+	/* Whole file mapped in memory */
+	BLOCK_BACKEND_MMAP,
+};
+
+/** Handle on an open virtual disk */
+typedef struct disk *disk_t;
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +43,21 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: How blocks are accessed
+ *
+ * Same as block_disk_open(), but select how the blocks of the virtual disk are
+ * accessed. With %BLOCK_BACKEND_MMAP, the whole disk file is mapped in memory:
+ * block_read() and block_write() become plain copies, and block_ptr() gives
+ * direct access to the blocks.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +65,43 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_set_block_size - Change the block size of the disk
+ * @block_size: New size of a block in bytes
+ *
+ * Blocks are %BLOCK_SIZE bytes when a virtual disk is opened. Once the real
+ * block size of the disk is known (usually from its first block), switch to
+ * it before any other block is accessed. The block indexes and the block count
+ * are then in units of @block_size, and so are the buffer sizes of the
+ * functions below.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if @block_size is not
+ * a power of two between %BLOCK_SIZE and %BLOCK_SIZE_MAX, or if the size of
+ * the disk file is not a multiple of @block_size. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t block_size);
+
+/**
+ * block_disk_block_size - Get the block size of the disk
+ *
+ * Return: 0 if there was no virtual disk file opened, otherwise the size of a
+ * block of the currently open disk.
+ */
+size_t block_disk_block_size(void);
+
+/**
+ * block_disk_sync - Flush the virtual disk file
+ *
+ * Make the blocks written so far durable: with the memory-mapped backend, write
+ * the modified pages of the mapping back to the disk file, and with the file
+ * backend, flush the file's data to stable storage. The memory-mapped backend
+ * also does this in block_disk_close().
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flushing
+ * operation fails. 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -39,7 +115,7 @@ int block_disk_count(void);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (one block) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -52,7 +128,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (one block) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -60,5 +136,191 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_ptr - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Get a pointer to the content of block @block in the memory-mapped virtual
+ * disk. Data read from or written to the block at this address is
+ * the disk's content. The pointer remains valid until the disk is closed.
+ *
+ * Return: NULL if the disk is not open with %BLOCK_BACKEND_MMAP, or if @block
+ * is out of bounds. Otherwise, the address of the block's content.
+ */
+void *block_ptr(size_t block);
+
+/**
+ * block_prefetch - Announce that blocks are about to be read
+ * @block: Index of the first block of the run
+ * @nblocks: Number of blocks in the run
+ *
+ * Ask the kernel to start bringing the run of blocks into memory in the
+ * background (posix_fadvise(), or madvise() with the memory-mapped backend),
+ * so that reading them later does not wait for the storage. The function does
+ * not wait for the blocks.
+ *
+ * Return: -1 if the run is out of bounds, or if the hint is rejected. 0
+ * otherwise.
+ */
+int block_prefetch(size_t block, size_t nblocks);
+
+/**
+ * block_writev - Write a run of contiguous blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Gather the content of the @iovcnt buffers described by @iov and write it in
+ * the virtual disk, starting at block @block. The total length of the buffers
+ * must be a multiple of the block size, and the whole run is written with a
+ * single positional system call in the common case.
+ *
+ * Return: -1 if the run is out of bounds or inaccessible, if the total length
+ * is not a multiple of the block size, or if the writing operation fails. 0
+ * otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read a run of contiguous blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the virtual disk's blocks starting at block @block and scatter their
+ * content into the @iovcnt buffers described by @iov. The total length of the
+ * buffers must be a multiple of the block size.
+ *
+ * Return: -1 if the run is out of bounds or inaccessible, if the total length
+ * is not a multiple of the block size, or if the reading operation fails. 0
+ * otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/** Run of contiguous blocks transferred by block_submit() */
+struct block_io {
+	size_t block;		/* First block of the run */
+	void *buf;		/* Data buffer, @nblocks blocks */
+	size_t nblocks;		/* Number of blocks in the run */
+};
+
+/** Completion callback of block_submit(), @ret is 0 on success, -1 if any run
+ * failed */
+typedef void (*block_done_t)(void *arg, int ret);
+
+/**
+ * block_submit - Start an asynchronous batch of block transfers
+ * @is_write: Whether the runs are written to the disk (or read from it)
+ * @ios: Runs to transfer
+ * @nios: Number of runs in @ios
+ * @done: Called once every run of the batch has been transferred
+ * @arg: Argument passed to @done
+ *
+ * Queue the whole batch at once and return without waiting for it. The runs
+ * are transferred through an io_uring when the kernel supports it (unless
+ * built with -DNO_IO_URING), and by a small pool of worker threads otherwise
+ * or when the disk is memory-mapped. The engine is started by the first
+ * submission and stopped when the disk is closed, after the batches in flight
+ * have completed.
+ *
+ * @ios itself can be reused as soon as the function returns, but the data
+ * buffers must stay valid until @done is called. @done runs on an internal
+ * thread and must not block for long.
+ *
+ * Return: -1 if a run is out of bounds, or if the batch cannot be queued. 0
+ * otherwise.
+ */
+int block_submit(int is_write, const struct block_io *ios, int nios,
+		 block_done_t done, void *arg);
+
+/**
+ * block_get_stats - Get the I/O counters
+ * @stats: Counters to be filled in
+ */
+void block_get_stats(struct block_stats *stats);
+
+/**
+ * block_disk_open_h - Open a virtual disk file and get a handle on it
+ * @diskname: Name of the virtual disk file
+ * @backend: How blocks are accessed
+ *
+ * Same as block_disk_open_backend(), but instead of becoming the disk used by
+ * the functions above, the virtual disk is accessed through the returned
+ * handle with the *_h() variants below. Any number of disks can be open at
+ * once this way, and a handle can be used from several threads.
+ *
+ * Return: NULL if @diskname is invalid, or if the virtual disk file cannot be
+ * opened or mapped. Otherwise, a handle on the disk.
+ */
+disk_t block_disk_open_h(const char *diskname, enum block_backend backend);
+
+/*
+ * Handle-based variants of the functions above, acting on virtual disk @disk
+ * instead of the one opened with block_disk_open(). block_disk_close_h() also
+ * releases the handle.
+ */
+int block_disk_close_h(disk_t disk);
+int block_disk_sync_h(disk_t disk);
+int block_disk_count_h(disk_t disk);
+int block_disk_set_block_size_h(disk_t disk, size_t block_size);
+size_t block_disk_block_size_h(disk_t disk);
+int block_write_h(disk_t disk, size_t block, const void *buf);
+int block_read_h(disk_t disk, size_t block, void *buf);
+void *block_ptr_h(disk_t disk, size_t block);
+int block_prefetch_h(disk_t disk, size_t block, size_t nblocks);
+int block_writev_h(disk_t disk, size_t block, const struct iovec *iov,
+		   int iovcnt);
+int block_readv_h(disk_t disk, size_t block, const struct iovec *iov,
+		  int iovcnt);
+int block_submit_h(disk_t disk, int is_write, const struct block_io *ios,
+		   int nios, block_done_t done, void *arg);
+
+/**
+ * block_disk_stats_h - Get the I/O counters of one disk
+ * @disk: Virtual disk
+ * @stats: Counters to be filled in
+ *
+ * Same as block_get_stats(), but only counts the I/O issued to @disk since it
+ * was opened.
+ */
+void block_disk_stats_h(disk_t disk, struct block_stats *stats);
+
+/**
+ * block_copy_in_h - Copy data from a file into the disk
+ * @disk: Virtual disk
+ * @block: Index of the block to copy into
+ * @offset: Offset in @block where the data starts
+ * @len: Number of bytes to copy, which may run over the following blocks
+ * @fd: File descriptor to read the data from, at its file offset
+ *
+ * Move data from @fd into the disk without going through the caller's memory:
+ * with copy_file_range() when both are regular files, or else with read()
+ * straight into the mapping of a memory-mapped disk, or through a bounded
+ * buffer. The file offset of @fd is advanced by the number of bytes copied.
+ * Any cached copy of the blocks is up to the caller.
+ *
+ * Return: -1 if the bytes are out of bounds, or if reading or writing fails.
+ * Otherwise, the number of bytes copied, below @len only if @fd ended first.
+ */
+ssize_t block_copy_in_h(disk_t disk, size_t block, size_t offset, size_t len,
+			int fd);
+
+/**
+ * block_copy_out_h - Copy data from the disk into a file
+ * @disk: Virtual disk
+ * @block: Index of the block to copy from
+ * @offset: Offset in @block where the data starts
+ * @len: Number of bytes to copy, which may run over the following blocks
+ * @fd: File descriptor to write the data to, at its file offset
+ *
+ * Same as block_copy_in_h() in the other direction, with sendfile(), which
+ * also accepts pipes and sockets for @fd.
+ *
+ * Return: -1 if the bytes are out of bounds, or if reading or writing fails.
+ * @len otherwise.
+ */
+ssize_t block_copy_out_h(disk_t disk, size_t block, size_t offset, size_t len,
+			 int fd);
+
 #endif /* _DISK_H */
 
@@ -1,16 +1,42 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "alloc.h"
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
+#include "journal.h"
+#include "stats.h"
 
-#define FAT_EOC 0xFFFF
-#define FBLOCK_SIZE 2048
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 0xFFFF
+#define SUPER_LEGACY 0
+#define SUPER_EXTENDED 1
+#define LAYOUT_FAT 0
+#define LAYOUT_EXTENTS 1
+#define EXTENT_SIGNATURE "ECS150EX"
+#define ENTRY_FILE 0
+#define ENTRY_DIR 1
+#define NAME_INDEX_SIZE (2 * FS_FILE_MAX_COUNT)
+#define NO_SLOT -1
+#define PATH_INVALID -2
+#define NODE_CHUNK 1024
+#define NODE_CHUNKS_MAX 1024
+#define FD_CHUNK 64
+#define FD_CHUNKS_MAX (FS_OPEN_LIMIT / FD_CHUNK)
+#define BOUNCE_POOL_SIZE 4
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_DEFAULT_BLOCKS 64
+#define WRITE_BUFFER_DEFAULT_BLOCKS 16
+#define IMPORT_CHUNK_BLOCKS 256
+#define JOURNAL_SYNC_INTERVAL_MS 5000
 
-/* TODO: Phase 1 */
 struct __attribute__ ((packed)) super_block {
     uint8_t signature[8];   // Signature of the file - Always "ECS150FS"
     uint16_t disk_blocks;   // Total number of virtual disk blocks
@@ -18,553 +44,3685 @@ struct __attribute__ ((packed)) super_block {
     uint16_t dblock_index;  // First data block index
     uint16_t num_blocks;    // Number of data blocks
     uint8_t block_fat;      // Number of fat blocks
-    uint8_t padding[4079];
+    uint8_t version;        // SUPER_LEGACY: 4 KiB blocks and 16-bit FAT
+                            // entries, as above. SUPER_EXTENDED: the 16-bit
+                            // fields above are 0, and the ones below are used
+    uint32_t block_size;    // Size of a block in bytes, a power of two
+    uint8_t fat_bits;       // Width of a FAT entry, 16 or 32 bits
+    uint32_t disk_blocks32;
+    uint32_t root_index32;
+    uint32_t dblock_index32;
+    uint32_t num_blocks32;
+    uint32_t block_fat32;
+    uint8_t layout;         // LAYOUT_FAT: files are FAT chains. LAYOUT_EXTENTS:
+                            // files are lists of extents, and the FAT only
+                            // tells which blocks are in use
+    uint8_t padding[4052];
 };
 
 struct __attribute__ ((packed)) FAT {
-    uint16_t* fat_data;  // Array containing the fat blocks
+    uint32_t* fat_data;  // Array containing the fat blocks, widened to 32 bits
 };
 
 typedef struct FAT* fat_t;
 
+/* Block holding the extents of a file, in extent layout */
+struct __attribute__ ((packed)) extent_block {
+    uint8_t signature[8];       // Always "ECS150EX"
+    uint32_t num_extents;       // Number of extents in use
+    uint32_t padding;
+    struct {
+        uint32_t start;         // Fat index of the first block of the extent
+        uint32_t len;           // Number of blocks in the extent
+    } extents[];                // Extents in file order, filling the block
+};
+
+// Extent of a file in memory, with the block of the file where it starts
+struct extent {
+    uint32_t file_block;
+    uint32_t start;
+    uint32_t len;
+};
+
+// Extents of a file in memory, protected by the file lock
+struct file_extents {
+    struct extent *list;        // Extents in file order, NULL if none yet
+    uint32_t count;             // Number of extents in use
+    uint32_t capacity;          // Number of extents allocated in list
+    int dirty;                  // Changed since the extent block was written
+                                // (set atomically)
+};
+
+struct bounce_pool {
+    uint8_t* data;                      // Buffer memory, one block each
+    uint8_t* free[BOUNCE_POOL_SIZE];    // Buffers not currently in use
+    int num_free;                       // Number of buffers in free
+    pthread_mutex_t lock;               // Protects free and num_free
+    pthread_cond_t available;           // Signaled when a buffer is put back
+};
+
 struct __attribute__ ((packed)) root_entry {
     char filename[FS_FILENAME_LEN];  // Filename
     uint32_t file_size;              // Size of file
     uint16_t block1_index;           // Index of first data block
-    uint8_t padding[10];
+    uint16_t block1_high;            // High bits of block1_index, with
+                                     // 32-bit FAT entries only
+    uint8_t type;                    // ENTRY_FILE, or ENTRY_DIR for a file
+                                     // holding directory entries
+    uint8_t padding[7];
+};
+
+// File or directory known to the mounted file system. Nodes 0 to
+// FS_FILE_MAX_COUNT - 1 are the entries of the root directory, and the entries
+// of the other directories get a node when their directory is loaded.
+struct node {
+    struct root_entry entry;    // Directory entry, outside the root directory
+                                // (root_directory holds the others)
+    pthread_rwlock_t lock;      // Protects the size and chain of the file
+    struct file_extents extents;    // Extent layout only
+    int parent;                 // Node of the directory holding the entry, or
+                                // NO_SLOT for the root directory
+    uint32_t slot;              // Slot of the entry in its directory
+    int entry_dirty;            // Entry changed since it was last written,
+                                // outside the root directory (set atomically)
+    struct dir *dir;            // Content of the directory once loaded, NULL
+                                // otherwise (set atomically)
+    int open_count;             // Fds open on the file, under fd_lock
+    int next_free;              // Next free node, while free
+    pthread_mutex_t wbuf_lock;  // Protects wbuf_fd and the buffer of that fd
+    int wbuf_fd;                // Fd holding appends to the file that are not
+                                // written yet, or NO_SLOT
+};
+
+// Directory other than the root directory, loaded in memory. On disk, it is a
+// file of entries laid out like the root directory, in any order; its name
+// index is built when it is loaded, and it stays loaded until it is deleted
+// or the file system is unmounted.
+struct dir {
+    int node;                   // Node of the directory
+    int *slots;                 // Node in each slot, NO_SLOT if free
+    size_t num_slots;
+    size_t num_used;            // Slots in use
+    size_t free_hint;           // No slot before this one is free
+    int *index;                 // Nodes by name, see index_find
+    size_t index_size;
+    uint32_t *blocks;           // Fat index of each block of the directory
+    uint8_t *dirty;             // Blocks whose slots were taken or freed since
+                                // they were last written
+    size_t num_blocks;
+    struct dir *next;           // Next loaded directory
+};
+
+// Blocks of a file deleted from a directory other than the root, with a
+// journal: they are only released once the flush after the one that wrote the
+// change to the directory, so that the journal never commits them as free
+// while the directory on disk still points at them
+struct pending_free {
+    uint32_t first;             // First block of the file, or FAT_EOC
+    struct file_extents extents;
+    struct pending_free *next;
+};
+
+// What a metadata block being flushed was copied from, so that it can be
+// flagged again if the flush fails
+struct meta_source {
+    int node;                   // File of an extent block, or directory of a
+                                // directory block, or NO_SLOT
+    uint32_t dir_block;         // Block in the directory, or UINT32_MAX
 };
 
 struct __attribute__ ((packed)) fd {
     int offset;                         // File offset
-    uint8_t file[FS_FILENAME_LEN];      // Name of the file
-    uint16_t index;                     // Index of first data block
     int is_open;                        // Indicator for file being open
+                                        // (set atomically)
+    int next_free;                      // Next free fd, while free
+    int node;                           // Node of the file
+    uint32_t cur_block_num;             // Block number of the cursor in file
+    uint32_t cur_block;                 // Fat index at the cursor, or FAT_EOC
+    uint32_t cur_extent;                // Extent holding the cursor, in
+                                        // extent layout
+    int aio_inflight;                   // Asynchronous requests in flight
+    uint32_t ra_expect;                 // Offset of the next sequential read
+    uint32_t ra_window;                 // Read-ahead window in blocks, or 0
+    uint32_t ra_start;                  // Prefetched blocks of the file not
+    uint32_t ra_end;                    // read yet, from ra_start to ra_end
+    uint8_t *wbuf;                      // Appends not written yet, or NULL
+    uint32_t wbuf_off;                  // File offset of the first byte of wbuf
+    uint32_t wbuf_len;                  // Number of bytes held in wbuf
+};
+
+// Asynchronous request, from its submission to its completion
+struct aio_req {
+    struct fs *fs;
+    int fd;
+    fs_aio_cb cb;
+    void *arg;
+    int ret;                // Bytes transferred, or -1
+    int num_copies;         // Partial blocks to copy out once read
+    struct {
+        uint8_t *dst;       // Where the bytes go in the user buffer
+        size_t block_off;   // Offset of the bytes in the block
+        size_t len;         // Number of bytes
+    } copies[2];
+    uint8_t bounce[];       // Partial blocks, one block each
 };
 
 typedef struct root_entry* root_t;
 
+// Mounted file system instance
+struct fs {
+    disk_t disk;                                        // Virtual disk
+    struct super_block super;
+
+    // Geometry of the disk, from either layout of the superblock
+    size_t block_size;
+    size_t disk_blocks;
+    size_t root_index;
+    size_t dblock_index;
+    size_t num_blocks;
+    size_t block_fat;
+    size_t fat_per_block;       // FAT entries per FAT block
+    uint32_t fat_eoc;           // FAT_EOC as stored on disk
+    int extent_layout;          // Files are lists of extents, not FAT chains
+    size_t max_extents;         // Extents that fit in an extent block
+
+    struct FAT fat_block;
+    struct root_entry root_directory[FS_FILE_MAX_COUNT];
+    int name_index[NAME_INDEX_SIZE];
+    struct bounce_pool bounce_pool;
+    struct cache *cache;                                // NULL if disabled
+    struct free_map *free_map;
+    struct journal *journal;                            // NULL if none
+
+    // Nodes, allocated a chunk at a time so that they never move, and the
+    // list of free ones. The loaded directories are the dentry cache: a path
+    // is resolved in memory once its directories were read.
+    struct node *nodes[NODE_CHUNKS_MAX];
+    int num_nodes;
+    int free_node;
+    struct dir *dirs;
+
+    // File descriptors, allocated a chunk at a time like the nodes, with the
+    // list of free ones, and the limit on the number of open ones
+    struct fd *fds[FD_CHUNKS_MAX];
+    int num_fds;                // Fds in the chunks handed out so far (set
+                                // atomically)
+    int free_fd;
+    size_t num_open;
+    size_t open_max;
+
+    // Metadata changed since it was last written to disk: one flag per FAT
+    // block (set under fat_lock), and one for the root directory (set
+    // atomically, under root_lock or a file lock held for writing). Directory
+    // blocks are tracked by their directory and their nodes.
+    uint8_t *fat_dirty;
+    int root_dirty;
+
+    // Copies of the dirty metadata blocks being flushed, their disk blocks and
+    // where they come from, growing as needed. A journal transaction holds at
+    // least meta_max blocks: the FAT, the root directory and, in extent
+    // layout, one extent block per root entry.
+    uint8_t *meta_copy;
+    size_t *meta_home;
+    struct meta_source *meta_source;
+    size_t meta_capacity;
+    size_t meta_max;
+
+    // Deleted files whose blocks wait for the next flush, and the ones whose
+    // blocks the next flush releases (journal only)
+    struct pending_free *pending_frees;
+    struct pending_free *committed_frees;
+
+    // Locks, always taken in this order:
+    // - sync_lock serializes the metadata flushes
+    // - fd_lock protects the allocation of file descriptors and the count of
+    //   fds open on each node
+    // - root_lock protects the namespace: the name indexes, which slots of
+    //   the directories are in use, and the nodes
+    // - dcache_lock lets a directory be loaded with root_lock only held for
+    //   reading, and protects the nodes and the loaded directories against
+    //   that
+    // - node locks protect the size and chain of each file
+    // - fat_lock protects the FAT, the free-block map and the pending frees
+    pthread_mutex_t sync_lock;
+    pthread_mutex_t fd_lock;
+    pthread_rwlock_t root_lock;
+    pthread_mutex_t dcache_lock;
+    pthread_mutex_t fat_lock;
+
+    // Asynchronous requests in flight (also counted per fd), and signaled
+    // when one completes
+    unsigned aio_inflight;
+    pthread_mutex_t aio_lock;
+    pthread_cond_t aio_done;
+
+    // Read-ahead limit and counters
+    size_t readahead_max;
+    size_t ra_prefetched;
+    size_t ra_hits;
+
+    // Event counters and latency histograms (see fs_stats_h)
+    struct stats *stats;
+
+    // Size of the per-fd append buffers in bytes, 0 if disabled
+    size_t wbuf_max;
+
+    // Background thread calling fs_sync_h every sync_interval milliseconds
+    unsigned sync_interval;
+    int flusher_running;
+    int flusher_stop;
+    pthread_t flusher;
+    pthread_mutex_t flusher_lock;
+    pthread_cond_t flusher_wake;
+};
+
 // Helper functions
-int empty_root_entries(void );
-int find_file(const char* filename);
-int find_first_empty(void);
-int first_fit(void);
-int first_open_fd(void );
-int free_fat_blocks(void );
+int file_open(struct fs *fs, const char *filename);
+int file_write(struct fs *fs, int fd, void *buf, size_t count);
+int file_read(struct fs *fs, int fd, void *buf, size_t count);
+int empty_root_entries(struct fs *fs);
+int find_file(struct fs *fs, const char* filename);
+int find_first_empty(struct fs *fs);
+unsigned name_hash(const char* filename);
+void name_index_build(struct fs *fs);
+int index_find(struct fs *fs, const int *index, size_t size,
+               const char* filename);
+void index_insert(struct fs *fs, int *index, size_t size, int node);
+void index_remove(struct fs *fs, int *index, size_t size, int node);
+struct node* node_get(struct fs *fs, int node);
+struct root_entry* node_entry(struct fs *fs, int node);
+void node_changed(struct fs *fs, int node);
+int node_alloc(struct fs *fs);
+void node_release(struct fs *fs, int node);
+int path_lookup(struct fs *fs, const char *path, int *dir, char *name);
+struct dir* dir_get(struct fs *fs, int node);
+int dir_load(struct fs *fs, int node);
+struct dir* dir_new(int node);
+void dir_free(struct dir *dir);
+int dir_add(struct fs *fs, int dir_node, const char *name, uint8_t type);
+int create_entry(struct fs *fs, const char *path, uint8_t type);
+void dir_remove(struct fs *fs, int node);
+int dir_add_block(struct dir *dir, uint32_t fat_index, size_t per_block);
+int dir_index_add(struct fs *fs, struct dir *dir, int node);
+int dir_grow(struct fs *fs, struct dir *dir);
+void blocks_release(struct fs *fs, uint32_t fat_index,
+                    struct file_extents *extents);
+int first_fit(struct fs *fs);
+struct fd* fd_get(struct fs *fs, int fd);
+struct fd* fd_slot(struct fs *fs, int fd);
+int fd_alloc(struct fs *fs);
+void fd_release(struct fs *fs, int fd);
+int free_fat_blocks(struct fs *fs);
+double average_extent_length(struct fs *fs);
+int info_print(struct fs *fs, int verbose);
+uint32_t cursor_seek(struct fs *fs, int fd, int file_index, size_t block_num);
+void cursor_skip_run(struct fs *fs, int fd, size_t run);
+size_t contiguous_run(struct fs *fs, uint32_t fat_index, size_t max_blocks);
+size_t cursor_run(struct fs *fs, int fd, size_t max_blocks);
+size_t extend_chain(struct fs *fs, int fd, int file_index, size_t num_blocks);
+size_t extent_find(struct file_extents *fe, size_t block_num);
+size_t extent_extend(struct fs *fs, int file_index, size_t num_blocks);
+int extents_load(struct fs *fs, int file_index, const uint8_t *block);
+void extents_store(struct fs *fs, int file_index, uint8_t *block);
+int read_partial(struct fs *fs, size_t block, size_t block_off, void *buf,
+                 size_t len);
+int write_partial(struct fs *fs, size_t block, size_t block_off,
+                  const void *buf, size_t len, int fresh);
+int bounce_pool_init(struct fs *fs);
+void bounce_pool_destroy(struct fs *fs);
+uint8_t* bounce_get(struct fs *fs);
+void bounce_put(struct fs *fs, uint8_t* bounce_buf);
+struct aio_req* aio_req_alloc(struct fs *fs, int fd, fs_aio_cb cb, void *arg,
+                              size_t num_copies);
+void aio_req_start(struct aio_req *req);
+void aio_req_finish(struct aio_req *req, int ret);
+void aio_read_done(void *arg, int ret);
+void aio_write_done(void *arg, int ret);
+void readahead(struct fs *fs, int fd, int file_index, size_t start,
+               size_t end);
+void readahead_reset(struct fs *fs, int fd);
+size_t prefetch_range(struct fs *fs, int fd, int file_index, size_t from,
+                      size_t to);
+int write_range(struct fs *fs, int fd, int file_index, size_t cur_off,
+                const uint8_t *buf, size_t count);
+int wbuf_append(struct fs *fs, int fd, const void *buf, size_t count);
+int wbuf_flush(struct fs *fs, int fd, int all);
+int wbuf_add(struct fs *fs, int fd, const void *buf, size_t count);
+int wbuf_write(struct fs *fs, int fd, int all);
+int node_wbuf_flush(struct fs *fs, int fd);
+void fat_set(struct fs *fs, uint32_t fat_index, uint32_t value);
+void fat_load(struct fs *fs, size_t fat_block, const uint8_t *src);
+void fat_store(struct fs *fs, size_t fat_block, uint8_t *dst);
+uint32_t node_first_block(struct fs *fs, int file_index);
+void node_set_first_block(struct fs *fs, int file_index, uint32_t fat_index);
+int super_parse(struct fs *fs);
+int meta_reserve(struct fs *fs, size_t num_blocks);
+size_t meta_copy_dirs(struct fs *fs, size_t num_blocks);
+int meta_commit(struct fs *fs, size_t num_blocks, size_t num_fat);
+int meta_flush(struct fs *fs);
+void* flusher_main(void *arg);
+struct fs* fs_alloc(void);
+void fs_free(struct fs *fs);
+int any_mounted(void);
 
 // Global variables
-struct root_entry root_directory[FS_FILE_MAX_COUNT];
-struct fd file_descriptor[FS_FILE_MAX_COUNT];
-struct FAT fat_block;
-struct super_block super;
-unsigned is_mounted = 0;
-int num_open_files = 0;
+fs_t default_fs = NULL;     // File system used by the functions without _h
+int mounted_count = 0;      // File systems mounted, with or without _h (set
+                            // atomically)
+// Settings of the fs_set_* functions, shared by every mount and frozen while
+// any file system is mounted
+size_t cache_blocks = CACHE_DEFAULT_BLOCKS;
+size_t open_max = FS_OPEN_MAX_COUNT;
+size_t readahead_blocks = READAHEAD_DEFAULT_BLOCKS;
+size_t write_buffer_blocks = WRITE_BUFFER_DEFAULT_BLOCKS;
+int latency_histograms = 0;
+long sync_interval_ms = -1;  // -1 until set with fs_set_sync_interval
+enum block_backend disk_backend = BLOCK_BACKEND_FILE;
 
 
-// To mount the given diskname by reading in all the blocks from that disk onto
-// the appropriate global variables.
-int fs_mount(const char *diskname) {
+/// Functions acting on the default file system instance
 
-    if (!diskname) {
+int fs_mount(const char *diskname) {
+    if (any_mounted()) {
         return -1;
     }
-    if (block_disk_open(diskname) == -1) {
-        return -1;
+    default_fs = fs_mount_h(diskname);
+    return default_fs ? 0 : -1;
+}
+
+int fs_umount(void) {
+    fs_t fs = default_fs;
+    default_fs = NULL;
+    return fs_umount_h(fs);
+}
+
+int fs_info(void) {
+    return fs_info_h(default_fs);
+}
+
+int fs_info_verbose(void) {
+    return fs_info_verbose_h(default_fs);
+}
+
+int fs_create(const char *filename) {
+    return fs_create_h(default_fs, filename);
+}
+
+int fs_delete(const char *filename) {
+    return fs_delete_h(default_fs, filename);
+}
+
+int fs_mkdir(const char *dirname) {
+    return fs_mkdir_h(default_fs, dirname);
+}
+
+int fs_ls(void) {
+    return fs_ls_h(default_fs);
+}
+
+int fs_open(const char *filename) {
+    return fs_open_h(default_fs, filename);
+}
+
+int fs_close(int fd) {
+    return fs_close_h(default_fs, fd);
+}
+
+int fs_stat(int fd) {
+    return fs_stat_h(default_fs, fd);
+}
+
+int fs_lseek(int fd, size_t offset) {
+    return fs_lseek_h(default_fs, fd, offset);
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+    return fs_write_h(default_fs, fd, buf, count);
+}
+
+int fs_fsync(int fd) {
+    return fs_fsync_h(default_fs, fd);
+}
+
+int fs_read(int fd, void *buf, size_t count) {
+    return fs_read_h(default_fs, fd, buf, count);
+}
+
+int fs_read_zc(int fd, const void **ptr, size_t count) {
+    return fs_read_zc_h(default_fs, fd, ptr, count);
+}
+
+int fs_import(int fd, int host_fd, size_t count) {
+    return fs_import_h(default_fs, fd, host_fd, count);
+}
+
+int fs_export(int fd, int host_fd, size_t count) {
+    return fs_export_h(default_fs, fd, host_fd, count);
+}
+
+int fs_read_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg) {
+    return fs_read_async_h(default_fs, fd, buf, count, cb, arg);
+}
+
+int fs_write_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg) {
+    return fs_write_async_h(default_fs, fd, buf, count, cb, arg);
+}
+
+int fs_aio_wait(void) {
+    return fs_aio_wait_h(default_fs);
+}
+
+int fs_sync(void) {
+    return fs_sync_h(default_fs);
+}
+
+int fs_readahead_window(int fd) {
+    return fs_readahead_window_h(default_fs, fd);
+}
+
+int fs_readahead_stats(struct fs_readahead_stats *stats) {
+    return fs_readahead_stats_h(default_fs, stats);
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats) {
+    return fs_cache_stats_h(default_fs, stats);
+}
+
+int fs_stats(struct fs_stats *stats) {
+    return fs_stats_h(default_fs, stats);
+}
+
+int fs_latency(enum fs_op op, struct fs_latency *latency) {
+    return fs_latency_h(default_fs, op, latency);
+}
+
+
+// To mount the given diskname by reading in all the blocks from that disk onto
+// a new file system instance.
+fs_t fs_mount_h(const char *diskname) {
+
+    if (!diskname) {
+        return NULL;
     }
-    is_mounted = 1;
-    size_t block_num = 0;
-    if (block_read(block_num, &super) != 0) {
-        return -1;
+    struct fs *fs = fs_alloc();
+    if (!fs) {
+        return NULL;
     }
-    if (block_disk_count() != super.disk_blocks) {
-        return -1;
+    uint64_t start = stats_start(fs->stats);
+    fs->disk = block_disk_open_h(diskname, disk_backend);
+    if (!fs->disk) {
+        fs_free(fs);
+        return NULL;
     }
-    if (!strcmp((char*)super.signature, "ECS150FS")) {
-        return -1;
+    size_t block_num = 0;
+    if (block_read_h(fs->disk, block_num, &fs->super) != 0) {
+        fs_free(fs);
+        return NULL;
+    }
+    // The superblock is read with the default block size, which the disk then
+    // switches to the one of the file system
+    if (super_parse(fs) != 0 ||
+        block_disk_set_block_size_h(fs->disk, fs->block_size) != 0 ||
+        block_disk_count_h(fs->disk) != (int)fs->disk_blocks) {
+        fs_free(fs);
+        return NULL;
     }
     block_num++;
-    // Allocating space for num fat blocks, with each index = BLOCK_SIZE
-    fat_block.fat_data = (uint16_t* ) malloc(sizeof(uint16_t) * FBLOCK_SIZE
-                                             * super.block_fat);
-    for (block_num = 1; block_num <= super.block_fat; block_num++) {
-        if (block_read(block_num, &fat_block.fat_data[(block_num - 1)\
-        *FBLOCK_SIZE]) != 0) {
-            return -1;
+    // Blocks between the root directory and the data hold a journal, which
+    // must be replayed before the metadata is read
+    size_t journal_start = fs->block_fat + 2;
+    if (fs->dblock_index > journal_start) {
+        fs->journal = journal_create(fs->disk, journal_start,
+                                     fs->dblock_index - journal_start);
+        if (!fs->journal ||
+            journal_capacity(fs->journal) < fs->meta_max ||
+            journal_replay(fs->journal) < 0) {
+            fs_free(fs);
+            return NULL;
         }
     }
-    block_num = super.block_fat + 1;
-    if (fat_block.fat_data[0] != FAT_EOC) {
-        return -1;
+    // The metadata blocks are read through the buffer used to flush them
+    fs->fat_block.fat_data = malloc(sizeof(uint32_t) * fs->fat_per_block
+                                    * fs->block_fat);
+    fs->fat_dirty = calloc(fs->block_fat, sizeof(uint8_t));
+    if (!fs->fat_block.fat_data || !fs->fat_dirty ||
+        meta_reserve(fs, fs->meta_max) != 0) {
+        fs_free(fs);
+        return NULL;
+    }
+    for (block_num = 1; block_num <= fs->block_fat; block_num++) {
+        if (block_read_h(fs->disk, block_num, fs->meta_copy) != 0) {
+            fs_free(fs);
+            return NULL;
+        }
+        fat_load(fs, block_num - 1, fs->meta_copy);
+    }
+    block_num = fs->block_fat + 1;
+    if (fs->fat_block.fat_data[0] != FAT_EOC) {
+        fs_free(fs);
+        return NULL;
+    }
+    if (block_read_h(fs->disk, block_num, fs->meta_copy) != 0) {
+        fs_free(fs);
+        return NULL;
+    }
+    memcpy(fs->root_directory, fs->meta_copy, sizeof(fs->root_directory));
+    name_index_build(fs);
+    for (int i = 0; fs->extent_layout && i < FS_FILE_MAX_COUNT; i++) {
+        uint32_t block = node_first_block(fs, i);
+        if (fs->root_directory[i].filename[0] == '\0' || block == FAT_EOC) {
+            continue;
+        }
+        if (block >= fs->num_blocks ||
+            block_read_h(fs->disk, fs->dblock_index + block,
+                         fs->meta_copy) != 0 ||
+            extents_load(fs, i, fs->meta_copy) != 0) {
+            fs_free(fs);
+            return NULL;
+        }
     }
-    if (block_read(block_num, &root_directory) != 0) {
-        return -1;
+    fs->free_map = alloc_create(fs->fat_block.fat_data, fs->num_blocks);
+    if (bounce_pool_init(fs) != 0 || !fs->free_map) {
+        fs_free(fs);
+        return NULL;
+    }
+    // A memory-mapped disk is its own cache
+    if (disk_backend != BLOCK_BACKEND_MMAP && cache_blocks > 0) {
+        fs->cache = cache_create(fs->disk, cache_blocks);
+        if (!fs->cache) {
+            fs_free(fs);
+            return NULL;
+        }
     }
-    return 0;
+    fs->open_max = open_max;
+    fs->readahead_max = readahead_blocks;
+    fs->wbuf_max = write_buffer_blocks * fs->block_size;
+    if (sync_interval_ms >= 0) {
+        fs->sync_interval = sync_interval_ms;
+    } else if (fs->journal) {
+        fs->sync_interval = JOURNAL_SYNC_INTERVAL_MS;
+    }
+    if (fs->sync_interval > 0) {
+        if (pthread_create(&fs->flusher, NULL, flusher_main, fs) != 0) {
+            fs_free(fs);
+            return NULL;
+        }
+        fs->flusher_running = 1;
+    }
+    stats_record(fs->stats, FS_OP_MOUNT, start);
+    return fs;
 }
 
 
-// To unmount the currently mounted disk and write back the data blocks from the
-// appropriate global variables back
-int fs_umount(void) {
+// To unmount the given file system instance and write back the data blocks
+// and the metadata changed since the last sync. The instance is released even
+// if writing back fails.
+int fs_umount_h(fs_t fs) {
 
-    if (is_mounted != 1) {
+    if (!fs) {
         return -1;
     }
-    is_mounted = 0;
-    int block_num = 0;
-    if (block_write(block_num, &super) != 0) {
-        return -1;
+    if (fs->flusher_running) {
+        pthread_mutex_lock(&fs->flusher_lock);
+        fs->flusher_stop = 1;
+        pthread_cond_signal(&fs->flusher_wake);
+        pthread_mutex_unlock(&fs->flusher_lock);
+        pthread_join(fs->flusher, NULL);
+        fs->flusher_running = 0;
+    }
+    fs_aio_wait_h(fs);
+    int ret = 0;
+    // Appends still buffered on open fds are not lost
+    for (int fd = 0; fd < fs->num_fds; fd++) {
+        if (fd_get(fs, fd) && wbuf_flush(fs, fd, 1) != 0) {
+            ret = -1;
+        }
     }
-    block_num++;
-    for (block_num = 1; block_num <= super.block_fat; block_num++) {
-        block_write(block_num, &fat_block.fat_data[(block_num - 1) \
-        *FBLOCK_SIZE]);
+    if (cache_destroy(fs->cache) != 0) {
+        ret = -1;
     }
-    free(fat_block.fat_data);
-    block_num = super.block_fat + 1;
-    if (block_write(block_num, &root_directory) != 0) {
-        return -1;
+    fs->cache = NULL;
+    // Files deleted outside the root directory are only released by the
+    // flush after the one that removes their entries
+    if (meta_flush(fs) != 0 || (fs->committed_frees && meta_flush(fs) != 0)) {
+        ret = -1;
+    }
+    if (block_disk_sync_h(fs->disk) != 0) {
+        ret = -1;
+    }
+    // Everything is in place, so the journal is not needed anymore
+    if (ret == 0 && (journal_clear(fs->journal) != 0 ||
+                     block_disk_sync_h(fs->disk) != 0)) {
+        ret = -1;
     }
-    if (block_disk_close() == -1) {
+    if (block_disk_close_h(fs->disk) == -1) {
+        ret = -1;
+    }
+    fs->disk = NULL;
+    fs_free(fs);
+    return ret;
+}
+
+// To return important and vital information about the currently mounted disk.
+// A legacy disk is described with the keys of the reference implementation
+// only.
+int fs_info_h(fs_t fs)
+{
+    if (!fs) {
         return -1;
     }
-    return 0;
+    return info_print(fs, fs->super.version != SUPER_LEGACY);
 }
 
-// To return important and vital information about the currently mounted disk
-int fs_info(void)
+
+// To return the information of fs_info_h, and the layout and fragmentation of
+// the disk whatever its format
+int fs_info_verbose_h(fs_t fs)
 {
-    if (is_mounted != 1) {
+    if (!fs) {
         return -1;
     }
+    return info_print(fs, 1);
+}
+
+
+// Print the keys of fs_info_h, and the ones added since the reference
+// implementation if verbose is set
+int info_print(struct fs *fs, int verbose)
+{
+    pthread_rwlock_rdlock(&fs->root_lock);
+    pthread_mutex_lock(&fs->dcache_lock);
+    double avg_extent_len = average_extent_length(fs);
+    pthread_mutex_unlock(&fs->dcache_lock);
+    pthread_mutex_lock(&fs->fat_lock);
     fprintf(stdout, "FS Info:\n");
-    fprintf(stdout, "total_blk_count=%d\n", super.disk_blocks);
-    fprintf(stdout, "fat_blk_count=%d\n", super.block_fat);
-    fprintf(stdout, "rdir_blk=%d\n", super.root_index);
-    fprintf(stdout, "data_blk=%d\n", super.dblock_index);
-    fprintf(stdout, "data_blk_count=%d\n", super.num_blocks);
-    fprintf(stdout, "fat_free_ratio=%d", free_fat_blocks());
-    fprintf(stdout, "/%d\n", super.num_blocks);
-    fprintf(stdout, "rdir_free_ratio=%d", empty_root_entries());
+    fprintf(stdout, "total_blk_count=%zu\n", fs->disk_blocks);
+    fprintf(stdout, "fat_blk_count=%zu\n", fs->block_fat);
+    fprintf(stdout, "rdir_blk=%zu\n", fs->root_index);
+    fprintf(stdout, "data_blk=%zu\n", fs->dblock_index);
+    fprintf(stdout, "data_blk_count=%zu\n", fs->num_blocks);
+    fprintf(stdout, "fat_free_ratio=%d", free_fat_blocks(fs));
+    fprintf(stdout, "/%zu\n", fs->num_blocks);
+    fprintf(stdout, "rdir_free_ratio=%d", empty_root_entries(fs));
     fprintf(stdout, "/%d\n", FS_FILE_MAX_COUNT);
+    if (verbose) {
+        fprintf(stdout, "avg_extent_len=%.2f\n", avg_extent_len);
+        fprintf(stdout, "journal_blk_count=%zu\n",
+                fs->dblock_index - fs->block_fat - 2);
+        fprintf(stdout, "blk_size=%zu\n", fs->block_size);
+        fprintf(stdout, "fat_entry_bits=%d\n",
+                fs->fat_eoc == FAT_EOC ? 32 : 16);
+        fprintf(stdout, "file_layout=%s\n",
+                fs->extent_layout ? "extents" : "fat");
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
     return 0;
 }
 
 
-// To create a new file in the currently mounted disk
-int fs_create(const char *filename)
+// To create a new file in the currently mounted disk, in the directory named
+// by its path
+int fs_create_h(fs_t fs, const char *filename)
 {
-    if (!filename) {
-        return -1;
-    }
-    if (is_mounted == 0) {
-        return -1;
-    }
-    if (strlen(filename) > FS_FILENAME_LEN) {
-        return -1;
-    }
-    if (find_file(filename) != -1) {
-        return -1;
-    }
-    int empty_entry = find_first_empty();
-    if (empty_entry == -1) {
-        return -1;
-    }
-    strcpy(root_directory[empty_entry].filename, filename);
-    root_directory[empty_entry].file_size = 0;
-    root_directory[empty_entry].block1_index = FAT_EOC;
-    return 0;
+    return create_entry(fs, filename, ENTRY_FILE);
 }
 
 
-// To delete a file in the currently mounted disk and deallocating its fat block
-int fs_delete(const char *filename) {
+// To create a new directory in the currently mounted disk
+int fs_mkdir_h(fs_t fs, const char *dirname)
+{
+    return create_entry(fs, dirname, ENTRY_DIR);
+}
+
 
-    if (is_mounted == 0) {
+// To delete a file or an empty directory in the currently mounted disk and
+// deallocating its fat blocks
+int fs_delete_h(fs_t fs, const char *filename) {
+
+    if (!fs) {
         return -1;
     }
     if (!filename) {
         return -1;
     }
-    int file_index = find_file(filename);
-    int fat_index = 0;
+    char name[FS_FILENAME_LEN];
+    int dir_node;
+    pthread_mutex_lock(&fs->fd_lock);
+    pthread_rwlock_wrlock(&fs->root_lock);
+    int file_index = path_lookup(fs, filename, &dir_node, name);
+    if (file_index != -1 && node_get(fs, file_index)->open_count > 0) {
+        file_index = -1;
+    }
+    // Only empty directories go away
+    struct dir *dir = NULL;
+    if (file_index != -1 && node_entry(fs, file_index)->type == ENTRY_DIR) {
+        dir = dir_get(fs, file_index);
+        if (!dir || dir->num_used > 0) {
+            file_index = -1;
+        }
+    }
     if (file_index == -1) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        pthread_mutex_unlock(&fs->fd_lock);
         return -1;
     }
-    memset(root_directory[file_index].filename, '\0', FS_FILENAME_LEN);
-    root_directory[file_index].file_size = 0;
-    fat_index = root_directory[file_index].block1_index;
-    root_directory[file_index].block1_index = 0;
+    struct node *n = node_get(fs, file_index);
+    if (dir) {
+        struct dir **link = &fs->dirs;
+        while (*link != dir) {
+            link = &(*link)->next;
+        }
+        *link = dir->next;
+        n->dir = NULL;
+        dir_free(dir);
+    }
+    uint32_t fat_index = node_first_block(fs, file_index);
+    struct file_extents extents = n->extents;
+    int in_root = (n->parent == NO_SLOT);
+    dir_remove(fs, file_index);
+    if (in_root) {
+        memset(&n->extents, 0, sizeof(n->extents));
+    } else {
+        node_release(fs, file_index);
+    }
+    pthread_mutex_lock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
+    pthread_mutex_unlock(&fs->fd_lock);
 
-    while (fat_index != FAT_EOC) {
-        int next_value = fat_block.fat_data[fat_index];
-        fat_block.fat_data[fat_index] = 0;
-        fat_index = next_value;
-    }
+    // The blocks of a file outside the root directory wait until its
+    // directory is on disk without it
+    struct pending_free *pf = NULL;
+    if (!in_root && fs->journal) {
+        pf = malloc(sizeof(struct pending_free));
+    }
+    if (pf) {
+        pf->first = fat_index;
+        pf->extents = extents;
+        pf->next = fs->pending_frees;
+        fs->pending_frees = pf;
+        pthread_mutex_unlock(&fs->fat_lock);
+        return 0;
+    }
+    blocks_release(fs, fat_index, &extents);
+    pthread_mutex_unlock(&fs->fat_lock);
+    free(extents.list);
     return 0;
 }
 
 
 // To give name, space and block information about files in the disk
-int fs_ls(void)
+int fs_ls_h(fs_t fs)
 {
-    if (is_mounted == 0) {
+    if (!fs) {
         return -1;
     }
+    pthread_rwlock_rdlock(&fs->root_lock);
     fprintf(stdout, "FS Ls:\n");
     for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (root_directory[i].block1_index != 0) {
-            fprintf(stdout, "file: %s, size: %d, data_blk: %d", \
-                    root_directory[i].filename, root_directory[i].file_size,
-                    root_directory[i].block1_index);
+        uint32_t first = node_first_block(fs, i);
+        if (first != 0) {
+            fprintf(stdout, "%s: %s, size: %d, data_blk: %u", \
+                    fs->root_directory[i].type == ENTRY_DIR ? "dir" : "file",
+                    fs->root_directory[i].filename,
+                    fs->root_directory[i].file_size,
+                    first == FAT_EOC ? fs->fat_eoc : first);
             printf("\n");
         }
     }
+    pthread_rwlock_unlock(&fs->root_lock);
     return 0;
 }
 
 
+// To open the given file, timing it if the latency histograms are on
+int fs_open_h(fs_t fs, const char *filename)
+{
+    if (!fs) {
+        return -1;
+    }
+    uint64_t start = stats_start(fs->stats);
+    int ret = file_open(fs, filename);
+    stats_record(fs->stats, FS_OP_OPEN, start);
+    return ret;
+}
+
+
 // To open the given file if present in the disk and assign it an fd
-int fs_open(const char *filename)
+int file_open(struct fs *fs, const char *filename)
 {
     if (!filename) {
         return -1;
     }
-    if (is_mounted == 0) {
-        return -1;
+    pthread_mutex_lock(&fs->fd_lock);
+    pthread_rwlock_rdlock(&fs->root_lock);
+    char name[FS_FILENAME_LEN];
+    int dir_node;
+    int file_match = path_lookup(fs, filename, &dir_node, name);
+    int descriptor = -1;
+    if (file_match != -1 && node_entry(fs, file_match)->type != ENTRY_DIR) {
+        descriptor = fd_alloc(fs);
     }
-    int descriptor = first_open_fd();
     if (descriptor == -1) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        pthread_mutex_unlock(&fs->fd_lock);
         return -1;
     }
-    int file_match = find_file(filename);
-    if (file_match == -1) {
-        return -1;
-    }
-    file_descriptor[descriptor].is_open = 1;
-    file_descriptor[descriptor].offset = 0;
-    strcpy((char*)file_descriptor[descriptor].file, \
-           (char*)root_directory[file_match].filename);
-    file_descriptor[descriptor].index =
-            root_directory[file_match].block1_index;
-    return 0;
+    // The fd points straight at the node, which holds the size and chain
+    struct fd *f = fd_slot(fs, descriptor);
+    f->offset = 0;
+    f->node = file_match;
+    f->cur_block = FAT_EOC;
+    f->cur_block_num = 0;
+    f->cur_extent = 0;
+    f->ra_expect = 0;
+    node_get(fs, file_match)->open_count++;
+    __atomic_store_n(&f->is_open, 1, __ATOMIC_RELEASE);
+    readahead_reset(fs, descriptor);
+    pthread_rwlock_unlock(&fs->root_lock);
+    pthread_mutex_unlock(&fs->fd_lock);
+    return descriptor;
 }
 
 
 // To close the file indicated by the fd and reset the associated variables
-int fs_close(int fd)
+int fs_close_h(fs_t fs, int fd)
 {
-    if (is_mounted == 0) {
+    if (!fs) {
         return -1;
     }
     if (fd < 0) {
         return -1;
     }
-    if (file_descriptor[fd].is_open != 1) {
+    struct fd *f = fd_get(fs, fd);
+    if (!f) {
         return -1;
     }
-    file_descriptor[fd].is_open = 0;
-    memset(file_descriptor[fd].file, '\0', FS_FILENAME_LEN);
-    file_descriptor[fd].index = 0;
-    file_descriptor[fd].offset = 0;
-    return 0;
+    // The file must not go away under the asynchronous requests on the fd
+    pthread_mutex_lock(&fs->aio_lock);
+    while (f->aio_inflight > 0) {
+        pthread_cond_wait(&fs->aio_done, &fs->aio_lock);
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+    int ret = wbuf_flush(fs, fd, 1);
+    pthread_mutex_lock(&fs->fd_lock);
+    free(f->wbuf);
+    f->wbuf = NULL;
+    node_get(fs, f->node)->open_count--;
+    f->offset = 0;
+    f->node = NO_SLOT;
+    f->cur_block = FAT_EOC;
+    f->cur_block_num = 0;
+    f->cur_extent = 0;
+    fd_release(fs, fd);
+    pthread_mutex_unlock(&fs->fd_lock);
+    return ret;
 }
 
 
 // To get size information about the file pointed at by the fd
-int fs_stat(int fd)
+int fs_stat_h(fs_t fs, int fd)
 {
-    if (is_mounted == 0) {
+    if (!fs) {
         return -1;
     }
     if (fd < 0) {
         return -1;
     }
-    if (file_descriptor[fd].is_open != 1) {
+    if (!fd_get(fs, fd)) {
         return -1;
     }
-    int fd_index = find_file((char *)file_descriptor[fd].file);
-    int result = root_directory[fd_index].file_size;
+    struct fd *f = fd_slot(fs, fd);
+    struct node *n = node_get(fs, f->node);
+    pthread_mutex_lock(&n->wbuf_lock);
+    // Appends buffered on another fd are written out to be seen, while those
+    // buffered on this fd already count
+    if (n->wbuf_fd != NO_SLOT && n->wbuf_fd != fd &&
+        wbuf_write(fs, n->wbuf_fd, 1) != 0) {
+        pthread_mutex_unlock(&n->wbuf_lock);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&n->lock);
+    int result = node_entry(fs, f->node)->file_size;
+    pthread_rwlock_unlock(&n->lock);
+    if (f->wbuf_len > 0 && f->wbuf_off + f->wbuf_len > (uint32_t)result) {
+        result = f->wbuf_off + f->wbuf_len;
+    }
+    pthread_mutex_unlock(&n->wbuf_lock);
     return result;
 }
 
 
 // To change the offset of the file indicated by the given fd to the given
 // offset
-int fs_lseek(int fd, size_t offset)
+int fs_lseek_h(fs_t fs, int fd, size_t offset)
 {
-    if (is_mounted == 0) {
-        printf("mouned is 0\n");
+    if (!fs) {
         return -1;
     }
     if (fd < 0) {
-        printf("fd less than 0\n");
         return -1;
     }
-    if (file_descriptor[fd].is_open != 1) {
-        printf("is open not 1\n");
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    if (node_wbuf_flush(fs, fd) != 0) {
         return -1;
     }
-    int fd_index = find_file((char *)file_descriptor[fd].file);
-    if (root_directory[fd_index].file_size < offset) {
+    int fd_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_rdlock(&node_get(fs, fd_index)->lock);
+    size_t file_size = node_entry(fs, fd_index)->file_size;
+    pthread_rwlock_unlock(&node_get(fs, fd_index)->lock);
+    if (file_size < offset) {
         return -1;
     }
-    file_descriptor[fd].offset = offset;
+    // Going backwards means walking the chain again from the start
+    if (offset / fs->block_size < fd_slot(fs, fd)->cur_block_num) {
+        fd_slot(fs, fd)->cur_block = FAT_EOC;
+        fd_slot(fs, fd)->cur_block_num = 0;
+    }
+    // Reads are no longer sequential
+    if (offset != fd_slot(fs, fd)->ra_expect) {
+        readahead_reset(fs, fd);
+    }
+    fd_slot(fs, fd)->offset = offset;
     return 0;
 }
-// To write the given bytes of data from a buffer pointer into the file
-// referenced by the file descriptor
-int fs_write(int fd, void *buf, size_t count)
+
+
+// To write into the file, timing it if the latency histograms are on
+int fs_write_h(fs_t fs, int fd, void *buf, size_t count)
 {
-    if (is_mounted == 0) {
+    if (!fs) {
         return -1;
     }
+    uint64_t start = stats_start(fs->stats);
+    int ret = file_write(fs, fd, buf, count);
+    stats_record(fs->stats, FS_OP_WRITE, start);
+    return ret;
+}
+
+
+// To write the given bytes of data from a buffer pointer into the file
+// referenced by the file descriptor. Small appends are only copied into the
+// fd's buffer, and written out later by wbuf_flush.
+int file_write(struct fs *fs, int fd, void *buf, size_t count)
+{
     if (fd < 0) {
         return -1;
     }
-    if (file_descriptor[fd].is_open != 1) {
+    if (!fd_get(fs, fd)) {
         return -1;
     }
     if (!buf) {
         return -1;
     }
-    char cur_filename[FS_FILENAME_LEN];
-    int cur_off;
-    int read_index = 1;
-    int start_index;
-    int fat_new;
-    int root_new;
-    int starting_block;
-    uint8_t * bounce_buf = (uint8_t * ) malloc(sizeof(uint8_t) * BLOCK_SIZE);
-    uint8_t * user_supplied_buf = (uint8_t* ) malloc(sizeof(uint8_t) * count);
-    memcpy(&user_supplied_buf[0], buf, count);
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (file_descriptor[fd].is_open) {
-            cur_off = file_descriptor[i].offset;
-            strcpy(cur_filename, (char *)file_descriptor[i].file);
-            break;
-        }
+    if (wbuf_append(fs, fd, buf, count) == 0) {
+        fd_slot(fs, fd)->offset += count;
+        return count;
     }
-    while((cur_off - BLOCK_SIZE) > 0){
-        cur_off -= BLOCK_SIZE;
-        read_index += 1;
-    }
-    start_index = find_file(cur_filename);
-    if (start_index == -1) {
+    if (node_wbuf_flush(fs, fd) != 0) {
         return -1;
     }
-    root_new = root_directory[start_index].block1_index;
-    fat_new = root_new;
-    for (int i = 1; i < read_index; i++){
-        fat_new = fat_block.fat_data[fat_new];
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_wrlock(&node_get(fs, file_index)->lock);
+    int written = write_range(fs, fd, file_index,
+                              fd_slot(fs, fd)->offset, buf, count);
+    if (written > 0) {
+        fd_slot(fs, fd)->offset += written;
     }
-    if ((fat_new == FAT_EOC) && (count > 0)) {
-        for (int i = 1; i < super.num_blocks; i++) {
-            if (fat_block.fat_data[i] == 0) {
-                fat_new = i;
-                fat_block.fat_data[i] = FAT_EOC;
-                break;
-            }
-        }
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    return written;
+}
+
+
+// To write out the appends buffered on the fd, then sync the file system
+int fs_fsync_h(fs_t fs, int fd)
+{
+    if (!fs) {
+        return -1;
     }
-    if((root_new == FAT_EOC) && (count > 0)){
-        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-            if (strcmp((char *)root_directory[i].filename, cur_filename) == 0) {
-                root_directory[start_index].block1_index = fat_new;
-                break;
-            }
-        }
+    if (fd < 0) {
+        return -1;
     }
-    starting_block = super.dblock_index + fat_new;
-    size_t fin_bytes = 0;
-    size_t rem_bytes = count;
-    size_t cur_bytes = 0;
-    while(fin_bytes < count){
-        size_t bytes_new = BLOCK_SIZE - (cur_off % BLOCK_SIZE);
-        if (block_read(starting_block, (void *)bounce_buf) != 0) {
-            return -1;
-        }
-        if(rem_bytes <= bytes_new){
-            cur_bytes = rem_bytes;
-        }
-        else{
-            cur_bytes = bytes_new;
-        }
-        memcpy(&bounce_buf[cur_off % BLOCK_SIZE], &user_supplied_buf[fin_bytes],
-               cur_bytes);
-        if (block_write(starting_block, (void *)bounce_buf) != 0) {
-            return -1;
-        }
-        rem_bytes = rem_bytes - cur_bytes;
-        fin_bytes += cur_bytes;
-        cur_off = cur_off + cur_bytes;
-        if(fin_bytes < count){
-            if(fat_block.fat_data[fat_new] == FAT_EOC){
-                for (int i = 1; i < super.num_blocks; i++) {
-                    if (fat_block.fat_data[i] == 0) {
-                        fat_block.fat_data[fat_new] = i;
-                        fat_block.fat_data[i] = FAT_EOC;
-                        break;
-                    }
-                }
-            }
-        }
-        fat_new = fat_block.fat_data[fat_new];
-        starting_block = super.dblock_index + fat_new;
+    if (!fd_get(fs, fd)) {
+        return -1;
     }
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (file_descriptor[fd].is_open) {
-            file_descriptor[i].offset = cur_off;
-            break;
-        }
+    int ret = node_wbuf_flush(fs, fd);
+    if (fs_sync_h(fs) != 0) {
+        ret = -1;
     }
-    int the_index = find_file((char *)file_descriptor[fd].file);
-    if ((int)root_directory[the_index].file_size < cur_off) {
-        root_directory[the_index].file_size = cur_off;
+    return ret;
+}
+
+
+// To read from the file, timing it if the latency histograms are on
+int fs_read_h(fs_t fs, int fd, void *buf, size_t count)
+{
+    if (!fs) {
+        return -1;
     }
-    return fin_bytes;
+    uint64_t start = stats_start(fs->stats);
+    int ret = file_read(fs, fd, buf, count);
+    stats_record(fs->stats, FS_OP_READ, start);
+    return ret;
 }
+
+
 // To read the given bytes of data from a buffer pointer into the file
 // referenced by the file descriptor
-int fs_read(int fd, void *buf, size_t count)
+int file_read(struct fs *fs, int fd, void *buf, size_t count)
 {
-    if (is_mounted == 0) {
-        return -1;
-    }
     if (fd < 0) {
         return -1;
     }
-    if (file_descriptor[fd].is_open != 1) {
+    if (!fd_get(fs, fd)) {
         return -1;
     }
     if (!buf) {
         return -1;
     }
-    char cur_filename[FS_FILENAME_LEN];
-    int cur_off;
-    int read_index = 1;
-    int start_index;
-    int fat_new;
-    int starting_block;
-    uint8_t * bounce_buf = (uint8_t * ) malloc(sizeof(uint8_t) * BLOCK_SIZE);
-    uint8_t * user_supplied_buf = (uint8_t* ) malloc(sizeof(uint8_t) * count);
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (file_descriptor[fd].is_open) {
-            cur_off = file_descriptor[i].offset;
-            strcpy(cur_filename, (char *)file_descriptor[i].file);
-            break;
-        }
-    }
-    while((cur_off - BLOCK_SIZE) > 0){
-        cur_off -= BLOCK_SIZE;
-        read_index += 1;
-    }
-    start_index = find_file(cur_filename);
-    if (start_index == -1) {
+    // Buffered appends must be on disk to be read back
+    if (node_wbuf_flush(fs, fd) != 0) {
         return -1;
     }
-    fat_new = root_directory[start_index].block1_index;
-    for (int j = 1; j < read_index; j++){
-        fat_new = fat_block.fat_data[fat_new];
-    }
-    starting_block = super.dblock_index + fat_new;
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_rdlock(&node_get(fs, file_index)->lock);
+    size_t cur_off = fd_slot(fs, fd)->offset;
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    if (cur_off >= file_size) {
+        count = 0;
+    } else if (count > file_size - cur_off) {
+        count = file_size - cur_off;
+    }
+    size_t start_off = cur_off;
+    uint8_t * user_supplied_buf = (uint8_t * ) buf;
     size_t fin_bytes = 0;
-    size_t rem_bytes = count;
     size_t cur_bytes = 0;
-    while(fin_bytes < count){
-        size_t bytes_new = BLOCK_SIZE - (cur_off % BLOCK_SIZE);
-        if (block_read(starting_block, (void *)bounce_buf)) {
-            return -1;
-        }
-        if(rem_bytes <= bytes_new){
-            cur_bytes = rem_bytes;
-        }
-        else{
-            cur_bytes = bytes_new;
+    int failed = 0;
+    while (fin_bytes < count) {
+        uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                       cur_off / fs->block_size);
+        size_t block_off = cur_off % fs->block_size;
+        size_t rem_bytes = count - fin_bytes;
+        if (block_off == 0 && rem_bytes >= fs->block_size) {
+            // Whole blocks come straight from disk, one call per contiguous
+            // run, once any newer cached copy has been written back
+            size_t run = cursor_run(fs, fd, rem_bytes / fs->block_size);
+            struct iovec iov = {
+                .iov_base = &user_supplied_buf[fin_bytes],
+                .iov_len = run * fs->block_size
+            };
+            size_t block = fs->dblock_index + fat_new;
+            if (cache_sync_range(fs->cache, block, run) != 0 ||
+                block_readv_h(fs->disk, block, &iov, 1) != 0) {
+                failed = 1;
+                break;
+            }
+            cur_bytes = run * fs->block_size;
+            cursor_skip_run(fs, fd, run);
+        } else {
+            cur_bytes = fs->block_size - block_off;
+            if (rem_bytes < cur_bytes) {
+                cur_bytes = rem_bytes;
+            }
+            if (read_partial(fs, fs->dblock_index + fat_new, block_off,
+                             &user_supplied_buf[fin_bytes], cur_bytes) != 0) {
+                failed = 1;
+                break;
+            }
         }
-        memcpy(&user_supplied_buf[fin_bytes], &bounce_buf[cur_off % BLOCK_SIZE],
-               cur_bytes);
-        rem_bytes = rem_bytes - cur_bytes;
         fin_bytes += cur_bytes;
-        cur_off = cur_off + cur_bytes;
-        fat_new = fat_block.fat_data[fat_new];
-        starting_block = super.dblock_index + fat_new;
-    }
-    memcpy(buf, &user_supplied_buf[0], count);
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (file_descriptor[fd].is_open) {
-            file_descriptor[i].offset = cur_off;
-            break;
-        }
+        cur_off += cur_bytes;
+    }
+    fd_slot(fs, fd)->offset = cur_off;
+    readahead(fs, fd, file_index, start_off, cur_off);
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    if (failed && fin_bytes == 0) {
+        return -1;
     }
     return fin_bytes;
 }
 
 
-/// Helper functions
-
-// Find the number of empty root entries
-int empty_root_entries() {
-    int result = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (root_directory[i].filename[0] == '\0') {
-            result++;
-        }
+// To hand out a pointer to the file's data in the memory-mapped disk, instead
+// of copying it like fs_read
+int fs_read_zc_h(fs_t fs, int fd, const void **ptr, size_t count)
+{
+    if (!fs) {
+        return -1;
     }
-    return result;
-}
-
-
-// Find the index of the given filename in the root directory
-int find_file(const char* filename) {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (strcmp((char *)root_directory[i].filename, filename) == 0) {
-            return i;
-        }
+    if (fd < 0) {
+        return -1;
     }
-    return -1;
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    if (!ptr) {
+        return -1;
+    }
+    if (node_wbuf_flush(fs, fd) != 0) {
+        return -1;
+    }
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_rdlock(&node_get(fs, file_index)->lock);
+    size_t cur_off = fd_slot(fs, fd)->offset;
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    *ptr = NULL;
+    if (cur_off >= file_size || count == 0) {
+        pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+        return 0;
+    }
+    if (count > file_size - cur_off) {
+        count = file_size - cur_off;
+    }
+    uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                   cur_off / fs->block_size);
+    uint8_t *block = block_ptr_h(fs->disk, fs->dblock_index + fat_new);
+    if (!block) {
+        pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+        return -1;
+    }
+    // Stop at the end of the contiguous run holding the current offset
+    size_t block_off = cur_off % fs->block_size;
+    size_t max_blocks = (block_off + count + fs->block_size - 1)
+                        / fs->block_size;
+    size_t run_bytes = cursor_run(fs, fd, max_blocks) * fs->block_size
+                       - block_off;
+    if (count > run_bytes) {
+        count = run_bytes;
+    }
+    *ptr = &block[block_off];
+    cursor_skip_run(fs, fd, (block_off + count - 1) / fs->block_size + 1);
+    fd_slot(fs, fd)->offset = cur_off + count;
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    return count;
 }
 
 
-// Find first empty root directory entry
-int find_first_empty(void) {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-        if (root_directory[i].filename[0] == '\0') {
-            return i;
+// To write data from a host file into the file, letting the disk copy it one
+// contiguous run at a time. The chain only grows a chunk ahead of the data,
+// since the host file may end early.
+int fs_import_h(fs_t fs, int fd, int host_fd, size_t count)
+{
+    if (!fs) {
+        return -1;
+    }
+    if (fd < 0 || host_fd < 0) {
+        return -1;
+    }
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    if (node_wbuf_flush(fs, fd) != 0) {
+        return -1;
+    }
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_wrlock(&node_get(fs, file_index)->lock);
+    size_t cur_off = fd_slot(fs, fd)->offset;
+    size_t fin_bytes = 0;
+    int failed = 0;
+    int host_end = 0;
+    while (fin_bytes < count && !failed && !host_end) {
+        size_t chunk = count - fin_bytes;
+        if (chunk > IMPORT_CHUNK_BLOCKS * fs->block_size) {
+            chunk = IMPORT_CHUNK_BLOCKS * fs->block_size;
+        }
+        size_t held = extend_chain(fs, fd, file_index,
+                                   (cur_off + chunk + fs->block_size - 1)
+                                   / fs->block_size) * fs->block_size;
+        if (held <= cur_off) {
+            break;
+        }
+        if (held < cur_off + chunk) {
+            chunk = held - cur_off;
+        }
+        while (chunk > 0) {
+            uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                           cur_off / fs->block_size);
+            size_t block_off = cur_off % fs->block_size;
+            size_t run = cursor_run(fs, fd, (block_off + chunk
+                                             + fs->block_size - 1)
+                                            / fs->block_size);
+            size_t len = run * fs->block_size - block_off;
+            if (len > chunk) {
+                len = chunk;
+            }
+            // Dirty cached blocks are written back first, since the part of
+            // them outside of the data must survive the copy
+            size_t block = fs->dblock_index + fat_new;
+            ssize_t copied = -1;
+            if (cache_sync_range(fs->cache, block, run) == 0) {
+                copied = block_copy_in_h(fs->disk, block, block_off, len,
+                                         host_fd);
+            }
+            cache_drop_range(fs->cache, block, run);
+            if (copied < 0) {
+                failed = 1;
+                break;
+            }
+            if (copied > 0) {
+                cursor_skip_run(fs, fd,
+                                (block_off + copied - 1) / fs->block_size + 1);
+            }
+            fin_bytes += copied;
+            cur_off += copied;
+            chunk -= copied;
+            if ((size_t)copied < len) {
+                host_end = 1;
+                break;
+            }
         }
     }
-    return -1;
+    if (node_entry(fs, file_index)->file_size < cur_off) {
+        node_entry(fs, file_index)->file_size = cur_off;
+        node_changed(fs, file_index);
+    }
+    fd_slot(fs, fd)->offset = cur_off;
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    if (failed && fin_bytes == 0) {
+        return -1;
+    }
+    return fin_bytes;
 }
 
 
-// Find first empty fat block entry
-int first_fit() {
-    for (int i = 0; i < super.block_fat; i++) {
-        if (fat_block.fat_data[i * BLOCK_SIZE] == 0) {
-            return i;
+// To read data from the file into a host file, letting the disk copy it one
+// contiguous run at a time
+int fs_export_h(fs_t fs, int fd, int host_fd, size_t count)
+{
+    if (!fs) {
+        return -1;
+    }
+    if (fd < 0 || host_fd < 0) {
+        return -1;
+    }
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    if (node_wbuf_flush(fs, fd) != 0) {
+        return -1;
+    }
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_rdlock(&node_get(fs, file_index)->lock);
+    size_t cur_off = fd_slot(fs, fd)->offset;
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    if (cur_off >= file_size) {
+        count = 0;
+    } else if (count > file_size - cur_off) {
+        count = file_size - cur_off;
+    }
+    size_t start_off = cur_off;
+    size_t fin_bytes = 0;
+    int failed = 0;
+    while (fin_bytes < count) {
+        uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                       cur_off / fs->block_size);
+        size_t block_off = cur_off % fs->block_size;
+        size_t rem_bytes = count - fin_bytes;
+        size_t run = cursor_run(fs, fd, (block_off + rem_bytes
+                                         + fs->block_size - 1)
+                                        / fs->block_size);
+        size_t len = run * fs->block_size - block_off;
+        if (len > rem_bytes) {
+            len = rem_bytes;
+        }
+        size_t block = fs->dblock_index + fat_new;
+        if (cache_sync_range(fs->cache, block, run) != 0 ||
+            block_copy_out_h(fs->disk, block, block_off, len, host_fd) < 0) {
+            failed = 1;
+            break;
         }
+        cursor_skip_run(fs, fd, (block_off + len - 1) / fs->block_size + 1);
+        fin_bytes += len;
+        cur_off += len;
+    }
+    fd_slot(fs, fd)->offset = cur_off;
+    readahead(fs, fd, file_index, start_off, cur_off);
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    if (failed && fin_bytes == 0) {
+        return -1;
     }
-    return -1;
+    return fin_bytes;
 }
 
 
-// Find the first open file descriptor
-int first_open_fd() {
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-        if (file_descriptor[i].file[0] == '\0') {
-            return i;
+// To read from the file referenced by the fd in the background. The chain is
+// resolved right away, and every block of the request is submitted to the
+// disk in one batch.
+int fs_read_async_h(fs_t fs, int fd, void *buf, size_t count, fs_aio_cb cb,
+                    void *arg)
+{
+    if (!fs) {
+        return -1;
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    if (!buf || !cb) {
+        return -1;
+    }
+    if (node_wbuf_flush(fs, fd) != 0) {
+        return -1;
+    }
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_rdlock(&node_get(fs, file_index)->lock);
+    size_t cur_off = fd_slot(fs, fd)->offset;
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    if (cur_off >= file_size) {
+        count = 0;
+    } else if (count > file_size - cur_off) {
+        count = file_size - cur_off;
+    }
+    size_t num_blocks = (cur_off % fs->block_size + count + fs->block_size - 1)
+                        / fs->block_size;
+    struct block_io *ios = malloc((num_blocks + 1) * sizeof(struct block_io));
+    struct aio_req *req = aio_req_alloc(fs, fd, cb, arg, 2);
+    if (!ios || !req) {
+        pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+        free(ios);
+        free(req);
+        return -1;
+    }
+    aio_req_start(req);
+    uint8_t * user_supplied_buf = (uint8_t * ) buf;
+    size_t fin_bytes = 0;
+    size_t cur_bytes = 0;
+    int num_ios = 0;
+    int failed = 0;
+    while (fin_bytes < count) {
+        uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                       cur_off / fs->block_size);
+        size_t block_off = cur_off % fs->block_size;
+        size_t rem_bytes = count - fin_bytes;
+        struct block_io *io = &ios[num_ios++];
+        io->block = fs->dblock_index + fat_new;
+        if (block_off == 0 && rem_bytes >= fs->block_size) {
+            // Whole blocks go straight into the buffer, one run at a time
+            io->nblocks = cursor_run(fs, fd, rem_bytes / fs->block_size);
+            io->buf = &user_supplied_buf[fin_bytes];
+            cur_bytes = io->nblocks * fs->block_size;
+            cursor_skip_run(fs, fd, io->nblocks);
+        } else {
+            // Partial blocks are read whole, and copied out on completion
+            cur_bytes = fs->block_size - block_off;
+            if (rem_bytes < cur_bytes) {
+                cur_bytes = rem_bytes;
+            }
+            int copy = req->num_copies++;
+            req->copies[copy].dst = &user_supplied_buf[fin_bytes];
+            req->copies[copy].block_off = block_off;
+            req->copies[copy].len = cur_bytes;
+            io->nblocks = 1;
+            io->buf = &req->bounce[copy * fs->block_size];
         }
+        // The disk must hold the latest content of the blocks
+        if (cache_sync_range(fs->cache, io->block, io->nblocks) != 0) {
+            failed = 1;
+            break;
+        }
+        fin_bytes += cur_bytes;
+        cur_off += cur_bytes;
+    }
+    fd_slot(fs, fd)->offset = cur_off;
+    req->ret = count;
+    // Once submitted, the request belongs to the completion path
+    int submitted = !failed && num_ios > 0 &&
+                    block_submit_h(fs->disk, 0, ios, num_ios, aio_read_done,
+                                   req) == 0;
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    free(ios);
+    if (!submitted) {
+        aio_req_finish(req, (failed || num_ios > 0) ? -1 : 0);
     }
-    return -1;
+    return 0;
 }
 
 
-// Find the number of free fat blocks
-int free_fat_blocks() {
+// To write to the file referenced by the fd in the background. The chain is
+// extended right away, partial blocks are written on the spot (usually into
+// the block cache), and every whole block is submitted to the disk in one
+// batch.
+int fs_write_async_h(fs_t fs, int fd, void *buf, size_t count, fs_aio_cb cb,
+                     void *arg)
+{
+    if (!fs) {
+        return -1;
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    if (!buf || !cb) {
+        return -1;
+    }
+    if (node_wbuf_flush(fs, fd) != 0) {
+        return -1;
+    }
+    int file_index = fd_slot(fs, fd)->node;
+    pthread_rwlock_wrlock(&node_get(fs, file_index)->lock);
+    size_t cur_off = fd_slot(fs, fd)->offset;
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    size_t blocks_held = extend_chain(fs, fd, file_index,
+                                      (cur_off + count + fs->block_size - 1)
+                                      / fs->block_size);
+    if (blocks_held * fs->block_size < cur_off + count) {
+        count = (blocks_held * fs->block_size > cur_off) ?
+                blocks_held * fs->block_size - cur_off : 0;
+    }
+    size_t num_blocks = (cur_off % fs->block_size + count + fs->block_size - 1)
+                        / fs->block_size;
+    struct block_io *ios = malloc((num_blocks + 1) * sizeof(struct block_io));
+    struct aio_req *req = aio_req_alloc(fs, fd, cb, arg, 0);
+    if (!ios || !req) {
+        pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+        free(ios);
+        free(req);
+        return -1;
+    }
+    aio_req_start(req);
+    uint8_t * user_supplied_buf = (uint8_t * ) buf;
+    size_t fin_bytes = 0;
+    size_t cur_bytes = 0;
+    int num_ios = 0;
+    int failed = 0;
+    while (fin_bytes < count) {
+        uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                       cur_off / fs->block_size);
+        size_t block_off = cur_off % fs->block_size;
+        size_t rem_bytes = count - fin_bytes;
+        size_t block = fs->dblock_index + fat_new;
+        if (block_off == 0 && rem_bytes >= fs->block_size) {
+            struct block_io *io = &ios[num_ios++];
+            io->block = block;
+            io->nblocks = cursor_run(fs, fd, rem_bytes / fs->block_size);
+            io->buf = &user_supplied_buf[fin_bytes];
+            cache_drop_range(fs->cache, block, io->nblocks);
+            cur_bytes = io->nblocks * fs->block_size;
+            cursor_skip_run(fs, fd, io->nblocks);
+        } else {
+            cur_bytes = fs->block_size - block_off;
+            if (rem_bytes < cur_bytes) {
+                cur_bytes = rem_bytes;
+            }
+            size_t block_start = cur_off - block_off;
+            size_t live_end = 0;
+            if (file_size > block_start) {
+                live_end = file_size - block_start;
+            }
+            int fresh = (block_off == 0 || live_end == 0) &&
+                        block_off + cur_bytes >= live_end;
+            if (write_partial(fs, block, block_off,
+                              &user_supplied_buf[fin_bytes], cur_bytes,
+                              fresh) != 0) {
+                failed = 1;
+                break;
+            }
+        }
+        fin_bytes += cur_bytes;
+        cur_off += cur_bytes;
+    }
+    fd_slot(fs, fd)->offset = cur_off;
+    if (file_size < cur_off) {
+        node_entry(fs, file_index)->file_size = cur_off;
+        node_changed(fs, file_index);
+    }
+    req->ret = fin_bytes;
+    // Once submitted, the request belongs to the completion path
+    int submitted = num_ios > 0 &&
+                    block_submit_h(fs->disk, 1, ios, num_ios, aio_write_done,
+                                   req) == 0;
+    pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+    free(ios);
+    if (!submitted) {
+        aio_req_finish(req, (num_ios > 0 || (failed && fin_bytes == 0)) ?
+                            -1 : 0);
+    }
+    return 0;
+}
+
+
+// To wait until every asynchronous request has completed
+int fs_aio_wait_h(fs_t fs)
+{
+    if (!fs) {
+        return -1;
+    }
+    pthread_mutex_lock(&fs->aio_lock);
+    while (fs->aio_inflight > 0) {
+        pthread_cond_wait(&fs->aio_done, &fs->aio_lock);
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+    return 0;
+}
+
+
+// To write back the dirty data blocks, then the FAT blocks and the root
+// directory if they changed since the last sync
+int fs_sync_h(fs_t fs)
+{
+    if (!fs) {
+        return -1;
+    }
+    int ret = 0;
+    if (cache_flush(fs->cache) != 0) {
+        ret = -1;
+    }
+    if (meta_flush(fs) != 0) {
+        ret = -1;
+    }
+    if (block_disk_sync_h(fs->disk) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+
+// To report the block reads and writes issued to the virtual disk
+int fs_io_stats(struct fs_io_stats *stats)
+{
+    if (!stats) {
+        return -1;
+    }
+    struct block_stats bs;
+    block_get_stats(&bs);
+    stats->read_calls = bs.read_calls;
+    stats->write_calls = bs.write_calls;
+    stats->blocks_read = bs.blocks_read;
+    stats->blocks_written = bs.blocks_written;
+    return 0;
+}
+
+
+// To select the memory-mapped disk backend for the next mounts
+int fs_set_mmap(int enable)
+{
+    if (any_mounted()) {
+        return -1;
+    }
+    disk_backend = enable ? BLOCK_BACKEND_MMAP : BLOCK_BACKEND_FILE;
+    return 0;
+}
+
+
+// To set the number of blocks cached by the next mounts
+int fs_set_cache_size(size_t nblocks)
+{
+    if (any_mounted()) {
+        return -1;
+    }
+    cache_blocks = nblocks;
+    return 0;
+}
+
+
+// To set how many files the next mounts can have open at once
+int fs_set_open_max(size_t max)
+{
+    if (any_mounted() || max == 0 || max > FS_OPEN_LIMIT) {
+        return -1;
+    }
+    open_max = max;
+    return 0;
+}
+
+
+// To set whether the next mounts time their operations
+int fs_set_latency_histograms(int enable)
+{
+    if (any_mounted()) {
+        return -1;
+    }
+    latency_histograms = enable;
+    return 0;
+}
+
+
+// To set the largest read-ahead window of the next mounts
+int fs_set_readahead(size_t max_blocks)
+{
+    if (any_mounted()) {
+        return -1;
+    }
+    readahead_blocks = max_blocks;
+    return 0;
+}
+
+
+// To set the size of the append buffers of the fds of the next mounts
+int fs_set_write_buffer(size_t nblocks)
+{
+    if (any_mounted()) {
+        return -1;
+    }
+    write_buffer_blocks = nblocks;
+    return 0;
+}
+
+
+// To set how often the next mounts sync in the background
+int fs_set_sync_interval(unsigned ms)
+{
+    if (any_mounted()) {
+        return -1;
+    }
+    sync_interval_ms = ms;
+    return 0;
+}
+
+
+// To get the current read-ahead window of the fd
+int fs_readahead_window_h(fs_t fs, int fd)
+{
+    if (!fs) {
+        return -1;
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (!fd_get(fs, fd)) {
+        return -1;
+    }
+    return fd_slot(fs, fd)->ra_window;
+}
+
+
+// To report how many blocks were prefetched and how many of them were read
+int fs_readahead_stats_h(fs_t fs, struct fs_readahead_stats *stats)
+{
+    if (!fs || !stats) {
+        return -1;
+    }
+    stats->prefetched = __atomic_load_n(&fs->ra_prefetched, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&fs->ra_hits, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+// To report the hit, miss and eviction counters of the block cache
+int fs_cache_stats_h(fs_t fs, struct fs_cache_stats *stats)
+{
+    if (!fs || !stats) {
+        return -1;
+    }
+    struct cache_stats cs;
+    cache_get_stats(fs->cache, &cs);
+    stats->hits = cs.hits;
+    stats->misses = cs.misses;
+    stats->evictions = cs.evictions;
+    stats->writebacks = cs.writebacks;
+    return 0;
+}
+
+
+// To report the I/O and work counters of the file system
+int fs_stats_h(fs_t fs, struct fs_stats *stats)
+{
+    if (!fs || !stats) {
+        return -1;
+    }
+    struct block_stats bs;
+    block_disk_stats_h(fs->disk, &bs);
+    stats->read_calls = bs.read_calls;
+    stats->write_calls = bs.write_calls;
+    stats->blocks_read = bs.blocks_read;
+    stats->blocks_written = bs.blocks_written;
+    stats->bytes_copied = stats_get(fs->stats, STATS_BYTES_COPIED);
+    stats->fat_steps = stats_get(fs->stats, STATS_FAT_STEPS);
+    stats->find_file_calls = stats_get(fs->stats, STATS_FIND_FILE);
+    struct alloc_stats as;
+    pthread_mutex_lock(&fs->fat_lock);
+    alloc_get_stats(fs->free_map, &as);
+    pthread_mutex_unlock(&fs->fat_lock);
+    stats->alloc_calls = as.calls;
+    stats->alloc_scanned = as.words_scanned;
+    return 0;
+}
+
+
+// To report the latency percentiles of an operation
+int fs_latency_h(fs_t fs, enum fs_op op, struct fs_latency *latency)
+{
+    if (!fs || (int)op < 0 || op >= FS_OP_COUNT || !latency) {
+        return -1;
+    }
+    struct stats_latency sl;
+    stats_latency(fs->stats, op, &sl);
+    latency->count = sl.count;
+    latency->p50 = sl.p50;
+    latency->p90 = sl.p90;
+    latency->p99 = sl.p99;
+    latency->p999 = sl.p999;
+    latency->max = sl.max;
+    return 0;
+}
+
+
+/// Helper functions
+
+// Find the number of empty root entries
+int empty_root_entries(struct fs *fs) {
     int result = 0;
-    for (int i = 0; i < super.num_blocks; i++) {
-        if (fat_block.fat_data[i] == 0) {
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (fs->root_directory[i].filename[0] == '\0') {
             result++;
         }
     }
     return result;
 }
+
+
+// Find the index of the given filename in the root directory
+int find_file(struct fs *fs, const char* filename) {
+    return index_find(fs, fs->name_index, NAME_INDEX_SIZE, filename);
+}
+
+
+// Hash a filename into a name index (FNV-1a)
+unsigned name_hash(const char* filename) {
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+// Index every file of the root directory by name
+void name_index_build(struct fs *fs) {
+    for (int i = 0; i < NAME_INDEX_SIZE; i++) {
+        fs->name_index[i] = NO_SLOT;
+    }
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (fs->root_directory[i].filename[0] != '\0') {
+            index_insert(fs, fs->name_index, NAME_INDEX_SIZE, i);
+        }
+    }
+}
+
+
+// Find the node of the given filename in a name index: an open-addressing
+// hash table of nodes, with NO_SLOT in the free positions. The root directory
+// has one, and so does each loaded directory.
+int index_find(struct fs *fs, const int *index, size_t size,
+               const char* filename) {
+    if (filename[0] == '\0') {
+        return -1;
+    }
+    stats_add(fs->stats, STATS_FIND_FILE, 1);
+    size_t pos = name_hash(filename) % size;
+    while (index[pos] != NO_SLOT) {
+        if (strncmp(node_entry(fs, index[pos])->filename, filename,
+                    FS_FILENAME_LEN) == 0) {
+            return index[pos];
+        }
+        pos = (pos + 1) % size;
+    }
+    return -1;
+}
+
+
+// Add the given node to a name index
+void index_insert(struct fs *fs, int *index, size_t size, int node) {
+    size_t pos = name_hash(node_entry(fs, node)->filename) % size;
+    while (index[pos] != NO_SLOT) {
+        pos = (pos + 1) % size;
+    }
+    index[pos] = node;
+}
+
+
+// Remove the given node from a name index, moving back the entries that were
+// pushed past it
+void index_remove(struct fs *fs, int *index, size_t size, int node) {
+    size_t pos = name_hash(node_entry(fs, node)->filename) % size;
+    while (index[pos] != node) {
+        pos = (pos + 1) % size;
+    }
+    size_t next = (pos + 1) % size;
+    while (index[next] != NO_SLOT) {
+        size_t home = name_hash(node_entry(fs, index[next])->filename) % size;
+        // Move the entry into the hole unless its home lies in (pos, next]
+        if ((next > pos) ? (home <= pos || home > next)
+                         : (home <= pos && home > next)) {
+            index[pos] = index[next];
+            pos = next;
+        }
+        next = (next + 1) % size;
+    }
+    index[pos] = NO_SLOT;
+}
+
+
+// Get a node
+struct node* node_get(struct fs *fs, int node) {
+    return &fs->nodes[node / NODE_CHUNK][node % NODE_CHUNK];
+}
+
+
+// Get the directory entry of a node
+struct root_entry* node_entry(struct fs *fs, int node) {
+    if (node < FS_FILE_MAX_COUNT) {
+        return &fs->root_directory[node];
+    }
+    return &node_get(fs, node)->entry;
+}
+
+
+// Remember that the directory entry of a node needs writing back. Its lock
+// must be held for writing, or root_lock.
+void node_changed(struct fs *fs, int node) {
+    if (node < FS_FILE_MAX_COUNT) {
+        __atomic_store_n(&fs->root_dirty, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&node_get(fs, node)->entry_dirty, 1,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+
+// Take a node for an entry outside the root directory, or return -1 if there
+// are too many. The root_lock must be held for writing, or for reading along
+// with the dcache_lock.
+int node_alloc(struct fs *fs) {
+    int node = fs->free_node;
+    if (node != NO_SLOT) {
+        fs->free_node = node_get(fs, node)->next_free;
+        return node;
+    }
+    if (fs->num_nodes == NODE_CHUNK * NODE_CHUNKS_MAX) {
+        return -1;
+    }
+    node = fs->num_nodes;
+    if (!fs->nodes[node / NODE_CHUNK]) {
+        struct node *chunk = calloc(NODE_CHUNK, sizeof(struct node));
+        if (!chunk) {
+            return -1;
+        }
+        for (int i = 0; i < NODE_CHUNK; i++) {
+            pthread_rwlock_init(&chunk[i].lock, NULL);
+            pthread_mutex_init(&chunk[i].wbuf_lock, NULL);
+            chunk[i].wbuf_fd = NO_SLOT;
+        }
+        fs->nodes[node / NODE_CHUNK] = chunk;
+    }
+    fs->num_nodes++;
+    return node;
+}
+
+
+// Give back a node taken with node_alloc, once its blocks are gone. The same
+// locks must be held.
+void node_release(struct fs *fs, int node) {
+    struct node *n = node_get(fs, node);
+    memset(&n->entry, 0, sizeof(n->entry));
+    memset(&n->extents, 0, sizeof(n->extents));
+    n->parent = NO_SLOT;
+    n->entry_dirty = 0;
+    n->next_free = fs->free_node;
+    fs->free_node = node;
+}
+
+
+// Resolve a path, made of names separated by '/', into the node of its last
+// name, or -1 if there is none. dir is set to the node of the directory that
+// holds (or would hold) the last name, NO_SLOT for the root directory, or
+// PATH_INVALID if a directory on the way is missing or cannot be read or if
+// a name is too long; name is set to the last name. The directories on the
+// way are loaded as needed. The root_lock must be held.
+int path_lookup(struct fs *fs, const char *path, int *dir, char *name) {
+    *dir = PATH_INVALID;
+    // Root entries created before directories existed may have a '/' in their
+    // name, and are still found under it
+    if (strlen(path) < FS_FILENAME_LEN && strchr(path, '/')) {
+        int node = find_file(fs, path);
+        if (node != -1) {
+            *dir = NO_SLOT;
+            strcpy(name, path);
+            return node;
+        }
+    }
+    if (path[0] == '/') {
+        path++;
+    }
+    int parent = NO_SLOT;
+    for (;;) {
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len == 0 || len >= FS_FILENAME_LEN) {
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        int node;
+        if (parent == NO_SLOT) {
+            node = find_file(fs, name);
+        } else {
+            struct dir *d = dir_get(fs, parent);
+            if (!d) {
+                return -1;
+            }
+            node = index_find(fs, d->index, d->index_size, name);
+        }
+        if (!end) {
+            *dir = parent;
+            return node;
+        }
+        if (node == -1 || node_entry(fs, node)->type != ENTRY_DIR) {
+            return -1;
+        }
+        parent = node;
+        path = end + 1;
+    }
+}
+
+
+// Get the content of the directory of the given node, loading it first if
+// needed, or NULL if it cannot be read. The root_lock must be held.
+struct dir* dir_get(struct fs *fs, int node) {
+    struct node *n = node_get(fs, node);
+    struct dir *dir = __atomic_load_n(&n->dir, __ATOMIC_ACQUIRE);
+    if (dir) {
+        return dir;
+    }
+    pthread_mutex_lock(&fs->dcache_lock);
+    if (!n->dir && dir_load(fs, node) != 0) {
+        pthread_mutex_unlock(&fs->dcache_lock);
+        return NULL;
+    }
+    dir = n->dir;
+    pthread_mutex_unlock(&fs->dcache_lock);
+    return dir;
+}
+
+
+// Read the directory of the given node from disk, giving a node to each of its
+// entries. The root_lock and the dcache_lock must be held.
+int dir_load(struct fs *fs, int node) {
+    struct root_entry *entry = node_entry(fs, node);
+    size_t num_blocks = entry->file_size / fs->block_size;
+    if (entry->file_size % fs->block_size != 0) {
+        return -1;
+    }
+    struct dir *dir = dir_new(node);
+    uint8_t *block = malloc(2 * fs->block_size);
+    if (!dir || !block) {
+        dir_free(dir);
+        free(block);
+        return -1;
+    }
+    struct file_extents *fe = &node_get(fs, node)->extents;
+    uint32_t fat_index = node_first_block(fs, node);
+    size_t per_block = fs->block_size / sizeof(struct root_entry);
+    int ret = 0;
+    while (ret == 0 && dir->num_blocks < num_blocks) {
+        if (fs->extent_layout) {
+            size_t i = extent_find(fe, dir->num_blocks);
+            fat_index = (i == fe->count) ? FAT_EOC :
+                        fe->list[i].start
+                        + (dir->num_blocks - fe->list[i].file_block);
+        } else if (dir->num_blocks > 0) {
+            fat_index = fs->fat_block.fat_data[fat_index];
+        }
+        if (fat_index >= fs->num_blocks ||
+            dir_add_block(dir, fat_index, per_block) != 0 ||
+            block_read_h(fs->disk, fs->dblock_index + fat_index,
+                         block) != 0) {
+            ret = -1;
+            break;
+        }
+        dir->dirty[dir->num_blocks - 1] = 0;
+        root_t entries = (root_t)block;
+        for (size_t i = 0; i < per_block; i++) {
+            if (entries[i].filename[0] == '\0') {
+                continue;
+            }
+            int child = node_alloc(fs);
+            if (child == -1) {
+                ret = -1;
+                break;
+            }
+            struct node *c = node_get(fs, child);
+            c->entry = entries[i];
+            c->entry.filename[FS_FILENAME_LEN - 1] = '\0';
+            c->parent = node;
+            c->slot = (dir->num_blocks - 1) * per_block + i;
+            dir->slots[c->slot] = child;
+            dir->num_used++;
+            if (dir_index_add(fs, dir, child) != 0) {
+                ret = -1;
+                break;
+            }
+            uint32_t first = node_first_block(fs, child);
+            if (!fs->extent_layout || first == FAT_EOC) {
+                continue;
+            }
+            uint8_t *eb = &block[fs->block_size];
+            if (first >= fs->num_blocks ||
+                block_read_h(fs->disk, fs->dblock_index + first, eb) != 0 ||
+                extents_load(fs, child, eb) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    free(block);
+    if (ret != 0) {
+        // The nodes handed out so far go back with the directory
+        for (size_t i = 0; i < dir->num_slots; i++) {
+            if (dir->slots[i] != NO_SLOT) {
+                free(node_get(fs, dir->slots[i])->extents.list);
+                node_release(fs, dir->slots[i]);
+            }
+        }
+        dir_free(dir);
+        return -1;
+    }
+    dir->next = fs->dirs;
+    fs->dirs = dir;
+    __atomic_store_n(&node_get(fs, node)->dir, dir, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+// Set up an empty directory for the given node
+struct dir* dir_new(int node) {
+    struct dir *dir = calloc(1, sizeof(struct dir));
+    if (!dir) {
+        return NULL;
+    }
+    dir->node = node;
+    dir->index_size = NAME_INDEX_SIZE;
+    dir->index = malloc(dir->index_size * sizeof(int));
+    if (!dir->index) {
+        free(dir);
+        return NULL;
+    }
+    for (size_t i = 0; i < dir->index_size; i++) {
+        dir->index[i] = NO_SLOT;
+    }
+    return dir;
+}
+
+
+// Release a directory set up with dir_new (not its nodes)
+void dir_free(struct dir *dir) {
+    if (!dir) {
+        return;
+    }
+    free(dir->slots);
+    free(dir->index);
+    free(dir->blocks);
+    free(dir->dirty);
+    free(dir);
+}
+
+
+// Append a block to a directory in memory, with per_block free slots, and
+// flag it for writing
+int dir_add_block(struct dir *dir, uint32_t fat_index, size_t per_block) {
+    size_t num_slots = dir->num_slots + per_block;
+    int *slots = realloc(dir->slots, num_slots * sizeof(int));
+    if (!slots) {
+        return -1;
+    }
+    dir->slots = slots;
+    uint32_t *blocks = realloc(dir->blocks,
+                               (dir->num_blocks + 1) * sizeof(uint32_t));
+    if (!blocks) {
+        return -1;
+    }
+    dir->blocks = blocks;
+    uint8_t *dirty = realloc(dir->dirty, dir->num_blocks + 1);
+    if (!dirty) {
+        return -1;
+    }
+    dir->dirty = dirty;
+    for (size_t i = dir->num_slots; i < num_slots; i++) {
+        dir->slots[i] = NO_SLOT;
+    }
+    dir->num_slots = num_slots;
+    dir->blocks[dir->num_blocks] = fat_index;
+    dir->dirty[dir->num_blocks] = 1;
+    dir->num_blocks++;
+    return 0;
+}
+
+
+// Add a node to the name index of a directory, which is rebuilt twice as large
+// once it is half full
+int dir_index_add(struct fs *fs, struct dir *dir, int node) {
+    if (2 * dir->num_used > dir->index_size) {
+        size_t size = 2 * dir->index_size;
+        int *index = malloc(size * sizeof(int));
+        if (!index) {
+            return -1;
+        }
+        for (size_t i = 0; i < size; i++) {
+            index[i] = NO_SLOT;
+        }
+        for (size_t i = 0; i < dir->index_size; i++) {
+            if (dir->index[i] != NO_SLOT) {
+                index_insert(fs, index, size, dir->index[i]);
+            }
+        }
+        free(dir->index);
+        dir->index = index;
+        dir->index_size = size;
+    }
+    index_insert(fs, dir->index, dir->index_size, node);
+    return 0;
+}
+
+
+// Grow a directory by one block of free slots. The block is zeroed on disk
+// before the directory's size takes it in, so that the journal never commits
+// a directory holding a block of garbage. The root_lock must be held for
+// writing.
+int dir_grow(struct fs *fs, struct dir *dir) {
+    struct node *n = node_get(fs, dir->node);
+    size_t per_block = fs->block_size / sizeof(struct root_entry);
+    if (dir_add_block(dir, FAT_EOC, per_block) != 0) {
+        return -1;
+    }
+    // Undone below if no block can be had
+    dir->num_blocks--;
+    dir->num_slots -= per_block;
+    pthread_rwlock_wrlock(&n->lock);
+    uint32_t fat_index = FAT_EOC;
+    if (fs->extent_layout) {
+        if (extent_extend(fs, dir->node, dir->num_blocks + 1)
+            > dir->num_blocks) {
+            size_t i = extent_find(&n->extents, dir->num_blocks);
+            fat_index = n->extents.list[i].start
+                        + (dir->num_blocks - n->extents.list[i].file_block);
+        }
+    } else {
+        pthread_mutex_lock(&fs->fat_lock);
+        int block = alloc_block(fs->free_map);
+        if (block != -1) {
+            fat_index = block;
+            fat_set(fs, fat_index, FAT_EOC);
+            if (dir->num_blocks == 0) {
+                node_set_first_block(fs, dir->node, fat_index);
+            } else {
+                fat_set(fs, dir->blocks[dir->num_blocks - 1], fat_index);
+            }
+        }
+        pthread_mutex_unlock(&fs->fat_lock);
+    }
+    if (fat_index == FAT_EOC) {
+        pthread_rwlock_unlock(&n->lock);
+        return -1;
+    }
+    // The block may have held a file, whose cached copy must not land on it.
+    // If it cannot be zeroed, it is still written whole by the next flush.
+    size_t block = fs->dblock_index + fat_index;
+    uint8_t *bounce_buf = bounce_get(fs);
+    memset(bounce_buf, 0, fs->block_size);
+    cache_drop_range(fs->cache, block, 1);
+    block_write_h(fs->disk, block, bounce_buf);
+    bounce_put(fs, bounce_buf);
+    dir->blocks[dir->num_blocks] = fat_index;
+    dir->num_blocks++;
+    dir->num_slots += per_block;
+    node_entry(fs, dir->node)->file_size += fs->block_size;
+    node_changed(fs, dir->node);
+    pthread_rwlock_unlock(&n->lock);
+    return 0;
+}
+
+
+// Create an entry of the given type in a directory (NO_SLOT for the root
+// directory), growing the directory if it is full, and return its node, or -1
+// if there is no room for it. The root_lock must be held for writing.
+int dir_add(struct fs *fs, int dir_node, const char *name, uint8_t type) {
+    int node;
+    if (dir_node == NO_SLOT) {
+        node = find_first_empty(fs);
+        if (node == -1) {
+            return -1;
+        }
+        memset(&fs->root_directory[node], 0, sizeof(struct root_entry));
+        strcpy(fs->root_directory[node].filename, name);
+        fs->root_directory[node].type = type;
+        node_set_first_block(fs, node, FAT_EOC);
+        node_get(fs, node)->parent = NO_SLOT;
+        node_changed(fs, node);
+        index_insert(fs, fs->name_index, NAME_INDEX_SIZE, node);
+        return node;
+    }
+    struct dir *dir = node_get(fs, dir_node)->dir;
+    size_t slot = dir->free_hint;
+    while (slot < dir->num_slots && dir->slots[slot] != NO_SLOT) {
+        slot++;
+    }
+    if (slot == dir->num_slots && dir_grow(fs, dir) != 0) {
+        dir->free_hint = slot;
+        return -1;
+    }
+    node = node_alloc(fs);
+    if (node == -1) {
+        return -1;
+    }
+    struct node *n = node_get(fs, node);
+    strcpy(n->entry.filename, name);
+    n->entry.type = type;
+    node_set_first_block(fs, node, FAT_EOC);
+    n->parent = dir_node;
+    n->slot = slot;
+    dir->num_used++;
+    if (dir_index_add(fs, dir, node) != 0) {
+        dir->num_used--;
+        node_release(fs, node);
+        return -1;
+    }
+    dir->slots[slot] = node;
+    dir->free_hint = slot + 1;
+    dir->dirty[slot / (fs->block_size / sizeof(struct root_entry))] = 1;
+    return node;
+}
+
+
+// Create an entry of the given type at the given path, if its directory
+// exists and has no entry of that name yet
+int create_entry(struct fs *fs, const char *path, uint8_t type) {
+    if (!path) {
+        return -1;
+    }
+    if (!fs) {
+        return -1;
+    }
+    char name[FS_FILENAME_LEN];
+    int dir_node;
+    pthread_rwlock_wrlock(&fs->root_lock);
+    int node = path_lookup(fs, path, &dir_node, name);
+    if (node != -1 || dir_node == PATH_INVALID ||
+        dir_add(fs, dir_node, name, type) == -1) {
+        pthread_rwlock_unlock(&fs->root_lock);
+        return -1;
+    }
+    pthread_rwlock_unlock(&fs->root_lock);
+    return 0;
+}
+
+
+// Remove the entry of a node from its directory. Its blocks are left alone,
+// and a node outside the root directory must then be given back with
+// node_release. The root_lock must be held for writing.
+void dir_remove(struct fs *fs, int node) {
+    struct node *n = node_get(fs, node);
+    if (n->parent == NO_SLOT) {
+        index_remove(fs, fs->name_index, NAME_INDEX_SIZE, node);
+        memset(&fs->root_directory[node], 0, sizeof(struct root_entry));
+        node_set_first_block(fs, node, 0);
+        node_changed(fs, node);
+        return;
+    }
+    struct dir *dir = node_get(fs, n->parent)->dir;
+    index_remove(fs, dir->index, dir->index_size, node);
+    dir->slots[n->slot] = NO_SLOT;
+    dir->num_used--;
+    if (n->slot < dir->free_hint) {
+        dir->free_hint = n->slot;
+    }
+    dir->dirty[n->slot / (fs->block_size / sizeof(struct root_entry))] = 1;
+}
+
+
+// Give the blocks of a deleted file back to the allocator: its chain (in
+// extent layout, only the extent block) and its extents. The fat_lock must be
+// held.
+void blocks_release(struct fs *fs, uint32_t fat_index,
+                    struct file_extents *extents) {
+    while (fat_index != FAT_EOC) {
+        uint32_t next_value = fs->fat_block.fat_data[fat_index];
+        fat_set(fs, fat_index, 0);
+        alloc_release(fs->free_map, fat_index);
+        fat_index = next_value;
+    }
+    for (size_t i = 0; i < extents->count; i++) {
+        for (size_t j = 0; j < extents->list[i].len; j++) {
+            fat_set(fs, extents->list[i].start + j, 0);
+            alloc_release(fs->free_map, extents->list[i].start + j);
+        }
+    }
+}
+
+// Find first empty root directory entry
+int find_first_empty(struct fs *fs) {
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+        if (fs->root_directory[i].filename[0] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Find first empty fat block entry
+int first_fit(struct fs *fs) {
+    for (size_t i = 0; i < fs->block_fat; i++) {
+        if (fs->fat_block.fat_data[i * fs->fat_per_block] == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Get an open file descriptor, or NULL if fd is out of the table or not open
+struct fd* fd_get(struct fs *fs, int fd) {
+    if (fd < 0 || fd >= __atomic_load_n(&fs->num_fds, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    struct fd *f = fd_slot(fs, fd);
+    return __atomic_load_n(&f->is_open, __ATOMIC_ACQUIRE) ? f : NULL;
+}
+
+
+// Get the slot of a file descriptor of the table, open or not
+struct fd* fd_slot(struct fs *fs, int fd) {
+    return &fs->fds[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+
+// Take a free file descriptor, the last one closed if any, or return -1 if
+// open_max are open already. The fd_lock must be held.
+int fd_alloc(struct fs *fs) {
+    if (fs->num_open >= fs->open_max) {
+        return -1;
+    }
+    int fd = fs->free_fd;
+    if (fd != NO_SLOT) {
+        fs->free_fd = fd_slot(fs, fd)->next_free;
+        fs->num_open++;
+        return fd;
+    }
+    fd = fs->num_fds;
+    if (fd == FD_CHUNK * FD_CHUNKS_MAX) {
+        return -1;
+    }
+    if (!fs->fds[fd / FD_CHUNK]) {
+        struct fd *chunk = calloc(FD_CHUNK, sizeof(struct fd));
+        if (!chunk) {
+            return -1;
+        }
+        fs->fds[fd / FD_CHUNK] = chunk;
+    }
+    __atomic_store_n(&fs->num_fds, fd + 1, __ATOMIC_RELEASE);
+    fs->num_open++;
+    return fd;
+}
+
+
+// Close a file descriptor taken with fd_alloc and put it on the free list.
+// The fd_lock must be held.
+void fd_release(struct fs *fs, int fd) {
+    struct fd *f = fd_slot(fs, fd);
+    __atomic_store_n(&f->is_open, 0, __ATOMIC_RELEASE);
+    f->next_free = fs->free_fd;
+    fs->free_fd = fd;
+    fs->num_open--;
+}
+
+
+// Find the number of free fat blocks
+int free_fat_blocks(struct fs *fs) {
+    return alloc_free_count(fs->free_map);
+}
+
+
+// Find the average number of contiguous blocks per extent over all the files
+// known to the file system: the root directory's and the ones of the loaded
+// directories. The root_lock and the dcache_lock must be held.
+double average_extent_length(struct fs *fs) {
+    size_t blocks = 0;
+    size_t extents = 0;
+    if (fs->extent_layout) {
+        for (int i = 0; i < fs->num_nodes; i++) {
+            pthread_rwlock_rdlock(&node_get(fs, i)->lock);
+            struct file_extents *fe = &node_get(fs, i)->extents;
+            for (size_t e = 0; e < fe->count; e++) {
+                blocks += fe->list[e].len;
+            }
+            extents += fe->count;
+            pthread_rwlock_unlock(&node_get(fs, i)->lock);
+        }
+        return extents ? (double)blocks / extents : 0.0;
+    }
+    pthread_mutex_lock(&fs->fat_lock);
+    for (int i = 0; i < fs->num_nodes; i++) {
+        if (node_entry(fs, i)->filename[0] == '\0') {
+            continue;
+        }
+        uint32_t fat_index = node_first_block(fs, i);
+        uint32_t prev = FAT_EOC;
+        while (fat_index != FAT_EOC) {
+            if (prev == FAT_EOC || fat_index != prev + 1) {
+                extents++;
+            }
+            blocks++;
+            prev = fat_index;
+            fat_index = fs->fat_block.fat_data[fat_index];
+        }
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    return extents ? (double)blocks / extents : 0.0;
+}
+
+
+// Move the fd's cursor to the given block of its file and return its fat
+// index. The chain is walked from the cursor, or from the first block of the
+// file when going backwards. Past the end of the chain, the cursor stays on the
+// last block and FAT_EOC is returned. In extent layout, the extent holding the
+// block is looked up instead, unless it is the one of the cursor.
+uint32_t cursor_seek(struct fs *fs, int fd, int file_index, size_t block_num) {
+    struct fd *cursor = fd_slot(fs, fd);
+    if (fs->extent_layout) {
+        struct file_extents *fe = &node_get(fs, file_index)->extents;
+        size_t i = cursor->cur_extent;
+        if (i >= fe->count || block_num < fe->list[i].file_block ||
+            block_num >= fe->list[i].file_block + fe->list[i].len) {
+            i = extent_find(fe, block_num);
+            if (i == fe->count) {
+                return FAT_EOC;
+            }
+            cursor->cur_extent = i;
+        }
+        cursor->cur_block = fe->list[i].start
+                            + (block_num - fe->list[i].file_block);
+        cursor->cur_block_num = block_num;
+        return cursor->cur_block;
+    }
+    if (cursor->cur_block == FAT_EOC || block_num < cursor->cur_block_num) {
+        cursor->cur_block = node_first_block(fs, file_index);
+        cursor->cur_block_num = 0;
+        if (cursor->cur_block == FAT_EOC) {
+            return FAT_EOC;
+        }
+    }
+    size_t steps = 0;
+    while (cursor->cur_block_num < block_num) {
+        uint32_t next = fs->fat_block.fat_data[cursor->cur_block];
+        steps++;
+        if (next == FAT_EOC) {
+            break;
+        }
+        cursor->cur_block = next;
+        cursor->cur_block_num++;
+    }
+    if (steps > 0) {
+        stats_add(fs->stats, STATS_FAT_STEPS, steps);
+    }
+    return (cursor->cur_block_num < block_num) ? FAT_EOC : cursor->cur_block;
+}
+
+
+// Move the fd's cursor to the last block of a contiguous run starting at the
+// cursor, without walking the chain
+void cursor_skip_run(struct fs *fs, int fd, size_t run) {
+    fd_slot(fs, fd)->cur_block += run - 1;
+    fd_slot(fs, fd)->cur_block_num += run - 1;
+}
+
+
+// Find how many blocks of the chain starting at fat_index directly follow each
+// other on disk, up to max_blocks
+size_t contiguous_run(struct fs *fs, uint32_t fat_index, size_t max_blocks) {
+    size_t run = 1;
+    while (run < max_blocks && fs->fat_block.fat_data[fat_index + run - 1]
+                               == fat_index + run) {
+        run++;
+    }
+    return run;
+}
+
+
+// Find how many blocks from the fd's cursor directly follow each other on
+// disk, up to max_blocks
+size_t cursor_run(struct fs *fs, int fd, size_t max_blocks) {
+    struct fd *cursor = fd_slot(fs, fd);
+    if (!fs->extent_layout) {
+        return contiguous_run(fs, cursor->cur_block, max_blocks);
+    }
+    struct extent *e =
+            &node_get(fs, cursor->node)->extents.list[cursor->cur_extent];
+    size_t run = e->file_block + e->len - cursor->cur_block_num;
+    return (run < max_blocks) ? run : max_blocks;
+}
+
+
+// Append free blocks to the file's chain until it holds num_blocks blocks, and
+// return the number of blocks it ends up holding (at most num_blocks). The
+// end of the chain is found from the fd's cursor.
+size_t extend_chain(struct fs *fs, int fd, int file_index, size_t num_blocks) {
+    if (num_blocks == 0) {
+        return 0;
+    }
+    if (fs->extent_layout) {
+        return extent_extend(fs, file_index, num_blocks);
+    }
+    if (cursor_seek(fs, fd, file_index, num_blocks - 1) != FAT_EOC) {
+        return num_blocks;
+    }
+    uint32_t last = fd_slot(fs, fd)->cur_block;
+    size_t held = (last == FAT_EOC) ? 0
+                  : fd_slot(fs, fd)->cur_block_num + 1;
+    pthread_mutex_lock(&fs->fat_lock);
+    while (held < num_blocks) {
+        // Ask for the rest of the file in one go, right after its last block
+        size_t run = 0;
+        int fat_new = alloc_run(fs->free_map, last == FAT_EOC ? 0 : last + 1,
+                                num_blocks - held, &run);
+        if (fat_new == -1) {
+            break;
+        }
+        for (size_t i = 0; i < run; i++) {
+            if (last == FAT_EOC) {
+                node_set_first_block(fs, file_index, fat_new + i);
+                node_changed(fs, file_index);
+            } else {
+                fat_set(fs, last, fat_new + i);
+            }
+            last = fat_new + i;
+        }
+        fat_set(fs, last, FAT_EOC);
+        held += run;
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    return held;
+}
+
+
+// Find the extent of the file holding the given block of the file (binary
+// search), or return the number of extents if the file is shorter
+size_t extent_find(struct file_extents *fe, size_t block_num) {
+    size_t lo = 0;
+    size_t hi = fe->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fe->list[mid].file_block + fe->list[mid].len <= block_num) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < fe->count && fe->list[lo].file_block <= block_num) {
+        return lo;
+    }
+    return fe->count;
+}
+
+
+// Extent layout counterpart of extend_chain: append free blocks to the file's
+// extents until it holds num_blocks blocks, growing the last extent when they
+// directly follow it on disk. The extent block is allocated along with the
+// first extent. Once the extent block is full, the file only grows by growing
+// its last extent.
+size_t extent_extend(struct fs *fs, int file_index, size_t num_blocks) {
+    struct file_extents *fe = &node_get(fs, file_index)->extents;
+    struct extent *last = fe->count ? &fe->list[fe->count - 1] : NULL;
+    size_t held = last ? last->file_block + last->len : 0;
+    if (held >= num_blocks) {
+        return num_blocks;
+    }
+    pthread_mutex_lock(&fs->fat_lock);
+    if (node_first_block(fs, file_index) == FAT_EOC) {
+        int block = alloc_block(fs->free_map);
+        if (block == -1) {
+            pthread_mutex_unlock(&fs->fat_lock);
+            return held;
+        }
+        fat_set(fs, block, FAT_EOC);
+        node_set_first_block(fs, file_index, block);
+        node_changed(fs, file_index);
+    }
+    while (held < num_blocks) {
+        size_t goal = last ? last->start + last->len : 0;
+        size_t run = 0;
+        int start = alloc_run(fs->free_map, goal, num_blocks - held, &run);
+        if (start == -1) {
+            break;
+        }
+        if (!last || (size_t)start != goal) {
+            // A new extent, if there is room for it
+            if (fe->count == fe->capacity && fe->count < fs->max_extents) {
+                size_t capacity = fe->capacity ? 2 * fe->capacity : 4;
+                if (capacity > fs->max_extents) {
+                    capacity = fs->max_extents;
+                }
+                struct extent *list = realloc(fe->list,
+                                              capacity * sizeof(*list));
+                if (list) {
+                    fe->list = list;
+                    fe->capacity = capacity;
+                }
+            }
+            if (fe->count == fe->capacity) {
+                for (size_t i = 0; i < run; i++) {
+                    alloc_release(fs->free_map, start + i);
+                }
+                break;
+            }
+            last = &fe->list[fe->count++];
+            last->file_block = held;
+            last->start = start;
+            last->len = 0;
+        }
+        for (size_t i = 0; i < run; i++) {
+            fat_set(fs, start + i, FAT_EOC);
+        }
+        last->len += run;
+        held += run;
+        __atomic_store_n(&fe->dirty, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    return held;
+}
+
+
+// Read the extents of a file from its extent block
+int extents_load(struct fs *fs, int file_index, const uint8_t *block) {
+    const struct extent_block *eb = (const struct extent_block *)block;
+    struct file_extents *fe = &node_get(fs, file_index)->extents;
+    if (memcmp(eb->signature, EXTENT_SIGNATURE, 8) != 0 ||
+        eb->num_extents > fs->max_extents) {
+        return -1;
+    }
+    fe->count = 0;
+    fe->capacity = eb->num_extents;
+    fe->list = malloc((fe->capacity ? fe->capacity : 1) * sizeof(*fe->list));
+    if (!fe->list) {
+        fe->capacity = 0;
+        return -1;
+    }
+    size_t file_block = 0;
+    for (size_t i = 0; i < eb->num_extents; i++) {
+        if (eb->extents[i].len == 0 ||
+            eb->extents[i].start >= fs->num_blocks ||
+            eb->extents[i].len > fs->num_blocks - eb->extents[i].start) {
+            return -1;
+        }
+        fe->list[i].file_block = file_block;
+        fe->list[i].start = eb->extents[i].start;
+        fe->list[i].len = eb->extents[i].len;
+        file_block += eb->extents[i].len;
+        fe->count++;
+    }
+    return 0;
+}
+
+
+// Put the extents of a file in the form of its extent block
+void extents_store(struct fs *fs, int file_index, uint8_t *block) {
+    struct extent_block *eb = (struct extent_block *)block;
+    struct file_extents *fe = &node_get(fs, file_index)->extents;
+    memset(block, 0, fs->block_size);
+    memcpy(eb->signature, EXTENT_SIGNATURE, 8);
+    eb->num_extents = fe->count;
+    for (size_t i = 0; i < fe->count; i++) {
+        eb->extents[i].start = fe->list[i].start;
+        eb->extents[i].len = fe->list[i].len;
+    }
+}
+
+
+// Copy part of a disk block into buf, straight from the mapping if the disk is
+// memory-mapped, or else from the block cache. Only with neither does the
+// block go through a bounce buffer.
+int read_partial(struct fs *fs, size_t block, size_t block_off, void *buf,
+                 size_t len) {
+    stats_add(fs->stats, STATS_BYTES_COPIED, len);
+    uint8_t *mapped = block_ptr_h(fs->disk, block);
+    if (mapped) {
+        memcpy(buf, &mapped[block_off], len);
+        return 0;
+    }
+    if (cache_capacity(fs->cache) > 0) {
+        return cache_read_part(fs->cache, block, block_off, buf, len);
+    }
+    uint8_t *bounce_buf = bounce_get(fs);
+    int ret = block_read_h(fs->disk, block, bounce_buf);
+    if (ret == 0) {
+        memcpy(buf, &bounce_buf[block_off], len);
+    }
+    bounce_put(fs, bounce_buf);
+    return ret;
+}
+
+
+// Copy buf into part of a disk block, keeping the rest of the block intact. A
+// fresh block holds no file data outside of buf, so it is not read from disk
+// and the rest of it is zeroed instead.
+int write_partial(struct fs *fs, size_t block, size_t block_off,
+                  const void *buf, size_t len, int fresh) {
+    stats_add(fs->stats, STATS_BYTES_COPIED, len);
+    uint8_t *mapped = block_ptr_h(fs->disk, block);
+    if (mapped) {
+        memcpy(&mapped[block_off], buf, len);
+        return 0;
+    }
+    if (cache_capacity(fs->cache) > 0) {
+        if (fresh) {
+            return cache_write_fresh(fs->cache, block, block_off, buf, len);
+        }
+        return cache_write_part(fs->cache, block, block_off, buf, len);
+    }
+    uint8_t *bounce_buf = bounce_get(fs);
+    int ret = 0;
+    if (fresh) {
+        memset(bounce_buf, 0, fs->block_size);
+    } else {
+        ret = block_read_h(fs->disk, block, bounce_buf);
+    }
+    if (ret == 0) {
+        memcpy(&bounce_buf[block_off], buf, len);
+        ret = block_write_h(fs->disk, block, bounce_buf);
+    }
+    bounce_put(fs, bounce_buf);
+    return ret;
+}
+
+
+// Write count bytes of buf into the file at cur_off, growing its chain and
+// size as needed, and return the number of bytes written (-1 if nothing could
+// be written because of an I/O error). The file lock must be held for
+// writing; the fd is only used for its cursor.
+int write_range(struct fs *fs, int fd, int file_index, size_t cur_off,
+                const uint8_t *buf, size_t count) {
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    // Grow the chain up front so whole-block spans can be written as runs; if
+    // the disk fills up, only write what fits in the blocks we got
+    size_t blocks_held = extend_chain(fs, fd, file_index,
+                                      (cur_off + count + fs->block_size - 1)
+                                      / fs->block_size);
+    if (blocks_held * fs->block_size < cur_off + count) {
+        count = (blocks_held * fs->block_size > cur_off) ?
+                blocks_held * fs->block_size - cur_off : 0;
+    }
+    size_t fin_bytes = 0;
+    size_t cur_bytes = 0;
+    int failed = 0;
+    while (fin_bytes < count) {
+        uint32_t fat_new = cursor_seek(fs, fd, file_index,
+                                       cur_off / fs->block_size);
+        size_t block_off = cur_off % fs->block_size;
+        size_t rem_bytes = count - fin_bytes;
+        if (block_off == 0 && rem_bytes >= fs->block_size) {
+            // Whole blocks go straight to disk, one call per contiguous run
+            size_t run = cursor_run(fs, fd, rem_bytes / fs->block_size);
+            struct iovec iov = {
+                .iov_base = (void *)&buf[fin_bytes],
+                .iov_len = run * fs->block_size
+            };
+            if (block_writev_h(fs->disk, fs->dblock_index + fat_new,
+                               &iov, 1) != 0) {
+                failed = 1;
+                break;
+            }
+            cache_drop_range(fs->cache, fs->dblock_index + fat_new, run);
+            cur_bytes = run * fs->block_size;
+            cursor_skip_run(fs, fd, run);
+        } else {
+            cur_bytes = fs->block_size - block_off;
+            if (rem_bytes < cur_bytes) {
+                cur_bytes = rem_bytes;
+            }
+            // Only read the block in if it holds file data outside of the
+            // bytes being written
+            size_t block_start = cur_off - block_off;
+            size_t live_end = 0;
+            if (file_size > block_start) {
+                live_end = file_size - block_start;
+            }
+            int fresh = (block_off == 0 || live_end == 0) &&
+                        block_off + cur_bytes >= live_end;
+            if (write_partial(fs, fs->dblock_index + fat_new, block_off,
+                              &buf[fin_bytes], cur_bytes, fresh) != 0) {
+                failed = 1;
+                break;
+            }
+        }
+        fin_bytes += cur_bytes;
+        cur_off += cur_bytes;
+    }
+    if (file_size < cur_off) {
+        node_entry(fs, file_index)->file_size = cur_off;
+        node_changed(fs, file_index);
+    }
+    if (failed && fin_bytes == 0) {
+        return -1;
+    }
+    return fin_bytes;
+}
+
+
+// Copy a small append into the fd's buffer instead of writing it, and return
+// -1 if it has to be written right away instead. Only one fd of a file
+// buffers appends at a time: those of another fd are written out first.
+int wbuf_append(struct fs *fs, int fd, const void *buf, size_t count) {
+    if (count == 0 || count >= fs->wbuf_max) {
+        return -1;
+    }
+    struct node *n = node_get(fs, fd_slot(fs, fd)->node);
+    pthread_mutex_lock(&n->wbuf_lock);
+    int ret = -1;
+    if (n->wbuf_fd == NO_SLOT || n->wbuf_fd == fd ||
+        wbuf_write(fs, n->wbuf_fd, 1) == 0) {
+        ret = wbuf_add(fs, fd, buf, count);
+    }
+    if (ret == 0) {
+        n->wbuf_fd = fd;
+    }
+    pthread_mutex_unlock(&n->wbuf_lock);
+    return ret;
+}
+
+
+// Copy an append into the fd's buffer, as wbuf_append. A full buffer is
+// emptied of its whole blocks first. The wbuf_lock of the file must be held.
+int wbuf_add(struct fs *fs, int fd, const void *buf, size_t count) {
+    struct fd *f = fd_slot(fs, fd);
+    if (f->wbuf_len == 0) {
+        // Only writes at the end of the file are buffered
+        int file_index = f->node;
+        pthread_rwlock_rdlock(&node_get(fs, file_index)->lock);
+        size_t file_size = node_entry(fs, file_index)->file_size;
+        pthread_rwlock_unlock(&node_get(fs, file_index)->lock);
+        if ((size_t)f->offset != file_size) {
+            return -1;
+        }
+        if (!f->wbuf) {
+            f->wbuf = malloc(fs->wbuf_max);
+            if (!f->wbuf) {
+                return -1;
+            }
+        }
+    } else if (f->wbuf_len + count > fs->wbuf_max) {
+        if (wbuf_write(fs, fd, 0) != 0) {
+            return -1;
+        }
+        if (f->wbuf_len + count > fs->wbuf_max &&
+            wbuf_write(fs, fd, 1) != 0) {
+            return -1;
+        }
+    }
+    if (f->wbuf_len == 0) {
+        f->wbuf_off = f->offset;
+    }
+    memcpy(&f->wbuf[f->wbuf_len], buf, count);
+    stats_add(fs->stats, STATS_BYTES_COPIED, count);
+    f->wbuf_len += count;
+    return 0;
+}
+
+
+// Write out the appends buffered on the fd. Unless all is set, only the bytes
+// up to the last block boundary are written, and the rest stays buffered.
+int wbuf_flush(struct fs *fs, int fd, int all) {
+    struct node *n = node_get(fs, fd_slot(fs, fd)->node);
+    pthread_mutex_lock(&n->wbuf_lock);
+    int ret = wbuf_write(fs, fd, all);
+    pthread_mutex_unlock(&n->wbuf_lock);
+    return ret;
+}
+
+
+// Write out the appends buffered on the file of the fd, whichever of its fds
+// holds them, so that they can be seen through this one
+int node_wbuf_flush(struct fs *fs, int fd) {
+    struct node *n = node_get(fs, fd_slot(fs, fd)->node);
+    pthread_mutex_lock(&n->wbuf_lock);
+    int ret = 0;
+    if (n->wbuf_fd != NO_SLOT) {
+        ret = wbuf_write(fs, n->wbuf_fd, 1);
+    }
+    pthread_mutex_unlock(&n->wbuf_lock);
+    return ret;
+}
+
+
+// Write out the appends buffered on the fd, allocating their blocks now so
+// that they follow each other on disk, like wbuf_flush. If the disk fills up,
+// the appends that do not fit are dropped and -1 is returned. The wbuf_lock
+// of the file must be held.
+int wbuf_write(struct fs *fs, int fd, int all) {
+    struct fd *f = fd_slot(fs, fd);
+    if (f->wbuf_len == 0) {
+        return 0;
+    }
+    size_t len = f->wbuf_len;
+    if (!all) {
+        size_t end = f->wbuf_off + f->wbuf_len;
+        if (end - end % fs->block_size <= f->wbuf_off) {
+            return 0;
+        }
+        len = end - end % fs->block_size - f->wbuf_off;
+    }
+    int file_index = f->node;
+    struct node *n = node_get(fs, file_index);
+    pthread_rwlock_wrlock(&n->lock);
+    int written = write_range(fs, fd, file_index, f->wbuf_off, f->wbuf, len);
+    size_t file_size = node_entry(fs, file_index)->file_size;
+    pthread_rwlock_unlock(&n->lock);
+    int ret = 0;
+    if (written != (int)len) {
+        f->wbuf_len = 0;
+        if ((size_t)f->offset > file_size) {
+            f->offset = file_size;
+        }
+        ret = -1;
+    } else {
+        memmove(f->wbuf, &f->wbuf[len], f->wbuf_len - len);
+        f->wbuf_off += len;
+        f->wbuf_len -= len;
+    }
+    if (f->wbuf_len == 0 && n->wbuf_fd == fd) {
+        n->wbuf_fd = NO_SLOT;
+    }
+    return ret;
+}
+
+
+// Change an entry of the FAT and remember that its block needs writing back.
+// The fat_lock must be held.
+void fat_set(struct fs *fs, uint32_t fat_index, uint32_t value) {
+    fs->fat_block.fat_data[fat_index] = value;
+    fs->fat_dirty[fat_index / fs->fat_per_block] = 1;
+}
+
+
+// Fill a block of the in-memory FAT from its on-disk form, widening 16-bit
+// entries
+void fat_load(struct fs *fs, size_t fat_block, const uint8_t *src) {
+    uint32_t *fat = &fs->fat_block.fat_data[fat_block * fs->fat_per_block];
+    if (fs->fat_eoc == FAT_EOC) {
+        memcpy(fat, src, fs->block_size);
+        return;
+    }
+    const uint16_t *entries = (const uint16_t *)src;
+    for (size_t i = 0; i < fs->fat_per_block; i++) {
+        fat[i] = (entries[i] == FAT16_EOC) ? FAT_EOC : entries[i];
+    }
+}
+
+
+// Put a block of the in-memory FAT in its on-disk form, narrowing it back to
+// 16-bit entries if needed
+void fat_store(struct fs *fs, size_t fat_block, uint8_t *dst) {
+    const uint32_t *fat =
+            &fs->fat_block.fat_data[fat_block * fs->fat_per_block];
+    if (fs->fat_eoc == FAT_EOC) {
+        memcpy(dst, fat, fs->block_size);
+        return;
+    }
+    uint16_t *entries = (uint16_t *)dst;
+    for (size_t i = 0; i < fs->fat_per_block; i++) {
+        entries[i] = (uint16_t)fat[i];
+    }
+}
+
+
+// Get the first data block of the file of the given node, or FAT_EOC if it is
+// empty
+uint32_t node_first_block(struct fs *fs, int file_index) {
+    struct root_entry *entry = node_entry(fs, file_index);
+    uint32_t fat_index = entry->block1_index;
+    if (fs->fat_eoc == FAT_EOC) {
+        fat_index |= (uint32_t)entry->block1_high << 16;
+    }
+    return (fat_index == fs->fat_eoc) ? FAT_EOC : fat_index;
+}
+
+
+// Set the first data block of the file of the given node
+void node_set_first_block(struct fs *fs, int file_index, uint32_t fat_index) {
+    struct root_entry *entry = node_entry(fs, file_index);
+    entry->block1_index = fat_index & 0xFFFF;
+    entry->block1_high = (fs->fat_eoc == FAT_EOC) ? fat_index >> 16 : 0;
+}
+
+
+// Get the geometry of the disk out of the superblock, in either layout
+int super_parse(struct fs *fs) {
+    struct super_block *super = &fs->super;
+    if (memcmp(super->signature, "ECS150FS", 8) != 0) {
+        return -1;
+    }
+    if (super->version == SUPER_LEGACY) {
+        fs->block_size = BLOCK_SIZE;
+        fs->disk_blocks = super->disk_blocks;
+        fs->root_index = super->root_index;
+        fs->dblock_index = super->dblock_index;
+        fs->num_blocks = super->num_blocks;
+        fs->block_fat = super->block_fat;
+        fs->fat_eoc = FAT16_EOC;
+    } else if (super->version == SUPER_EXTENDED &&
+               (super->fat_bits == 16 || super->fat_bits == 32) &&
+               (super->layout == LAYOUT_FAT ||
+                super->layout == LAYOUT_EXTENTS)) {
+        fs->block_size = super->block_size;
+        fs->disk_blocks = super->disk_blocks32;
+        fs->root_index = super->root_index32;
+        fs->dblock_index = super->dblock_index32;
+        fs->num_blocks = super->num_blocks32;
+        fs->block_fat = super->block_fat32;
+        fs->fat_eoc = (super->fat_bits == 32) ? FAT_EOC : FAT16_EOC;
+        fs->extent_layout = (super->layout == LAYOUT_EXTENTS);
+    } else {
+        return -1;
+    }
+    if (fs->block_size < BLOCK_SIZE || fs->block_size > BLOCK_SIZE_MAX) {
+        return -1;
+    }
+    // Block indexes are handed out as ints, and must not reach FAT_EOC
+    fs->fat_per_block = fs->block_size / (fs->fat_eoc == FAT_EOC ? 4 : 2);
+    fs->max_extents = (fs->block_size - sizeof(struct extent_block))
+                      / sizeof(((struct extent_block *)0)->extents[0]);
+    fs->meta_max = fs->block_fat + 1;
+    if (fs->extent_layout) {
+        fs->meta_max += FS_FILE_MAX_COUNT;
+    }
+    if (fs->block_fat == 0 || fs->root_index != fs->block_fat + 1 ||
+        fs->dblock_index < fs->block_fat + 2 ||
+        fs->num_blocks > fs->block_fat * fs->fat_per_block ||
+        fs->num_blocks >= fs->fat_eoc || fs->num_blocks > INT32_MAX) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Make room for num_blocks metadata blocks in the flush buffers. The
+// sync_lock must be held.
+int meta_reserve(struct fs *fs, size_t num_blocks) {
+    if (num_blocks <= fs->meta_capacity) {
+        return 0;
+    }
+    size_t capacity = 2 * fs->meta_capacity;
+    if (capacity < num_blocks) {
+        capacity = num_blocks;
+    }
+    uint8_t *copy = realloc(fs->meta_copy, capacity * fs->block_size);
+    if (!copy) {
+        return -1;
+    }
+    fs->meta_copy = copy;
+    size_t *home = realloc(fs->meta_home, capacity * sizeof(size_t));
+    if (!home) {
+        return -1;
+    }
+    fs->meta_home = home;
+    struct meta_source *source = realloc(fs->meta_source,
+                                         capacity * sizeof(*source));
+    if (!source) {
+        return -1;
+    }
+    fs->meta_source = source;
+    fs->meta_capacity = capacity;
+    return 0;
+}
+
+
+// Copy the blocks of the loaded directories holding entries that changed, or
+// slots that were taken or freed, after the first num_blocks blocks of the
+// flush buffers, and return the new number of blocks. A block that cannot be
+// copied for lack of memory stays flagged. The sync_lock, the root_lock and
+// the dcache_lock must be held.
+size_t meta_copy_dirs(struct fs *fs, size_t num_blocks) {
+    size_t per_block = fs->block_size / sizeof(struct root_entry);
+    for (struct dir *dir = fs->dirs; dir; dir = dir->next) {
+        for (size_t b = 0; b < dir->num_blocks; b++) {
+            int dirty = dir->dirty[b];
+            for (size_t i = b * per_block; !dirty && i < (b + 1) * per_block;
+                 i++) {
+                dirty = dir->slots[i] != NO_SLOT &&
+                        __atomic_load_n(&node_get(fs, dir->slots[i])
+                                        ->entry_dirty, __ATOMIC_RELAXED);
+            }
+            if (!dirty || meta_reserve(fs, num_blocks + 1) != 0) {
+                continue;
+            }
+            root_t copy = (root_t)&fs->meta_copy[num_blocks * fs->block_size];
+            memset(copy, 0, fs->block_size);
+            for (size_t i = 0; i < per_block; i++) {
+                int node = dir->slots[b * per_block + i];
+                if (node == NO_SLOT) {
+                    continue;
+                }
+                struct node *n = node_get(fs, node);
+                pthread_rwlock_rdlock(&n->lock);
+                __atomic_store_n(&n->entry_dirty, 0, __ATOMIC_RELAXED);
+                copy[i] = n->entry;
+                pthread_rwlock_unlock(&n->lock);
+            }
+            dir->dirty[b] = 0;
+            fs->meta_home[num_blocks] = fs->dblock_index + dir->blocks[b];
+            fs->meta_source[num_blocks].node = dir->node;
+            fs->meta_source[num_blocks].dir_block = b;
+            num_blocks++;
+        }
+    }
+    return num_blocks;
+}
+
+
+// Write the first num_blocks blocks of the flush buffers in place, the last
+// num_fat of them being FAT blocks. With a journal, they go in one
+// transaction if it can hold them, or else in several ones starting with the
+// FAT, so that a crash between two of them can leak blocks but never leave
+// an entry pointing at a free block.
+int meta_commit(struct fs *fs, size_t num_blocks, size_t num_fat) {
+    if (!fs->journal) {
+        int ret = 0;
+        for (size_t i = 0; i < num_blocks; i++) {
+            if (block_write_h(fs->disk, fs->meta_home[i],
+                              &fs->meta_copy[i * fs->block_size]) != 0) {
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+    size_t capacity = journal_capacity(fs->journal);
+    if (num_blocks <= capacity) {
+        return journal_commit(fs->journal, fs->meta_home, fs->meta_copy,
+                              num_blocks);
+    }
+    // The FAT blocks come last, and always fit in one transaction
+    size_t end = num_blocks;
+    size_t start = num_blocks - num_fat;
+    while (end > 0) {
+        if (journal_commit(fs->journal, &fs->meta_home[start],
+                           &fs->meta_copy[start * fs->block_size],
+                           end - start) != 0) {
+            return -1;
+        }
+        end = start;
+        start = (end > capacity) ? end - capacity : 0;
+    }
+    return 0;
+}
+
+
+// Write back the FAT blocks, the root directory, the directory blocks and the
+// extent blocks if they changed since they were last written, as one journal
+// transaction if the disk has a journal and it is large enough. The blocks
+// are copied first, the entries and the extents one file at a time under the
+// file's lock, so that writers are not held off during the I/O.
+int meta_flush(struct fs *fs) {
+    int ret = 0;
+    size_t num_blocks = 0;
+    pthread_mutex_lock(&fs->sync_lock);
+    // The blocks of the files deleted before the last flush can go, now that
+    // their directories are on disk without them
+    pthread_mutex_lock(&fs->fat_lock);
+    while (fs->committed_frees) {
+        struct pending_free *pf = fs->committed_frees;
+        fs->committed_frees = pf->next;
+        blocks_release(fs, pf->first, &pf->extents);
+        free(pf->extents.list);
+        free(pf);
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    // The blocks pointing at data blocks are copied before the FAT, so that
+    // the copy of the FAT has every block they point at marked as used
+    pthread_rwlock_rdlock(&fs->root_lock);
+    if (__atomic_exchange_n(&fs->root_dirty, 0, __ATOMIC_RELAXED)) {
+        uint8_t *block = &fs->meta_copy[num_blocks * fs->block_size];
+        root_t copy = (root_t)block;
+        memset(&block[sizeof(fs->root_directory)], 0,
+               fs->block_size - sizeof(fs->root_directory));
+        for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+            pthread_rwlock_rdlock(&node_get(fs, i)->lock);
+            copy[i] = fs->root_directory[i];
+            pthread_rwlock_unlock(&node_get(fs, i)->lock);
+        }
+        fs->meta_home[num_blocks] = fs->block_fat + 1;
+        fs->meta_source[num_blocks].node = NO_SLOT;
+        fs->meta_source[num_blocks].dir_block = UINT32_MAX;
+        num_blocks++;
+    }
+    // No directory is loaded meanwhile
+    pthread_mutex_lock(&fs->dcache_lock);
+    num_blocks = meta_copy_dirs(fs, num_blocks);
+    for (int i = 0; fs->extent_layout && i < fs->num_nodes; i++) {
+        struct node *n = node_get(fs, i);
+        if (node_entry(fs, i)->filename[0] == '\0' ||
+            node_first_block(fs, i) == FAT_EOC ||
+            !__atomic_load_n(&n->extents.dirty, __ATOMIC_RELAXED) ||
+            meta_reserve(fs, num_blocks + 1) != 0) {
+            continue;
+        }
+        pthread_rwlock_rdlock(&n->lock);
+        __atomic_store_n(&n->extents.dirty, 0, __ATOMIC_RELAXED);
+        extents_store(fs, i, &fs->meta_copy[num_blocks * fs->block_size]);
+        fs->meta_home[num_blocks] = fs->dblock_index + node_first_block(fs, i);
+        fs->meta_source[num_blocks].node = i;
+        fs->meta_source[num_blocks].dir_block = UINT32_MAX;
+        num_blocks++;
+        pthread_rwlock_unlock(&n->lock);
+    }
+    pthread_mutex_unlock(&fs->dcache_lock);
+    // The files deleted so far are in the directory blocks just copied
+    pthread_mutex_lock(&fs->fat_lock);
+    struct pending_free *frees = fs->pending_frees;
+    fs->pending_frees = NULL;
+    pthread_mutex_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
+    size_t num_fat = 0;
+    pthread_mutex_lock(&fs->fat_lock);
+    if (meta_reserve(fs, num_blocks + fs->block_fat) != 0) {
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < fs->block_fat; i++) {
+        if (fs->fat_dirty[i]) {
+            fat_store(fs, i, &fs->meta_copy[num_blocks * fs->block_size]);
+            fs->meta_home[num_blocks] = i + 1;
+            fs->meta_source[num_blocks].node = NO_SLOT;
+            fs->meta_source[num_blocks].dir_block = UINT32_MAX;
+            num_blocks++;
+            num_fat++;
+            fs->fat_dirty[i] = 0;
+        }
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    if (ret == 0 && num_blocks > 0) {
+        ret = meta_commit(fs, num_blocks, num_fat);
+    }
+    // Flag the blocks again so that the next flush retries them, and keep the
+    // deleted files waiting until their directories are written
+    pthread_rwlock_rdlock(&fs->root_lock);
+    pthread_mutex_lock(&fs->fat_lock);
+    struct pending_free **tail = &frees;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    if (ret != 0) {
+        *tail = fs->pending_frees;
+        fs->pending_frees = frees;
+        for (size_t i = 0; i < num_blocks; i++) {
+            struct meta_source *src = &fs->meta_source[i];
+            if (fs->meta_home[i] <= fs->block_fat) {
+                fs->fat_dirty[fs->meta_home[i] - 1] = 1;
+            } else if (fs->meta_home[i] == fs->block_fat + 1) {
+                __atomic_store_n(&fs->root_dirty, 1, __ATOMIC_RELAXED);
+            } else if (src->dir_block != UINT32_MAX) {
+                // Unless the directory was deleted in the meantime
+                struct dir *dir = node_get(fs, src->node)->dir;
+                if (dir && dir->node == src->node &&
+                    src->dir_block < dir->num_blocks) {
+                    dir->dirty[src->dir_block] = 1;
+                }
+            } else {
+                __atomic_store_n(&node_get(fs, src->node)->extents.dirty, 1,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+    } else {
+        *tail = fs->committed_frees;
+        fs->committed_frees = frees;
+    }
+    pthread_mutex_unlock(&fs->fat_lock);
+    pthread_rwlock_unlock(&fs->root_lock);
+    pthread_mutex_unlock(&fs->sync_lock);
+    return ret;
+}
+
+
+// Body of the background flusher: sync every sync_interval milliseconds until
+// told to stop
+void* flusher_main(void *arg) {
+    struct fs *fs = arg;
+    pthread_mutex_lock(&fs->flusher_lock);
+    while (!fs->flusher_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += fs->sync_interval / 1000;
+        until.tv_nsec += (long)(fs->sync_interval % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&fs->flusher_wake, &fs->flusher_lock, &until);
+        if (fs->flusher_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&fs->flusher_lock);
+        fs_sync_h(fs);
+        pthread_mutex_lock(&fs->flusher_lock);
+    }
+    pthread_mutex_unlock(&fs->flusher_lock);
+    return NULL;
+}
+
+
+// Allocate the bounce buffers used by partial-block transfers for the
+// lifetime of the mount
+int bounce_pool_init(struct fs *fs) {
+    fs->bounce_pool.data = malloc(BOUNCE_POOL_SIZE * fs->block_size);
+    if (!fs->bounce_pool.data) {
+        return -1;
+    }
+    for (int i = 0; i < BOUNCE_POOL_SIZE; i++) {
+        fs->bounce_pool.free[i] = &fs->bounce_pool.data[i * fs->block_size];
+    }
+    fs->bounce_pool.num_free = BOUNCE_POOL_SIZE;
+    return 0;
+}
+
+
+// Release the bounce buffers
+void bounce_pool_destroy(struct fs *fs) {
+    free(fs->bounce_pool.data);
+    fs->bounce_pool.data = NULL;
+    fs->bounce_pool.num_free = 0;
+}
+
+
+// Take a bounce buffer from the pool
+uint8_t* bounce_get(struct fs *fs) {
+    pthread_mutex_lock(&fs->bounce_pool.lock);
+    while (fs->bounce_pool.num_free == 0) {
+        pthread_cond_wait(&fs->bounce_pool.available, &fs->bounce_pool.lock);
+    }
+    uint8_t *bounce_buf = fs->bounce_pool.free[--fs->bounce_pool.num_free];
+    pthread_mutex_unlock(&fs->bounce_pool.lock);
+    return bounce_buf;
+}
+
+
+// Give a bounce buffer back to the pool
+void bounce_put(struct fs *fs, uint8_t* bounce_buf) {
+    pthread_mutex_lock(&fs->bounce_pool.lock);
+    fs->bounce_pool.free[fs->bounce_pool.num_free++] = bounce_buf;
+    pthread_cond_signal(&fs->bounce_pool.available);
+    pthread_mutex_unlock(&fs->bounce_pool.lock);
+}
+
+
+// Account for a read of the fd from start to end offsets. While reads follow
+// each other, the window doubles (up to readahead_max) and the blocks of the
+// chain ahead of the reader are prefetched, half a window at a time. Any other
+// read closes the window.
+void readahead(struct fs *fs, int fd, int file_index, size_t start,
+               size_t end) {
+    struct fd *f = fd_slot(fs, fd);
+    if (end == start) {
+        return;
+    }
+    // Prefetched blocks that this read consumed, each counted once
+    size_t last = (end - 1) / fs->block_size;
+    size_t from = start / fs->block_size;
+    if (from < f->ra_start) {
+        from = f->ra_start;
+    }
+    if (from <= last && from < f->ra_end) {
+        size_t upto = (last + 1 < f->ra_end) ? last + 1 : f->ra_end;
+        __atomic_fetch_add(&fs->ra_hits, upto - from, __ATOMIC_RELAXED);
+        f->ra_start = upto;
+    }
+    if (start != f->ra_expect) {
+        readahead_reset(fs, fd);
+        f->ra_expect = end;
+        return;
+    }
+    f->ra_expect = end;
+    if (f->ra_window == 0) {
+        f->ra_window = READAHEAD_MIN_BLOCKS;
+    } else {
+        f->ra_window *= 2;
+    }
+    if (f->ra_window > fs->readahead_max) {
+        f->ra_window = fs->readahead_max;
+    }
+    size_t next = (end + fs->block_size - 1) / fs->block_size;
+    if (f->ra_window == 0 || f->ra_end >= next + f->ra_window / 2 ||
+        f->cur_block == FAT_EOC) {
+        return;
+    }
+    size_t file_blocks = (node_entry(fs, file_index)->file_size
+                          + fs->block_size - 1) / fs->block_size;
+    size_t to = next + f->ra_window;
+    if (to > file_blocks) {
+        to = file_blocks;
+    }
+    from = (f->ra_end > next) ? f->ra_end : next;
+    if (from >= to) {
+        return;
+    }
+    if (f->ra_start >= f->ra_end) {
+        f->ra_start = from;
+    }
+    f->ra_end = prefetch_range(fs, fd, file_index, from, to);
+}
+
+
+// Hint the disk about the blocks of the file from block from to block to, one
+// contiguous run at a time, and return the block where the hints stopped. The
+// chain is walked ahead of the fd's cursor without moving it.
+size_t prefetch_range(struct fs *fs, int fd, int file_index, size_t from,
+                      size_t to) {
+    size_t block_num = from;
+    if (fs->extent_layout) {
+        struct file_extents *fe = &node_get(fs, file_index)->extents;
+        for (size_t i = extent_find(fe, from); i < fe->count && block_num < to;
+             i++) {
+            size_t skip = block_num - fe->list[i].file_block;
+            size_t run = fe->list[i].len - skip;
+            if (run > to - block_num) {
+                run = to - block_num;
+            }
+            block_prefetch_h(fs->disk,
+                             fs->dblock_index + fe->list[i].start + skip, run);
+            __atomic_fetch_add(&fs->ra_prefetched, run, __ATOMIC_RELAXED);
+            block_num += run;
+        }
+        return block_num;
+    }
+    uint32_t fat_index = fd_slot(fs, fd)->cur_block;
+    block_num = fd_slot(fs, fd)->cur_block_num;
+    size_t steps = 0;
+    while (block_num < from && fat_index != FAT_EOC) {
+        fat_index = fs->fat_block.fat_data[fat_index];
+        block_num++;
+        steps++;
+    }
+    while (block_num < to && fat_index != FAT_EOC) {
+        size_t run = contiguous_run(fs, fat_index, to - block_num);
+        block_prefetch_h(fs->disk, fs->dblock_index + fat_index, run);
+        __atomic_fetch_add(&fs->ra_prefetched, run, __ATOMIC_RELAXED);
+        fat_index = fs->fat_block.fat_data[fat_index + run - 1];
+        block_num += run;
+        steps++;
+    }
+    if (steps > 0) {
+        stats_add(fs->stats, STATS_FAT_STEPS, steps);
+    }
+    return block_num;
+}
+
+
+// Close the read-ahead window of the fd
+void readahead_reset(struct fs *fs, int fd) {
+    fd_slot(fs, fd)->ra_window = 0;
+    fd_slot(fs, fd)->ra_start = 0;
+    fd_slot(fs, fd)->ra_end = 0;
+}
+
+
+// Set up an asynchronous request on the fd, with room for the given number of
+// partial blocks
+struct aio_req* aio_req_alloc(struct fs *fs, int fd, fs_aio_cb cb, void *arg,
+                              size_t num_copies) {
+    struct aio_req *req = malloc(sizeof(struct aio_req)
+                                 + num_copies * fs->block_size);
+    if (!req) {
+        return NULL;
+    }
+    req->fs = fs;
+    req->fd = fd;
+    req->cb = cb;
+    req->arg = arg;
+    req->ret = 0;
+    req->num_copies = 0;
+    return req;
+}
+
+
+// Count an asynchronous request as in flight until aio_req_finish
+void aio_req_start(struct aio_req *req) {
+    pthread_mutex_lock(&req->fs->aio_lock);
+    req->fs->aio_inflight++;
+    fd_slot(req->fs, req->fd)->aio_inflight++;
+    pthread_mutex_unlock(&req->fs->aio_lock);
+}
+
+
+// Report the outcome of an asynchronous request and release it. A failed
+// transfer (ret of -1) fails the whole request.
+void aio_req_finish(struct aio_req *req, int ret) {
+    struct fs *fs = req->fs;
+    int fd = req->fd;
+    req->cb(req->arg, ret == -1 ? -1 : req->ret);
+    free(req);
+    pthread_mutex_lock(&fs->aio_lock);
+    fs->aio_inflight--;
+    fd_slot(fs, fd)->aio_inflight--;
+    pthread_cond_broadcast(&fs->aio_done);
+    pthread_mutex_unlock(&fs->aio_lock);
+}
+
+
+// Completion of the batch of an asynchronous read
+void aio_read_done(void *arg, int ret) {
+    struct aio_req *req = arg;
+    for (int i = 0; ret == 0 && i < req->num_copies; i++) {
+        memcpy(req->copies[i].dst,
+               &req->bounce[i * req->fs->block_size
+                            + req->copies[i].block_off],
+               req->copies[i].len);
+        stats_add(req->fs->stats, STATS_BYTES_COPIED, req->copies[i].len);
+    }
+    aio_req_finish(req, ret);
+}
+
+
+// Completion of the batch of an asynchronous write
+void aio_write_done(void *arg, int ret) {
+    aio_req_finish(arg, ret);
+}
+
+
+// Allocate an empty file system instance and set up its locks
+struct fs* fs_alloc(void) {
+    struct fs *fs = calloc(1, sizeof(struct fs));
+    if (!fs) {
+        return NULL;
+    }
+    pthread_mutex_init(&fs->sync_lock, NULL);
+    pthread_mutex_init(&fs->fd_lock, NULL);
+    pthread_rwlock_init(&fs->root_lock, NULL);
+    pthread_mutex_init(&fs->dcache_lock, NULL);
+    // The first chunk of nodes starts with the root directory's
+    fs->nodes[0] = calloc(NODE_CHUNK, sizeof(struct node));
+    fs->stats = stats_create(FS_OP_COUNT, latency_histograms);
+    if (!fs->nodes[0] || !fs->stats) {
+        free(fs->nodes[0]);
+        stats_destroy(fs->stats);
+        free(fs);
+        return NULL;
+    }
+    for (int i = 0; i < NODE_CHUNK; i++) {
+        pthread_rwlock_init(&fs->nodes[0][i].lock, NULL);
+        pthread_mutex_init(&fs->nodes[0][i].wbuf_lock, NULL);
+        fs->nodes[0][i].parent = NO_SLOT;
+        fs->nodes[0][i].wbuf_fd = NO_SLOT;
+    }
+    fs->num_nodes = FS_FILE_MAX_COUNT;
+    fs->free_node = NO_SLOT;
+    fs->free_fd = NO_SLOT;
+    pthread_mutex_init(&fs->fat_lock, NULL);
+    pthread_mutex_init(&fs->bounce_pool.lock, NULL);
+    pthread_cond_init(&fs->bounce_pool.available, NULL);
+    pthread_mutex_init(&fs->aio_lock, NULL);
+    pthread_cond_init(&fs->aio_done, NULL);
+    pthread_mutex_init(&fs->flusher_lock, NULL);
+    pthread_cond_init(&fs->flusher_wake, NULL);
+    __atomic_fetch_add(&mounted_count, 1, __ATOMIC_RELAXED);
+    return fs;
+}
+
+
+// Release a file system instance and whatever was set up for it, without
+// writing anything back
+void fs_free(struct fs *fs) {
+    for (int i = 0; i < fs->num_fds; i++) {
+        free(fd_slot(fs, i)->wbuf);
+    }
+    for (int c = 0; c < FD_CHUNKS_MAX && fs->fds[c]; c++) {
+        free(fs->fds[c]);
+    }
+    cache_destroy(fs->cache);
+    alloc_destroy(fs->free_map);
+    bounce_pool_destroy(fs);
+    for (int i = 0; i < fs->num_nodes; i++) {
+        free(node_get(fs, i)->extents.list);
+    }
+    while (fs->dirs) {
+        struct dir *dir = fs->dirs;
+        fs->dirs = dir->next;
+        dir_free(dir);
+    }
+    struct pending_free *lists[] = { fs->pending_frees, fs->committed_frees };
+    for (int i = 0; i < 2; i++) {
+        while (lists[i]) {
+            struct pending_free *pf = lists[i];
+            lists[i] = pf->next;
+            free(pf->extents.list);
+            free(pf);
+        }
+    }
+    free(fs->fat_block.fat_data);
+    free(fs->fat_dirty);
+    free(fs->meta_copy);
+    free(fs->meta_home);
+    free(fs->meta_source);
+    journal_destroy(fs->journal);
+    if (fs->disk) {
+        block_disk_close_h(fs->disk);
+    }
+    pthread_mutex_destroy(&fs->sync_lock);
+    pthread_mutex_destroy(&fs->fd_lock);
+    pthread_rwlock_destroy(&fs->root_lock);
+    pthread_mutex_destroy(&fs->dcache_lock);
+    for (int c = 0; c < NODE_CHUNKS_MAX && fs->nodes[c]; c++) {
+        for (int i = 0; i < NODE_CHUNK; i++) {
+            pthread_rwlock_destroy(&fs->nodes[c][i].lock);
+            pthread_mutex_destroy(&fs->nodes[c][i].wbuf_lock);
+        }
+        free(fs->nodes[c]);
+    }
+    pthread_mutex_destroy(&fs->fat_lock);
+    pthread_mutex_destroy(&fs->bounce_pool.lock);
+    pthread_cond_destroy(&fs->bounce_pool.available);
+    pthread_mutex_destroy(&fs->aio_lock);
+    pthread_cond_destroy(&fs->aio_done);
+    pthread_mutex_destroy(&fs->flusher_lock);
+    pthread_cond_destroy(&fs->flusher_wake);
+    stats_destroy(fs->stats);
+    free(fs);
+    __atomic_fetch_sub(&mounted_count, 1, __ATOMIC_RELAXED);
+}
+
+
+// Whether a file system is mounted, with fs_mount() or fs_mount_h(), so that
+// the settings cannot change
+int any_mounted(void) {
+    return __atomic_load_n(&mounted_count, __ATOMIC_RELAXED) > 0;
+}
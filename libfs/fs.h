@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -9,16 +10,56 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/*
+ * Paths: the files taking a filename below also accept a path, made of names
+ * separated by '/' (a leading '/' is ignored), which names a file inside the
+ * directories created with fs_mkdir(). Each name is limited to
+ * %FS_FILENAME_LEN characters (including the NULL character), but only the
+ * root directory is limited to %FS_FILE_MAX_COUNT entries: other directories
+ * are stored as files, and grow a block of entries at a time. The entries of
+ * a directory are indexed by name in memory the first time a path goes
+ * through it, so that later lookups do not read the disk. Files created in
+ * the root directory before directories existed, with a '/' in their name,
+ * are still found under that name.
+ */
+
+/** Maximum number of open files, unless changed with fs_set_open_max() */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Largest limit on open files that fs_set_open_max() accepts */
+#define FS_OPEN_LIMIT (1 << 20)
+
+/*
+ * Thread safety: while a file system is mounted, the functions below can be
+ * called from several threads at once. Reads of different files (or of the
+ * same file) run in parallel, writes to a file are serialized, and directory
+ * changes lock out other directory operations only. fs_mount(), fs_umount()
+ * and the fs_set_*() configuration functions must not run concurrently with
+ * any other call, and a given file descriptor must only be used by one thread
+ * at a time.
+ */
+
+/** Handle on a mounted file system, see fs_mount_h() */
+typedef struct fs *fs_t;
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). If the disk was formatted
+ * with a journal (see fs_format.x) and not unmounted cleanly, the last
+ * metadata changes that were committed to the journal are applied first.
+ *
+ * Besides the original layout (4096-byte blocks and 16-bit FAT entries), the
+ * superblock can describe an extended one, with blocks of up to 64 KiB and
+ * 32-bit FAT entries, so that volumes are no longer limited to 65535 blocks.
+ * An extended file system can also keep each file as a list of extents, held
+ * in a block of its own, instead of a FAT chain: seeking into a file then
+ * takes a binary search instead of a walk down the chain, but a file can only
+ * grow to as many extents as fit in one block. The layout only matters to the
+ * file system: files are read and written the same way on all of them.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
@@ -39,12 +80,26 @@ int fs_umount(void);
 /**
  * fs_info - Display information about file system
  *
- * Display some information about the currently mounted file system.
+ * Display some information about the currently mounted file system. On a
+ * legacy disk, the output is the same as the reference implementation's. On
+ * an extended disk, it also shows the fragmentation, the journal and the
+ * layout of the disk, as fs_info_verbose() does.
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_info(void);
 
+/**
+ * fs_info_verbose - Display detailed information about file system
+ *
+ * Same as fs_info(), and also display the average length of the extents of
+ * the files, the size of the journal, the block size, the width of the FAT
+ * entries and the file layout, whatever the format of the disk.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_info_verbose(void);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -56,7 +111,8 @@ int fs_info(void);
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the root directory already contains %FS_FILE_MAX_COUNT files, or if the
+ * directory of path @filename does not exist or cannot grow. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -65,18 +121,33 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. @filename can also name an empty directory.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, or if file @filename is currently open, or if it is a directory that
+ * is not empty. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a directory
+ * @dirname: Directory name
+ *
+ * Create a new and empty directory named @dirname, in which files and other
+ * directories can then be created by giving their path, see above.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if
+ * an entry named @dirname already exists, or if there is no room for it. 0
+ * otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files located in the root directory. Directories
+ * are listed as "dir" instead of "file".
  *
  * Return: -1 if no FS is currently mounted. 0 otherwise.
  */
@@ -92,11 +163,12 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously, see fs_set_open_max().
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * there is no file named @filename to open, or if it is a directory, or if
+ * there are already %FS_OPEN_MAX_COUNT files (or the limit set with
+ * fs_set_open_max()) currently open. Otherwise, return the file
  * descriptor.
  */
 int fs_open(const char *filename);
@@ -105,10 +177,13 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after writing out the appends buffered on it (see
+ * fs_write()).
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if the buffered appends
+ * did not fit on disk (the file descriptor is closed all the same). 0
+ * otherwise.
  */
 int fs_close(int fd);
 
@@ -116,7 +191,8 @@ int fs_close(int fd);
  * fs_stat - Get file status
  * @fd: File descriptor
  *
- * Get the current size of the file pointed by file descriptor @fd.
+ * Get the current size of the file pointed by file descriptor @fd, including
+ * the appends buffered on @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
  * invalid (out of bounds or not currently open). Otherwise return the current
@@ -131,11 +207,13 @@ int fs_stat(int fd);
  *
  * Set the file offset (used for read and write operations) associated with file
  * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * fs_lseek(fd, fs_stat(fd)); The appends buffered on @fd are written out
+ * first.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the current file size, or if the buffered appends did not fit on disk.
+ * 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -155,12 +233,66 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * Small writes at the end of the file are only copied into a buffer of @fd
+ * (see fs_set_write_buffer()), and their blocks are allocated when the buffer
+ * is written out: once it is full, by fs_fsync(), fs_lseek(), fs_read() and
+ * fs_close() on @fd, and by fs_stat(), fs_lseek(), fs_read() and fs_write() on
+ * any other file descriptor of the same file, so that every file descriptor
+ * sees the same file. Running out of space is reported by the call that
+ * writes them out.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_fsync - Write out the data of a file descriptor
+ * @fd: File descriptor
+ *
+ * Write out the appends buffered on @fd, then write back the file system with
+ * fs_sync().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the buffered appends
+ * did not fit on disk, or if the data cannot be written. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_sync - Write back the file system
+ *
+ * Write back the dirty blocks of the block cache, then the blocks of the FAT
+ * and the root directory that changed since the last sync, and flush the
+ * virtual disk file. Until then, files created or grown since the file system
+ * was mounted are not on disk. Appends buffered on file descriptors are left
+ * alone, see fs_fsync().
+ *
+ * On a disk with a journal, the metadata blocks are first written to the
+ * journal as a single transaction, so that a crash leaves the disk with either
+ * all of them or none of them. All the changes made since the last sync are
+ * committed together, at the cost of one sequential journal write.
+ *
+ * Return: -1 if no FS is currently mounted, or if the data cannot be written.
+ * 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_set_sync_interval - Configure background syncs
+ * @ms: Time between two syncs, in milliseconds
+ *
+ * Have each file system mounted from now on call fs_sync() every @ms
+ * milliseconds from a background thread, until it is unmounted. An interval
+ * of 0 disables background syncs. By default, file systems with a journal sync
+ * every 5 seconds, and the others never do.
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(). 0 otherwise.
+ */
+int fs_set_sync_interval(unsigned ms);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -182,4 +314,407 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_read_zc - Read from a file without copying
+ * @fd: File descriptor
+ * @ptr: Set to the address of the data
+ * @count: Maximum number of bytes of data to be read
+ *
+ * Zero-copy variant of fs_read() for file systems mounted with the
+ * memory-mapped backend (see fs_set_mmap()). Instead of copying the data, set
+ * @ptr to the address of the file's content at the current file offset, inside
+ * the mapping of the virtual disk. At most @count bytes are handed out at once,
+ * and never more than what is stored contiguously on disk, so a whole file is
+ * read by calling fs_read_zc() until it returns 0. The file offset is
+ * incremented by the number of bytes handed out.
+ *
+ * The data must not be modified, and is only valid until the file is written
+ * or the file system is unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @ptr is NULL, or if the
+ * file system is not memory-mapped. Otherwise return the number of bytes
+ * available at @ptr.
+ */
+int fs_read_zc(int fd, const void **ptr, size_t count);
+
+/**
+ * fs_import - Write data from a host file into a file
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to read the data from
+ * @count: Number of bytes to copy
+ *
+ * Same as reading @count bytes from @host_fd (at its file offset) and writing
+ * them with fs_write(), without a buffer of that size: the data goes from
+ * @host_fd to the virtual disk one contiguous run of blocks at a time, copied
+ * by the kernel (copy_file_range()) when it can. The file offset of @fd and
+ * the one of @host_fd are both advanced by the number of bytes copied.
+ *
+ * The blocks are allocated for @count bytes a chunk at a time, so if @host_fd
+ * ends early the file can keep a few blocks past its end.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative.
+ * Otherwise return the number of bytes actually copied.
+ */
+int fs_import(int fd, int host_fd, size_t count);
+
+/**
+ * fs_export - Read data from a file into a host file
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to write the data to
+ * @count: Number of bytes to copy
+ *
+ * Same as reading @count bytes with fs_read() and writing them to @host_fd
+ * (at its file offset), without a buffer of that size: the data goes from the
+ * virtual disk to @host_fd one contiguous run of blocks at a time, copied by
+ * the kernel (sendfile(), which also accepts pipes and sockets) when it can.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative.
+ * Otherwise return the number of bytes actually copied.
+ */
+int fs_export(int fd, int host_fd, size_t count);
+
+/**
+ * typedef fs_aio_cb - Completion callback of asynchronous requests
+ * @arg: Argument given when the request was submitted
+ * @ret: Number of bytes transferred, or -1 if the request failed
+ */
+typedef void (*fs_aio_cb)(void *arg, int ret);
+
+/**
+ * fs_read_async - Read from a file in the background
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @cb: Called when the data is in @buf
+ * @arg: Argument passed to @cb
+ *
+ * Asynchronous variant of fs_read(). The blocks holding the data are located
+ * right away and submitted to the disk as a single batch, and the file offset
+ * is incremented by the number of bytes that will be read before returning.
+ * The function then returns without waiting: @cb is called once the data is in
+ * @buf, which must stay valid until then. Many requests, on the same file or
+ * on different ones, can be in flight at once.
+ *
+ * @cb usually runs on an internal I/O thread, but it is called before
+ * fs_read_async() returns when there is nothing to read or the request failed
+ * early. It must not block, and must not call libfs functions.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf or @cb is NULL, or
+ * if the request cannot be allocated. 0 otherwise, in which case @cb is called
+ * exactly once.
+ */
+int fs_read_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg);
+
+/**
+ * fs_write_async - Write to a file in the background
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @cb: Called when the data is written
+ * @arg: Argument passed to @cb
+ *
+ * Asynchronous variant of fs_write(), see fs_read_async(). Blocks are
+ * allocated and the file size and offset are updated right away. The bytes
+ * filling whole blocks are submitted to the disk as a single batch, while the
+ * ones that only cover part of a block are written before returning (usually
+ * into the block cache). Until @cb is called, @buf must stay valid, and the
+ * content of the range being written is undefined.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf or @cb is NULL, or
+ * if the request cannot be allocated. 0 otherwise, in which case @cb is called
+ * exactly once.
+ */
+int fs_write_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg);
+
+/**
+ * fs_aio_wait - Wait for asynchronous requests
+ *
+ * Wait until every request submitted with fs_read_async() or fs_write_async()
+ * has completed. fs_close() waits for the requests on its file descriptor, and
+ * fs_umount() for all of them.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_aio_wait(void);
+
+/**
+ * fs_set_mmap - Select the memory-mapped disk backend
+ * @enable: Whether to map the virtual disk file in memory
+ *
+ * Select how the file systems mounted from now on access their virtual disk
+ * file. When @enable
+ * is non-zero, the whole disk file is mapped in memory: blocks are copied
+ * directly from or into the mapping, the block cache is not used, and the
+ * mapping is synced back to the file by fs_umount(). Otherwise, blocks are
+ * accessed with system calls (default).
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(). 0 otherwise.
+ */
+int fs_set_mmap(int enable);
+
+/**
+ * fs_set_open_max - Configure the number of open files
+ * @max: Number of files that can be open at once
+ *
+ * Set how many file descriptors each file system mounted from now on can have
+ * open at once (%FS_OPEN_MAX_COUNT by default). File descriptors are taken
+ * from a table that grows as needed, so opening, closing and getting the
+ * status of a file take the same time however many files are open.
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(), or if @max is 0 or larger than %FS_OPEN_LIMIT. 0 otherwise.
+ */
+int fs_set_open_max(size_t max);
+
+/** Block cache counters reported by fs_cache_stats() */
+struct fs_cache_stats {
+	size_t hits;		/* Block lookups served from memory */
+	size_t misses;		/* Block lookups that went to the disk */
+	size_t evictions;	/* Blocks pushed out of the cache */
+	size_t writebacks;	/* Dirty blocks written back to the disk */
+};
+
+/**
+ * fs_set_cache_size - Configure the block cache
+ * @nblocks: Number of blocks to cache
+ *
+ * Set the size of the write-back block cache that each file system mounted
+ * from now on sets up between itself and its virtual disk. Dirty blocks are written back
+ * when evicted and when the file system is unmounted. A size of 0 disables the
+ * cache.
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(). 0 otherwise.
+ */
+int fs_set_cache_size(size_t nblocks);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Counters to be filled in
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_set_write_buffer - Configure the append buffers
+ * @nblocks: Size of the buffer of each file descriptor, in blocks
+ *
+ * Set the size of the buffer that absorbs small appends on each file
+ * descriptor of the file systems mounted from now on (16 blocks by default),
+ * see fs_write(). A full buffer writes out its whole blocks and keeps the
+ * rest. A size of 0 disables the buffers, so that every fs_write() goes to
+ * the disk (or the block cache) right away.
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(). 0 otherwise.
+ */
+int fs_set_write_buffer(size_t nblocks);
+
+/** Read-ahead counters reported by fs_readahead_stats() */
+struct fs_readahead_stats {
+	size_t prefetched;	/* Blocks announced to the disk ahead of reads */
+	size_t hits;		/* Prefetched blocks that were then read */
+};
+
+/**
+ * fs_set_readahead - Configure read-ahead
+ * @max_blocks: Largest read-ahead window, in blocks
+ *
+ * fs_read() detects when a file descriptor is read sequentially, and then
+ * prefetches the blocks of the file that follow, so that they are already in
+ * memory when they are read. The window starts at a few blocks and doubles
+ * with each sequential read, up to @max_blocks, and closes when the file
+ * offset is moved elsewhere with fs_lseek(). Set the largest window of the
+ * file systems mounted from now on (64 blocks by default). A size of 0
+ * disables read-ahead.
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(). 0 otherwise.
+ */
+int fs_set_readahead(size_t max_blocks);
+
+/**
+ * fs_readahead_window - Get the read-ahead window of a file descriptor
+ * @fd: File descriptor
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the number
+ * of blocks currently read ahead of the file offset, 0 when the reads are not
+ * sequential.
+ */
+int fs_readahead_window(int fd);
+
+/**
+ * fs_readahead_stats - Get read-ahead counters
+ * @stats: Counters to be filled in
+ *
+ * The prefetch hit rate is @stats->hits / @stats->prefetched.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_readahead_stats(struct fs_readahead_stats *stats);
+
+/** Virtual disk I/O counters reported by fs_io_stats() */
+struct fs_io_stats {
+	size_t read_calls;	/* Read requests issued to the virtual disk */
+	size_t write_calls;	/* Write requests issued to the virtual disk */
+	size_t blocks_read;	/* Blocks read from the virtual disk */
+	size_t blocks_written;	/* Blocks written to the virtual disk */
+};
+
+/**
+ * fs_io_stats - Get virtual disk I/O counters
+ * @stats: Counters to be filled in
+ *
+ * The counters keep growing across mounts, so the I/O cost of an operation is
+ * the difference between the counters taken before and after it.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_io_stats(struct fs_io_stats *stats);
+
+/** Counters of one mounted file system reported by fs_stats() */
+struct fs_stats {
+	size_t read_calls;	/* Read requests issued to its virtual disk */
+	size_t write_calls;	/* Write requests issued to its virtual disk */
+	size_t blocks_read;	/* Blocks read from its virtual disk */
+	size_t blocks_written;	/* Blocks written to its virtual disk */
+	size_t bytes_copied;	/* Bytes copied between user buffers and blocks */
+	size_t fat_steps;	/* FAT entries followed while walking chains */
+	size_t alloc_calls;	/* Block allocation requests */
+	size_t alloc_scanned;	/* Free-map words (64 blocks) scanned by them */
+	size_t find_file_calls;	/* Lookups of a name in a directory */
+};
+
+/**
+ * fs_stats - Get the counters of the mounted file system
+ * @stats: Counters to be filled in
+ *
+ * Unlike fs_io_stats(), the counters only cover the current mount. They are
+ * kept per thread, so that counting costs little even when many threads use
+ * the file system at once.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/** Operations timed by the latency histograms */
+enum fs_op {
+	FS_OP_READ,		/* fs_read() */
+	FS_OP_WRITE,		/* fs_write() */
+	FS_OP_OPEN,		/* fs_open() */
+	FS_OP_MOUNT,		/* fs_mount() */
+	FS_OP_COUNT
+};
+
+/** Latency summary reported by fs_latency(), in nanoseconds */
+struct fs_latency {
+	size_t count;		/* Operations timed */
+	uint64_t p50;		/* Median */
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;		/* Slowest operation */
+};
+
+/**
+ * fs_set_latency_histograms - Configure the latency histograms
+ * @enable: Whether to time operations
+ *
+ * When @enable is non-zero, the file systems mounted from now on time each of
+ * the operations of &enum fs_op into a histogram with 8 buckets per power of
+ * two, which keeps the percentiles within 12.5% of the exact ones. Timing an
+ * operation costs two clock reads, so it is off by default.
+ *
+ * Return: -1 if a file system is currently mounted, with fs_mount() or
+ * fs_mount_h(). 0 otherwise.
+ */
+int fs_set_latency_histograms(int enable);
+
+/**
+ * fs_latency - Get the latency summary of an operation
+ * @op: Operation
+ * @latency: Summary to be filled in
+ *
+ * Every field is 0 if the file system was mounted without histograms.
+ *
+ * Return: -1 if no FS is currently mounted, if @op is not an operation of
+ * &enum fs_op, or if @latency is NULL. 0 otherwise.
+ */
+int fs_latency(enum fs_op op, struct fs_latency *latency);
+
+/**
+ * fs_mount_h - Mount a file system and get a handle on it
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as fs_mount(), but instead of becoming the file system used by the
+ * functions above, the file system is accessed through the returned handle
+ * with the *_h() variants below. Each handle has its own disk, block cache,
+ * file descriptors and locks, so any number of file systems can be mounted at
+ * once, and used from different threads. The functions without a handle act
+ * on the file system mounted with fs_mount(), which is independent from the
+ * ones mounted with fs_mount_h().
+ *
+ * The settings of the fs_set_*() functions are process-wide: every file
+ * system, whether mounted with fs_mount() or fs_mount_h(), uses those in
+ * effect when it is mounted, and they cannot be changed while any file system
+ * is mounted.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise, a handle on the file system.
+ */
+fs_t fs_mount_h(const char *diskname);
+
+/**
+ * fs_umount_h - Unmount a file system mounted with fs_mount_h()
+ * @fs: File system handle
+ *
+ * Same as fs_umount(). The handle is released, even if -1 is returned because
+ * the file system could not be written back entirely.
+ *
+ * Return: -1 if @fs is NULL, or if the file system cannot be written back to
+ * the virtual disk or the virtual disk cannot be closed. 0 otherwise.
+ */
+int fs_umount_h(fs_t fs);
+
+/*
+ * Handle-based variants of the functions above, acting on file system @fs
+ * instead of the one mounted with fs_mount(). They also return -1 when @fs is
+ * NULL. File descriptors are local to their file system.
+ */
+int fs_info_h(fs_t fs);
+int fs_info_verbose_h(fs_t fs);
+int fs_create_h(fs_t fs, const char *filename);
+int fs_delete_h(fs_t fs, const char *filename);
+int fs_mkdir_h(fs_t fs, const char *dirname);
+int fs_ls_h(fs_t fs);
+int fs_open_h(fs_t fs, const char *filename);
+int fs_close_h(fs_t fs, int fd);
+int fs_stat_h(fs_t fs, int fd);
+int fs_lseek_h(fs_t fs, int fd, size_t offset);
+int fs_write_h(fs_t fs, int fd, void *buf, size_t count);
+int fs_fsync_h(fs_t fs, int fd);
+int fs_sync_h(fs_t fs);
+int fs_read_h(fs_t fs, int fd, void *buf, size_t count);
+int fs_read_zc_h(fs_t fs, int fd, const void **ptr, size_t count);
+int fs_import_h(fs_t fs, int fd, int host_fd, size_t count);
+int fs_export_h(fs_t fs, int fd, int host_fd, size_t count);
+int fs_read_async_h(fs_t fs, int fd, void *buf, size_t count, fs_aio_cb cb,
+                    void *arg);
+int fs_write_async_h(fs_t fs, int fd, void *buf, size_t count, fs_aio_cb cb,
+                     void *arg);
+int fs_aio_wait_h(fs_t fs);
+int fs_cache_stats_h(fs_t fs, struct fs_cache_stats *stats);
+int fs_readahead_window_h(fs_t fs, int fd);
+int fs_readahead_stats_h(fs_t fs, struct fs_readahead_stats *stats);
+int fs_stats_h(fs_t fs, struct fs_stats *stats);
+int fs_latency_h(fs_t fs, enum fs_op op, struct fs_latency *latency);
+
 #endif /* _FS_H */
@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "journal.h"
+
+#define JOURNAL_SIGNATURE "ECS150JL"
+
+/* First block of the journal region, describing the logged blocks after it */
+struct __attribute__ ((packed)) journal_header {
+    uint8_t signature[8];       // Always "ECS150JL"
+    uint32_t num_blocks;        // Number of logged blocks, 0 if empty
+    uint32_t checksum;          // CRC-32 of the header and logged blocks
+    uint32_t home[];            // Disk block of each logged block, filling
+                                // the rest of the block
+};
+
+/* Journal instance */
+struct journal {
+    disk_t disk;                    // Disk the journal lives on
+    size_t block_size;              // Size of a block of the disk
+    size_t start;                   // First block of the journal region
+    size_t nblocks;                 // Blocks in the journal region
+    int in_use;                     // The journal holds a transaction
+    struct journal_header *header;  // Header of the latest transaction
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320u : 0);
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Checksum of a transaction, computed with the checksum field set to 0
+static uint32_t checksum(struct journal *journal, const uint8_t *blocks) {
+    struct journal_header *header = journal->header;
+    uint32_t saved = header->checksum;
+    header->checksum = 0;
+    uint32_t crc = crc_update(0xFFFFFFFFu, (const uint8_t *)header,
+                              journal->block_size);
+    header->checksum = saved;
+    crc = crc_update(crc, blocks, header->num_blocks * journal->block_size);
+    return ~crc;
+}
+
+struct journal *journal_create(disk_t disk, size_t start, size_t nblocks) {
+    if (nblocks < 2) {
+        return NULL;
+    }
+    struct journal *journal = calloc(1, sizeof(*journal));
+    if (!journal) {
+        return NULL;
+    }
+    pthread_once(&crc_once, crc_init);
+    journal->block_size = block_disk_block_size_h(disk);
+    journal->header = calloc(1, journal->block_size);
+    if (!journal->header) {
+        free(journal);
+        return NULL;
+    }
+    journal->disk = disk;
+    journal->start = start;
+    journal->nblocks = nblocks;
+    return journal;
+}
+
+void journal_destroy(struct journal *journal) {
+    if (journal) {
+        free(journal->header);
+    }
+    free(journal);
+}
+
+size_t journal_capacity(struct journal *journal) {
+    if (!journal) {
+        return 0;
+    }
+    size_t capacity = journal->nblocks - 1;
+    size_t max_logged = (journal->block_size - sizeof(struct journal_header))
+                        / sizeof(uint32_t);
+    return capacity < max_logged ? capacity : max_logged;
+}
+
+int journal_replay(struct journal *journal) {
+    if (!journal) {
+        return 0;
+    }
+    struct journal_header *header = journal->header;
+    if (block_read_h(journal->disk, journal->start, header) != 0) {
+        return -1;
+    }
+    if (memcmp(header->signature, JOURNAL_SIGNATURE, 8) != 0 ||
+        header->num_blocks == 0 ||
+        header->num_blocks > journal_capacity(journal)) {
+        return 0;
+    }
+    size_t num_blocks = header->num_blocks;
+    uint8_t *blocks = malloc(num_blocks * journal->block_size);
+    if (!blocks) {
+        return -1;
+    }
+    struct iovec iov = {
+        .iov_base = blocks,
+        .iov_len = num_blocks * journal->block_size
+    };
+    int ret = block_readv_h(journal->disk, journal->start + 1, &iov, 1);
+    if (ret == 0 && checksum(journal, blocks) == header->checksum) {
+        for (size_t i = 0; ret == 0 && i < num_blocks; i++) {
+            ret = block_write_h(journal->disk, header->home[i],
+                                &blocks[i * journal->block_size]);
+        }
+        journal->in_use = 1;
+        if (ret == 0 && (block_disk_sync_h(journal->disk) != 0 ||
+                         journal_clear(journal) != 0)) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = num_blocks;
+        }
+    }
+    free(blocks);
+    return ret;
+}
+
+int journal_commit(struct journal *journal, const size_t *homes,
+                   const uint8_t *blocks, size_t nblocks) {
+    if (!journal || nblocks > journal_capacity(journal)) {
+        return -1;
+    }
+    struct journal_header *header = journal->header;
+    memset(header, 0, journal->block_size);
+    memcpy(header->signature, JOURNAL_SIGNATURE, 8);
+    header->num_blocks = nblocks;
+    for (size_t i = 0; i < nblocks; i++) {
+        header->home[i] = homes[i];
+    }
+    header->checksum = checksum(journal, blocks);
+    // The data and the previous transaction's blocks must be on disk before
+    // the new transaction replaces the previous one
+    if (block_disk_sync_h(journal->disk) != 0) {
+        return -1;
+    }
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = journal->block_size },
+        { .iov_base = (void *)blocks, .iov_len = nblocks * journal->block_size }
+    };
+    journal->in_use = 1;
+    if (block_writev_h(journal->disk, journal->start, iov, 2) != 0 ||
+        block_disk_sync_h(journal->disk) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < nblocks; i++) {
+        if (block_write_h(journal->disk, homes[i],
+                          &blocks[i * journal->block_size]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int journal_clear(struct journal *journal) {
+    if (!journal || !journal->in_use) {
+        return 0;
+    }
+    struct journal_header *header = journal->header;
+    memset(header, 0, journal->block_size);
+    memcpy(header->signature, JOURNAL_SIGNATURE, 8);
+    if (block_write_h(journal->disk, journal->start, header) != 0) {
+        return -1;
+    }
+    journal->in_use = 0;
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint8_t definition */
+
+#include "disk.h"
+
+/*
+ * Write-ahead journal of metadata blocks, kept in a region of the disk that is
+ * reserved when the disk is formatted. The first block of the region
+ * describes the transaction that follows it: the disk block where each logged
+ * block belongs, and a checksum over the whole transaction. Only the latest
+ * transaction is kept, so it can be replayed any number of times.
+ *
+ * Each mounted file system has its own journal. A NULL journal stands for a
+ * disk without one: every function below accepts it, journal_commit() then
+ * fails and the others do nothing.
+ */
+struct journal;
+
+/**
+ * journal_create - Set up the journal of a disk
+ * @disk: Virtual disk holding the journal
+ * @start: Index of the first block of the journal region
+ * @nblocks: Number of blocks in the journal region
+ *
+ * Return: NULL if @nblocks is below 2 or if the journal cannot be allocated.
+ * Otherwise, the new journal.
+ */
+struct journal *journal_create(disk_t disk, size_t start, size_t nblocks);
+
+/**
+ * journal_destroy - Release a journal
+ * @journal: Journal
+ */
+void journal_destroy(struct journal *journal);
+
+/**
+ * journal_capacity - Get the size of the largest transaction
+ * @journal: Journal
+ *
+ * Return: The number of blocks a transaction can hold, 0 without a journal.
+ */
+size_t journal_capacity(struct journal *journal);
+
+/**
+ * journal_replay - Apply the transaction left in the journal
+ * @journal: Journal
+ *
+ * Copy the blocks of the transaction found in the journal to where they
+ * belong, and empty the journal. A transaction that was not completely written
+ * (bad checksum) is ignored, since none of its blocks were written in place.
+ * Must be called at mount time, before the metadata is read.
+ *
+ * Return: -1 if the journal or the blocks cannot be read or written. Otherwise,
+ * the number of blocks replayed.
+ */
+int journal_replay(struct journal *journal);
+
+/**
+ * journal_commit - Write a set of blocks atomically
+ * @journal: Journal
+ * @homes: Disk block where each block belongs
+ * @blocks: Contents of the @nblocks blocks, one disk block each
+ * @nblocks: Number of blocks, at most journal_capacity()
+ *
+ * Make the earlier writes durable, write the transaction to the journal in one
+ * sequential write and make it durable, then write the blocks in place. After
+ * a crash, the disk holds either all of the blocks or none of them.
+ *
+ * Return: -1 if there is no journal, or if @nblocks is too large, or if the
+ * blocks cannot be written. 0 otherwise.
+ */
+int journal_commit(struct journal *journal, const size_t *homes,
+                   const uint8_t *blocks, size_t nblocks);
+
+/**
+ * journal_clear - Empty the journal
+ * @journal: Journal
+ *
+ * Forget the latest transaction, once its blocks were made durable in place,
+ * so that the disk can be used without replaying the journal. Nothing is
+ * written if the journal is already empty.
+ *
+ * Return: -1 if the journal cannot be written. 0 otherwise.
+ */
+int journal_clear(struct journal *journal);
+
+#endif /* _JOURNAL_H */
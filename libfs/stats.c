@@ -0,0 +1,186 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_SHARDS 16
+#define CACHE_LINE 64
+
+// Log-linear buckets: SUB_COUNT per power of two, and the values below
+// SUB_COUNT counted exactly
+#define SUB_BITS STATS_SUB_BITS
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKETS STATS_HIST_BUCKETS
+
+/* Counters of the threads using one shard */
+struct shard {
+    size_t counters[STATS_COUNTERS];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Counters of a file system */
+struct stats {
+    struct shard shards[STATS_SHARDS];
+    int nops;
+    // Per shard and per operation, a histogram of STATS_HIST_SLOTS counts.
+    // NULL without histograms.
+    uint64_t *hist;
+};
+
+// Shard of the calling thread, handed out round-robin on first use
+static __thread int thread_shard = -1;
+static unsigned next_shard;
+
+static struct shard *my_shard(struct stats *stats) {
+    if (thread_shard < 0) {
+        thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+                       % STATS_SHARDS;
+    }
+    return &stats->shards[thread_shard];
+}
+
+static uint64_t *op_hist(struct stats *stats, int shard, int op) {
+    return &stats->hist[((size_t)shard * stats->nops + op) * STATS_HIST_SLOTS];
+}
+
+static size_t bucket_of(uint64_t ns) {
+    if (ns < SUB_COUNT) {
+        return ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    size_t sub = (ns >> (e - SUB_BITS)) - SUB_COUNT;
+    return (size_t)(e - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+// Largest value counted in a bucket
+static uint64_t bucket_top(size_t bucket) {
+    if (bucket < SUB_COUNT) {
+        return bucket;
+    }
+    int e = bucket / SUB_COUNT + SUB_BITS - 1;
+    uint64_t low = (uint64_t)(SUB_COUNT + bucket % SUB_COUNT) << (e - SUB_BITS);
+    return low + (((uint64_t)1 << (e - SUB_BITS)) - 1);
+}
+
+struct stats *stats_create(int nops, int histograms) {
+    struct stats *stats;
+    if (posix_memalign((void **)&stats, CACHE_LINE, sizeof(*stats)) != 0) {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->nops = nops;
+    if (histograms) {
+        stats->hist = calloc((size_t)STATS_SHARDS * nops * STATS_HIST_SLOTS,
+                             sizeof(uint64_t));
+        if (!stats->hist) {
+            free(stats);
+            return NULL;
+        }
+    }
+    return stats;
+}
+
+void stats_destroy(struct stats *stats) {
+    if (!stats) {
+        return;
+    }
+    free(stats->hist);
+    free(stats);
+}
+
+void stats_add(struct stats *stats, enum stats_counter counter, size_t n) {
+    __atomic_fetch_add(&my_shard(stats)->counters[counter], n,
+                       __ATOMIC_RELAXED);
+}
+
+size_t stats_get(struct stats *stats, enum stats_counter counter) {
+    size_t sum = 0;
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        sum += __atomic_load_n(&stats->shards[i].counters[counter],
+                               __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t stats_start(struct stats *stats) {
+    return stats->hist ? now_ns() : 0;
+}
+
+void stats_record(struct stats *stats, int op, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t ns = now_ns() - start;
+    my_shard(stats);
+    stats_hist_add(op_hist(stats, thread_shard, op), ns);
+}
+
+void stats_latency(struct stats *stats, int op, struct stats_latency *latency) {
+    memset(latency, 0, sizeof(*latency));
+    if (!stats->hist) {
+        return;
+    }
+    uint64_t *sum = calloc(STATS_HIST_SLOTS, sizeof(uint64_t));
+    if (!sum) {
+        return;
+    }
+    for (int s = 0; s < STATS_SHARDS; s++) {
+        stats_hist_merge(sum, op_hist(stats, s, op));
+    }
+    stats_hist_summary(sum, latency);
+    free(sum);
+}
+
+void stats_hist_add(uint64_t *hist, uint64_t ns) {
+    __atomic_fetch_add(&hist[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist[STATS_HIST_SUM], ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist[STATS_HIST_MAX], __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist[STATS_HIST_MAX],
+                                                    &max, ns, 1,
+                                                    __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED)) {
+    }
+}
+
+void stats_hist_merge(uint64_t *dst, const uint64_t *src) {
+    for (size_t b = 0; b < STATS_HIST_MAX; b++) {
+        dst[b] += __atomic_load_n(&src[b], __ATOMIC_RELAXED);
+    }
+    uint64_t max = __atomic_load_n(&src[STATS_HIST_MAX], __ATOMIC_RELAXED);
+    if (max > dst[STATS_HIST_MAX]) {
+        dst[STATS_HIST_MAX] = max;
+    }
+}
+
+void stats_hist_summary(const uint64_t *hist, struct stats_latency *latency) {
+    memset(latency, 0, sizeof(*latency));
+    for (size_t b = 0; b < BUCKETS; b++) {
+        latency->count += hist[b];
+    }
+    if (latency->count == 0) {
+        return;
+    }
+    latency->mean = hist[STATS_HIST_SUM] / latency->count;
+    latency->max = hist[STATS_HIST_MAX];
+    // Walk the buckets once, filling each percentile as its rank is reached
+    static const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *targets[] = { &latency->p50, &latency->p90, &latency->p99,
+                            &latency->p999 };
+    size_t seen = 0;
+    size_t next = 0;
+    for (size_t b = 0; b < BUCKETS && next < 4; b++) {
+        seen += hist[b];
+        while (next < 4 && seen > 0 &&
+               seen >= (size_t)(fractions[next] * latency->count + 0.5)) {
+            uint64_t top = bucket_top(b);
+            *targets[next++] = (top < latency->max) ? top : latency->max;
+        }
+    }
+}
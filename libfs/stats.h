@@ -0,0 +1,136 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
+
+/* Event counters */
+enum stats_counter {
+    STATS_BYTES_COPIED,     // Bytes copied between user buffers and blocks
+    STATS_FAT_STEPS,        // FAT entries followed while walking chains
+    STATS_FIND_FILE,        // Lookups of a name in a name index
+    STATS_COUNTERS
+};
+
+/*
+ * A latency histogram is an array of STATS_HIST_SLOTS counts: one per
+ * log-linear bucket, then the sum and the largest of the latencies added.
+ */
+#define STATS_SUB_BITS 3
+#define STATS_HIST_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_HIST_SUM STATS_HIST_BUCKETS
+#define STATS_HIST_MAX (STATS_HIST_BUCKETS + 1)
+#define STATS_HIST_SLOTS (STATS_HIST_BUCKETS + 2)
+
+/* Latency summary of one operation, in nanoseconds */
+struct stats_latency {
+    size_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+/*
+ * Each mounted file system has its own counters. They are split in shards,
+ * each on its own cache lines, and a thread always adds to the same shard with
+ * relaxed atomics, so that counting scales with the number of threads.
+ *
+ * Latency histograms are optional. They are log-linear: 8 buckets between
+ * each power of two, for a precision of 12.5% over the whole range of 64-bit
+ * nanosecond counts.
+ */
+struct stats;
+
+/**
+ * stats_create - Set up counters
+ * @nops: Number of operations that can be timed
+ * @histograms: Whether to keep latency histograms of the operations
+ *
+ * Return: NULL if the counters cannot be allocated. Otherwise, the new
+ * counters, all zero.
+ */
+struct stats *stats_create(int nops, int histograms);
+
+/**
+ * stats_destroy - Release counters
+ * @stats: Counters
+ */
+void stats_destroy(struct stats *stats);
+
+/**
+ * stats_add - Add to a counter
+ * @stats: Counters
+ * @counter: Counter to add to
+ * @n: Amount to add
+ */
+void stats_add(struct stats *stats, enum stats_counter counter, size_t n);
+
+/**
+ * stats_get - Get a counter
+ * @stats: Counters
+ * @counter: Counter
+ *
+ * Return: The sum of @counter over every shard.
+ */
+size_t stats_get(struct stats *stats, enum stats_counter counter);
+
+/**
+ * stats_start - Start timing an operation
+ * @stats: Counters
+ *
+ * Return: 0 if @stats keeps no histograms. Otherwise, the current time, to be
+ * given to stats_record() when the operation ends.
+ */
+uint64_t stats_start(struct stats *stats);
+
+/**
+ * stats_record - Record the latency of an operation
+ * @stats: Counters
+ * @op: Operation, below the @nops given to stats_create()
+ * @start: Time the operation started, from stats_start()
+ *
+ * Nothing is recorded if @start is 0.
+ */
+void stats_record(struct stats *stats, int op, uint64_t start);
+
+/**
+ * stats_latency - Get the latency summary of an operation
+ * @stats: Counters
+ * @op: Operation
+ * @latency: Summary to be filled in
+ *
+ * The percentiles are rounded up to the upper bound of their bucket. Every
+ * field is 0 if @stats keeps no histograms.
+ */
+void stats_latency(struct stats *stats, int op, struct stats_latency *latency);
+
+/**
+ * stats_hist_add - Add a latency to a histogram
+ * @hist: Histogram of STATS_HIST_SLOTS counts
+ * @ns: Latency
+ *
+ * The counts are updated with relaxed atomics, so threads can share @hist.
+ */
+void stats_hist_add(uint64_t *hist, uint64_t ns);
+
+/**
+ * stats_hist_merge - Add a histogram to another
+ * @dst: Histogram added to
+ * @src: Histogram to add
+ */
+void stats_hist_merge(uint64_t *dst, const uint64_t *src);
+
+/**
+ * stats_hist_summary - Summarize a histogram
+ * @hist: Histogram
+ * @latency: Summary to be filled in
+ *
+ * The percentiles are rounded up to the upper bound of their bucket, but never
+ * above the largest latency.
+ */
+void stats_hist_summary(const uint64_t *hist, struct stats_latency *latency);
+
+#endif /* _STATS_H */